@@ -10,35 +10,89 @@
  *  Declaration of zxfs structures, macros and globals goes here.
  *
  *  On disk layout of zxfs
- *    ___________________________________________________________________________________
- *   |                   |                   |                                           |
- *   | super block       |  inode block      |  Data block                               |
- *   |                   |                   |                                           |
- *   |                   |                   |                                           |
- *   |                   |                   |                                           |
- *   |___________________|___________________|___________________________________________|
- *       /           \     /                  \
- *      /             \   /                    \
- *      ---------------   ___________________________________________________________
- *     | s_magic       | |         |         |         |       |                     |
- *     | s_state       | | inode 1 | inode 2 | inode 3 | ...   | inode ZX_MAX_INODES |
- *     | s_free_inodes | |_________|_________|_________|_______|_____________________|
- *     | s_inode_list[]|                     /     \
- *     | s_free_blocks |                    /       \
- *     | s_block_list[]|                   /         \
- *      ---------------                    -----------  
- *      zx_super_t                        | i_mode    |   
- *                                        | i_atime   |
- *                                        | i_mtime   |
- *                                        | i_ctime   |
- *                                        | i_uid     |
- *                                        | i_gid     |   
- *                                        | i_size    |   
- *                                        | i_blocks  |
- *                                        | i_block[] |
- *                                        | i_pad[]   |
- *                                         -----------
- *                                         zx_inode_t
+ *    _________________________________________________________________________________
+ *   |      |         |        |        |        |               |         |           |
+ *   | skip |  super  | group  | inode  | block  |  inode table  | journal |    Data   |
+ *   |      |  block  | table  | bitmap | bitmap |               |         |   blocks  |
+ *   |______|_________|________|________|________|_______________|_________|___________|
+ *             /   \                               /             \
+ *            /     \                             /               \
+ *      ----------------   ___________________________________________________________
+ *     | s_magic        | |         |         |         |       |                     |
+ *     | s_state        | | inode 0 | inode 1 | inode 2 | ...   | inode s_inodes - 1  |
+ *     | s_free_inodes  | |_________|_________|_________|_______|_____________________|
+ *     | s_free_blocks  |                    /     \
+ *     | s_inodes_count |                   /       \
+ *     | s_blocks_count |                  /         \
+ *     | s_imap_start   |                  -----------
+ *     | s_imap_blocks  |                 | i_mode    |
+ *     | s_bmap_start   |                 | i_atime   |
+ *     | s_bmap_blocks  |                 | i_mtime   |
+ *     | s_inode_start  |                 | i_ctime   |
+ *     | s_inode_blocks |                 | i_uid     |
+ *     | s_data_start   |                 | i_gid     |
+ *     | s_checksum     |                 | i_size    |
+ *     | s_jnl_start    |                 | i_blocks  |
+ *     | s_jnl_blocks   |                 | i_xblock  |
+ *     | s_log_bsize    |                 | i_extent[]|
+ *     | s_itable_unused|                 | i_nextents|
+ *     | s_gdt_start    |                 | i_flags   |
+ *     | s_gdt_blocks   |                 | i_dxroot  |
+ *     | s_ag_inodes    |                 | i_checksum|
+ *     | s_ag_blocks    |                  -----------
+ *      ----------------                   zx_inode_t
+ *      zx_super_t
+ *
+ *  Block size is chosen by mkzx, ZX_MIN_BLOCK_SIZE to
+ *  ZX_MAX_BLOCK_SIZE in powers of two, and kept in s_log_bsize. All
+ *  block numbers are in units of it, sizes that depend on it take it
+ *  as argument (ZX_DIR_PER_BLOCK(bs) ...). Super block sits at byte
+ *  ZX_SUPER_OFFSET whatever the block size, group table (or inode
+ *  bitmap when there is none) starts with the first block past it
+ *  (ZX_SUPER_END(bs)).
+ *
+ *  Number of inodes and data blocks is chosen by mkzx. Inode and
+ *  block bitmaps take as many blocks as needed, one bit per inode
+ *  (data block), bit n lives in byte n / 8 at bit position n % 8.
+ *
+ *  Inodes and data blocks are split into allocation groups, group g
+ *  owns inodes from g * s_ag_inodes and data blocks from
+ *  g * s_ag_blocks on, with their bits in both bitmaps and their
+ *  slots in the inode table. s_ag_inodes is a whole number of inode
+ *  table blocks and s_ag_blocks a multiple of 8, so no two groups
+ *  share a byte of bitmap or a block of inode table. Group table has
+ *  a zx_group_t per group with its free counts. A file system without
+ *  group table (s_gdt_blocks 0) is one group.
+ *
+ *  mkzx can leave the inode table uninitialized: last
+ *  gd_itable_unused blocks of a group's part of it were never written
+ *  and hold no inode in use (s_itable_unused of whole table when
+ *  there is no group table). They are cleared one by one as inode
+ *  allocation reaches them.
+ *
+ *  File data is mapped by extents (start block, length) in file
+ *  order. First ZX_INODE_EXTENTS live in inode, rest in one overflow
+ *  extent block pointed to by i_xblock.
+ *
+ *  A regular file of up to ZX_INLINE_MAX bytes keeps its data in the
+ *  inode itself (i_pad) and has no extents, i_flags tells with
+ *  ZX_INODE_INLINE. It moves to a data block once it grows past that.
+ *
+ *  A large directory can carry a hash index (i_dxroot). Dirents stay
+ *  in their linear slots, index only tells which slot holds a name,
+ *  so a directory without index is laid out exactly the same.
+ *
+ *  Super block, inodes and directory blocks carry a CRC32C of their
+ *  contents, see zx_crc32c() in libzx. Last dirent of a directory
+ *  block is never used for a name, its d_inode holds the checksum.
+ *
+ *  Metadata updates go to the journal first, a circular log of whole
+ *  block images behind the inode table. Each transaction is one or
+ *  more descriptor blocks, each followed by the blocks it lists, and
+ *  a commit block holding CRC32C of all of them. Blocks are written
+ *  to their home location only after their transaction is committed.
+ *  Mount replays committed transactions from j_head on. A journal of
+ *  0 blocks (s_jnl_blocks) means metadata is written in place.
  *
  */
 
@@ -50,18 +104,17 @@
 #include <linux/types.h>
 #include <linux/kernel.h>
 
-#define ZX_BLOCK_SIZE       512
-#define ZX_MAGIC_NUMBER     0x2E40f500 
-#define ZX_MAX_INODES       64
+#define ZX_MIN_BLOCK_SIZE   512
+#define ZX_MAX_BLOCK_SIZE   4096
+#define ZX_DEF_BLOCK_SIZE   512
+#define ZX_MAGIC_NUMBER     0x2E40f501
+#define ZX_DEF_INODES       64
+#define ZX_BLOCKS_PER_INODE 4
 #define ZX_MAX_LINKS        3
-#define ZX_MAX_BLOCKS       576
-#define ZX_DIRECT_BLOCKS    9
-#define ZX_BLOCK_LIST_SIZE  18
-#define ZX_INODE_PADDING    2
+#define ZX_INODE_EXTENTS    3
 #define ZX_SKIP_BLOCKS      4
-#define ZX_SUPER_START      ZX_SKIP_BLOCKS
-#define ZX_INODE_START      ZX_SUPER_START + 1
-#define ZX_DATA_START       14
+#define ZX_SUPER_OFFSET     (ZX_SKIP_BLOCKS * ZX_MIN_BLOCK_SIZE)    /* bytes */
+#define ZX_SUPER_END(bs)    ((ZX_SUPER_OFFSET + ZX_MIN_BLOCK_SIZE + (bs) - 1) / (bs))
 #define ZX_VALID_FS         0
 #define ZX_ERROR_FS         1
 #define ZX_ROOT_UID         0
@@ -69,21 +122,53 @@
 #define ZX_ROOT_INODE       0
 #define ZX_ROOT_INIT_BLKS   1
 #define ZX_ROOT_INIT_LNKS   2
+#define ZX_SUPER_RESERVED   10
 
 /*
  * The zxfs superblock : 128 byte
  */
-typedef struct zx_super_block {                 /*  1024    bits */
+typedef struct zx_super_block {
     __le32   s_magic;
     __le32   s_state;
     __le32   s_free_inodes;
-    __le64   s_inode_list;                       /*  64      bits */
     __le32   s_free_blocks;
-    __le32   s_block_list[ZX_BLOCK_LIST_SIZE];   /*  576     bits */
+    __le32   s_inodes_count;                    /* inodes in inode table */
+    __le32   s_blocks_count;                    /* data blocks */
+    __le32   s_imap_start;                      /* inode bitmap */
+    __le32   s_imap_blocks;
+    __le32   s_bmap_start;                      /* block bitmap */
+    __le32   s_bmap_blocks;
+    __le32   s_inode_start;                     /* inode table */
+    __le32   s_inode_blocks;
+    __le32   s_data_start;                      /* first data block */
+    __le32   s_checksum;                        /* CRC32C, this field as 0 */
+    __le32   s_jnl_start;                       /* journal */
+    __le32   s_jnl_blocks;                      /* 0 if none */
+    __le32   s_log_bsize;                       /* ZX_MIN_BLOCK_SIZE << this */
+    __le32   s_itable_unused;                   /* inode table blocks never written */
+    __le32   s_gdt_start;                       /* group table */
+    __le32   s_gdt_blocks;                      /* 0 if none */
+    __le32   s_ag_inodes;                       /* inodes per allocation group */
+    __le32   s_ag_blocks;                       /* data blocks per allocation group */
+    __le32   s_reserved[ZX_SUPER_RESERVED];
 } zx_super_t;
 
 #define ZX_SUPER_SIZE   sizeof(zx_super_t)
-#define ZX_SUPER_BLOCKS (ZX_SUPER_SIZE % ZX_BLOCK_SIZE)
+#define ZX_BITS_PER_BLOCK(bs)   ((bs) * 8)
+
+/*
+ * Allocation group descriptor, group table is an array of them
+ */
+typedef struct zx_group {
+    __le32   gd_free_inodes;
+    __le32   gd_free_blocks;
+    __le32   gd_itable_unused;                  /* inode table blocks never written */
+    __le32   gd_checksum;                       /* CRC32C seeded with group */
+} zx_group_t;
+
+#define ZX_GROUP_SIZE           sizeof(zx_group_t)
+#define ZX_GROUP_PER_BLOCK(bs)  ((bs) / ZX_GROUP_SIZE)
+#define ZX_DEF_AG_BLOCKS(bs)    ZX_BITS_PER_BLOCK(bs)   /* one bitmap block a group */
 
 typedef struct zx_super_inmem {
     struct buffer_head *sbh;
@@ -99,7 +184,24 @@ typedef struct zx_super_inmem {
 #endif
 } zx_super_inmem_t;
 /*
- *  The zxfs inode : 64 byte
+ * Extent : len blocks starting at device block start
+ */
+typedef struct zx_extent {
+    __le32   e_start;
+    __le32   e_len;
+} zx_extent_t;
+
+#define ZX_EXTENT_SIZE      sizeof(zx_extent_t)
+#define ZX_XBLOCK_EXTENTS(bs)   ((bs) / ZX_EXTENT_SIZE)
+#define ZX_MAX_EXTENTS(bs)      (ZX_INODE_EXTENTS + ZX_XBLOCK_EXTENTS(bs))
+
+#define ZX_INODE_PADDING    60
+
+#define ZX_INODE_INLINE     0x0001      /* data in i_pad, no extents */
+#define ZX_INLINE_MAX       ZX_INODE_PADDING
+
+/*
+ *  The zxfs inode : 128 byte
  */
 typedef struct zx_inode {               /* |links|FileTyp|user |group|world| */
     __le16   i_mode;                     /* [ | | | | | | |r|w|x|r|w|x|r|w|x] */
@@ -109,17 +211,20 @@ typedef struct zx_inode {               /* |links|FileTyp|user |group|world| */
     __le32   i_ctime;
     __le16   i_uid;
     __le16   i_gid;
-    __le16   i_size;
-    __le16   i_blocks;
-    __le32   i_block[ZX_DIRECT_BLOCKS];
-    __le16   i_pad[ZX_INODE_PADDING];
+    __le32   i_size;
+    __le32   i_blocks;                   /* data blocks mapped */
+    __le32   i_xblock;                   /* overflow extent block or 0 */
+    zx_extent_t i_extent[ZX_INODE_EXTENTS];
+    __le16   i_nextents;
+    __le16   i_flags;
+    __le32   i_dxroot;                   /* directory index root or 0 */
+    __le32   i_checksum;                 /* CRC32C seeded with ino */
+    __u8     i_pad[ZX_INODE_PADDING];    /* inline data */
 } zx_inode_t;
 
 #define ZX_INODE_SIZE   sizeof(zx_inode_t)
-#define ZX_INODE_LIST_BLOCKS ((ZX_MAX_INODES * ZX_INODE_SIZE) / ZX_BLOCK_SIZE)
 
-#define ZX_INODE_PER_BLOCK (ZX_BLOCK_SIZE / ZX_INODE_SIZE)
-#define ZX_SEEK_BLOCKS  (ZX_MAX_BLOCKS + ZX_SUPER_BLOCKS + ZX_INODE_LIST_BLOCKS +ZX_SKIP_BLOCKS + 1)
+#define ZX_INODE_PER_BLOCK(bs)  ((bs) / ZX_INODE_SIZE)
 
 #define SET_BIT(bits, pos) bits ^= ((long) 1 << pos)
 #define IFSET(bits, pos)   (bits & (1 << pos))
@@ -134,17 +239,90 @@ typedef struct zx_inode {               /* |links|FileTyp|user |group|world| */
 #define SET_USER_W(mode)  SET_BIT(mode, 7)
 #define SET_USER_R(mode)  SET_BIT(mode, 8)
 
-#define ZX_MAX_NAME         31
+#define ZX_MAX_NAME         28
 /*
  * Directory entry
  */
 typedef struct zx_dirent {
-    __u8    d_inode;
+    __le32  d_inode;
     char    d_name[ZX_MAX_NAME];
 } zx_dirent_t;
 
 #define ZX_DIR_SIZE sizeof(zx_dirent_t)
+#define ZX_DIR_PER_BLOCK(bs)    ((bs) / ZX_DIR_SIZE)
+#define ZX_DIR_TAIL(bs)         (ZX_DIR_PER_BLOCK(bs) - 1)      /* checksum slot */
+
+/*
+ * Directory hash index
+ *
+ * Root block lists (1 << dx_order) table blocks. Table is an open
+ * addressing hash of name to dirent slot, each entry holds high bits
+ * of name hash (tag) above ZX_DX_SLOT_BITS and slot + 2 below them.
+ * Free dirents of an indexed directory are chained through d_inode
+ * (next free slot + 1), dx_free is head of chain.
+ */
+#define ZX_DX_MAGIC         0x2E40d1c5
+#define ZX_DX_MAX_ORDER     6
+#define ZX_DX_MAX_BLOCKS    (1 << ZX_DX_MAX_ORDER)
+#define ZX_DX_ENTRIES(bs)   ((bs) / sizeof(__le32))
+#define ZX_DX_SLOT_BITS     20
+#define ZX_DX_EMPTY         0
+#define ZX_DX_DELETED       1
+
+typedef struct zx_dx_root {
+    __le32  dx_magic;
+    __le32  dx_order;
+    __le32  dx_count;                   /* live entries */
+    __le32  dx_deleted;                 /* deleted entries */
+    __le32  dx_free;                    /* first free slot + 1 or 0 */
+    __le32  dx_block[ZX_DX_MAX_BLOCKS];
+} zx_dx_root_t;
+
+/*
+ * Journal
+ *
+ * First journal block holds zx_jsuper_t, the rest is the log. j_head
+ * is log block (1 .. j_blocks - 1) of oldest transaction that may
+ * not be at home yet, j_seq its sequence number. Transactions follow
+ * each other with sequence numbers going up by one, recovery stops
+ * at the first block that does not continue this chain.
+ */
+#define ZX_JNL_MAGIC        0x2E40a10c
+#define ZX_JDESC_MAGIC      0x2E40a1d5
+#define ZX_JCOMMIT_MAGIC    0x2E40a1c0
+#define ZX_JNL_BLOCKS       1024        /* default, at most 1/16 of device */
+#define ZX_JNL_MIN          64
+#define ZX_JNL_OP_BLOCKS    16          /* an op changes besides bitmap, group table, index */
+
+typedef struct zx_jsuper {
+    __le32  j_magic;
+    __le32  j_blocks;                   /* including this one */
+    __le32  j_head;
+    __le32  j_seq;
+    __le32  j_checksum;
+} zx_jsuper_t;
+
+/*
+ * Descriptor, jd_count home block numbers of the blocks following it,
+ * then jd_revoke blocks whose copies in older transactions must not
+ * be replayed (they were freed)
+ */
+#define ZX_JDESC_TAGS(bs)   (((bs) - 12) / sizeof(__le32))
+
+typedef struct zx_jdesc {
+    __le32  jd_magic;
+    __le32  jd_seq;
+    __le16  jd_count;
+    __le16  jd_revoke;
+    __le32  jd_tag[];                   /* ZX_JDESC_TAGS(block size) */
+} zx_jdesc_t;
 
+typedef struct zx_jcommit {
+    __le32  jc_magic;
+    __le32  jc_seq;
+    __le32  jc_blocks;                  /* log blocks before this one */
+    __le32  jc_checksum;                /* CRC32C of them, seeded with seq */
+} zx_jcommit_t;
 
 extern struct address_space_operations  zx_aops;
 extern struct inode_operations  zx_file_iops;
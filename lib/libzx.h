@@ -0,0 +1,441 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  lib/libzx.h
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  libzx - user space zxfs engine.
+ *
+ *  libzx works directly on a block device or an image file holding
+ *  zxfs, no kernel module or mount is needed. The API mirrors the
+ *  POSIX calls it stands in for: calls return -1 and set errno on
+ *  failure, file descriptors are small integers local to a zx_fs_t.
+ *
+ *  All calls on one zx_fs_t are serialized by the fs lock, so a
+ *  zx_fs_t can be shared between threads.
+ *
+ */
+
+#ifndef LIBZX_H
+#define LIBZX_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include "../fs/zxfs.h"
+
+#define ZX_MAX_FILES        256     /* open descriptors per zx_fs_t */
+
+/*
+ * Raw device access, shared by the engine and the utilities.
+ */
+typedef struct zx_dev {
+    int     fd;
+    off_t   size;                   /* bytes, 0 if unknown */
+} zx_dev_t;
+
+extern int  zx_dev_open(zx_dev_t *dev, const char *path, int flags);
+extern void zx_dev_close(zx_dev_t *dev);
+extern int  zx_dev_pread(zx_dev_t *dev, void *buf, size_t len, off_t off);
+extern int  zx_dev_pwrite(zx_dev_t *dev, const void *buf, size_t len, off_t off);
+extern int  zx_dev_pwritev(zx_dev_t *dev, struct iovec *iov, int cnt, off_t off);
+extern int  zx_dev_discard(zx_dev_t *dev, off_t off, off_t len);
+extern int  zx_dev_readahead(zx_dev_t *dev, off_t off, off_t len);
+
+/*
+ * Host endian copy of layout fields of zx_super_t
+ */
+typedef struct zx_geom {
+    __u32   g_bsize;                /* bytes */
+    __u32   g_inodes;
+    __u32   g_blocks;
+    __u32   g_imap_start;
+    __u32   g_imap_blocks;
+    __u32   g_bmap_start;
+    __u32   g_bmap_blocks;
+    __u32   g_inode_start;
+    __u32   g_inode_blocks;
+    __u32   g_jnl_start;
+    __u32   g_jnl_blocks;
+    __u32   g_data_start;
+    __u32   g_itable_unused;        /* inode table blocks, from the end */
+    __u32   g_gdt_start;
+    __u32   g_gdt_blocks;           /* 0 if no group table */
+    __u32   g_groups;
+    __u32   g_ag_inodes;            /* per group */
+    __u32   g_ag_blocks;
+} zx_geom_t;
+
+extern int  zx_geom_bshift(__u32 bsize);
+extern int  zx_geom_make(zx_geom_t *g, __u32 bsize, __u64 dev_blocks, __u32 inodes,
+                         __u32 jnl, __u32 ag_blocks);
+extern void zx_geom_load(zx_geom_t *g, const zx_super_t *sb);
+extern void zx_geom_store(const zx_geom_t *g, zx_super_t *sb);
+extern int  zx_geom_check(const zx_geom_t *g, off_t dev_size);
+extern __u32 zx_geom_ag_inodes(const zx_geom_t *g, __u32 ag, __u32 *first);
+extern __u32 zx_geom_ag_blocks(const zx_geom_t *g, __u32 ag, __u32 *first);
+
+/*
+ * Read only mapping of whole zxfs image, used by dbzx. When super
+ * block is not valid whole device is mapped and geo is all zero, so
+ * only raw blocks can be looked at.
+ */
+typedef struct zx_map {
+    zx_dev_t    dev;
+    char        *base;
+    size_t      len;
+    zx_geom_t   geo;
+    zx_super_t  *sb;
+    zx_group_t  *gdt;               /* group table, NULL if none */
+    __u8        *imap;              /* inode bitmap */
+    __u8        *bmap;              /* block bitmap */
+    zx_inode_t  *itab;              /* geo.g_inodes entries */
+} zx_map_t;
+
+extern int  zx_map_open(zx_map_t *m, const char *path);
+extern void zx_map_close(zx_map_t *m);
+extern zx_inode_t * zx_map_inode(zx_map_t *m, __u32 ino);
+extern void * zx_map_block(zx_map_t *m, __u32 bno);
+extern zx_extent_t * zx_map_extent(zx_map_t *m, zx_inode_t *in, __u32 i);
+
+#define zx_test_bit(map, n) (((map)[(n) >> 3] >> ((n) & 7)) & 1)
+
+/*
+ * In core inode or block bitmap with cached count of clear bits
+ */
+typedef struct zx_bitmap {
+    __u8    *bm_map;                /* whole bitmap blocks */
+    __u32   bm_nbits;
+    __u32   bm_free;
+    __u32   bm_next;                /* search rotor, bit after last set */
+} zx_bitmap_t;
+
+extern __u32 zx_bm_count(const __u8 *map, __u32 nbits);
+extern void  zx_bm_init(zx_bitmap_t *bm, __u8 *map, __u32 nbits);
+extern __u32 zx_bm_used(const zx_bitmap_t *bm, __u32 from, __u32 to);
+extern __u32 zx_bm_find(const zx_bitmap_t *bm, __u32 from, __u32 to);
+extern __u32 zx_bm_run(const zx_bitmap_t *bm, __u32 goal, __u32 want, __u32 *len);
+extern void  zx_bm_set(zx_bitmap_t *bm, __u32 n, __u32 len);
+extern void  zx_bm_clear(zx_bitmap_t *bm, __u32 n, __u32 len);
+
+/*
+ * CRC32C of on disk metadata, checksum field itself counts as zero
+ */
+extern __u32 zx_crc32c(__u32 crc, const void *buf, size_t len);
+extern __u32 zx_super_csum(const zx_super_t *sb);
+extern __u32 zx_inode_csum(const zx_inode_t *in, __u32 ino);
+extern __u32 zx_dir_csum(const zx_dirent_t *de, __u32 ino, __u32 bsize);
+extern __u32 zx_group_csum(const zx_group_t *gd, __u32 ag);
+extern __u32 zx_jsuper_csum(const zx_jsuper_t *js);
+
+/*
+ * Write back cache of metadata blocks, see zx_cache.c
+ */
+#define ZX_CACHE_SIZE       (2 * 1024 * 1024)   /* bytes of buffers per mount */
+
+#define ZX_BUF_VALID        1
+#define ZX_BUF_DIRTY        2
+#define ZX_BUF_REF          4       /* CLOCK reference bit */
+
+typedef struct zx_buf {
+    __u32           b_bno;
+    __u32           b_flags;
+    __u32           b_seq;          /* transaction of dirty contents */
+    __u32           b_lseq;         /* last logged, not yet at home */
+    struct zx_buf   *b_hnext;       /* hash chain */
+    char            *b_data;
+} zx_buf_t;
+
+typedef struct zx_cache_stat {
+    __u64   cs_hits;
+    __u64   cs_misses;
+    __u64   cs_evictions;
+    __u64   cs_writeback;           /* dirty blocks written */
+    __u64   cs_writes;              /* write back I/Os */
+} zx_cache_stat_t;
+
+typedef struct zx_cache {
+    zx_dev_t        *c_dev;
+    __u32           c_bsize;
+    int             c_wthru;
+    __u32           c_nbufs;
+    __u32           c_hand;
+    __u32           c_ndirty;
+    __u32           c_hmask;
+    __u32           c_seq;          /* running transaction, 0 if none */
+    __u32           c_durable;      /* last committed transaction */
+    __u32           c_txblocks;     /* buffers in running transaction */
+    zx_buf_t        **c_hash;
+    zx_buf_t        *c_bufs;
+    zx_buf_t        **c_sort;       /* scratch for flush */
+    char            *c_mem;
+    zx_cache_stat_t c_stat;
+} zx_cache_t;
+
+extern int  zx_cache_init(zx_cache_t *c, zx_dev_t *dev, __u32 bsize, __u32 nbufs, int wthru);
+extern void zx_cache_destroy(zx_cache_t *c);
+extern int  zx_cache_read(zx_cache_t *c, void *buf, size_t len, off_t off);
+extern int  zx_cache_write(zx_cache_t *c, const void *buf, size_t len, off_t off);
+extern void zx_cache_forget(zx_cache_t *c, __u32 bno, __u32 len);
+extern int  zx_cache_flush(zx_cache_t *c);
+extern __u32 zx_cache_tx(zx_cache_t *c, __u32 seq, zx_buf_t **v);
+extern __u32 zx_cache_horizon(zx_cache_t *c);
+
+/*
+ * In core inode, on disk copy plus whole extent list decoded
+ */
+typedef struct zx_run {
+    __u32   r_start;
+    __u32   r_len;
+} zx_run_t;
+
+typedef struct zx_inode_info {
+    __u32       ii_ino;
+    int         ii_xdirty;              /* extents in i_xblock changed */
+    __u32       ii_nrun;
+    zx_inode_t  ii_raw;
+    zx_run_t    ii_run[ZX_MAX_EXTENTS(ZX_MAX_BLOCK_SIZE)];
+} zx_inode_info_t;
+
+#define ZX_II_DIRTY         1       /* newer than inode table */
+#define ZX_II_TIMES         2       /* only timestamps are newer */
+#define ZX_II_TLIST         4       /* on timestamp list */
+
+/*
+ * Inode as kept in the inode cache. Runs past the ones in the inode
+ * itself are allocated apart, only for inodes with an overflow
+ * extent block.
+ */
+typedef struct zx_icache_ent {
+    __u32                   ie_ino;
+    __u32                   ie_nrun;
+    __u32                   ie_flags;
+    struct zx_icache_ent    *ie_hnext;      /* hash chain */
+    struct zx_icache_ent    *ie_prev;       /* LRU, most recent first */
+    struct zx_icache_ent    *ie_next;
+    struct zx_icache_ent    *ie_dnext;      /* dirty list */
+    struct zx_icache_ent    *ie_tnext;      /* timestamp list */
+    zx_run_t                *ie_xrun;       /* runs from ZX_INODE_EXTENTS on or NULL */
+    zx_inode_t              ie_raw;
+    zx_run_t                ie_run[ZX_INODE_EXTENTS];
+} zx_icache_ent_t;
+
+/*
+ * Inode cache, see zx_icache.c
+ */
+#define ZX_ICACHE_INODES    65536   /* inodes cached per mount */
+#define ZX_LAZY_INTERVAL    60      /* seconds a timestamp change may wait */
+
+typedef struct zx_icache_stat {
+    __u64   is_hits;
+    __u64   is_misses;
+    __u64   is_reclaims;
+    __u64   is_writeback;           /* dirty inodes written */
+    __u64   is_writes;              /* inode table blocks written */
+    __u64   is_lazy;                /* timestamp changes kept in core */
+} zx_icache_stat_t;
+
+typedef struct zx_icache {
+    __u32               ic_max;
+    __u32               ic_count;       /* carved from arena so far */
+    __u32               ic_ndirty;
+    __u32               ic_ntimes;      /* ZX_II_TIMES inodes */
+    __u32               ic_ntlist;      /* on timestamp list */
+    time_t              ic_tstart;      /* oldest timestamp change */
+    __u32               ic_hmask;
+    zx_icache_ent_t     **ic_hash;
+    zx_icache_ent_t     *ic_head;       /* LRU */
+    zx_icache_ent_t     *ic_tail;
+    zx_icache_ent_t     *ic_free;
+    zx_icache_ent_t     *ic_dirty;
+    zx_icache_ent_t     *ic_times;
+    zx_icache_ent_t     **ic_sort;      /* scratch for write back */
+    char                **ic_arena;     /* chunks inodes are carved from */
+    __u32               ic_narena;
+    zx_icache_stat_t    ic_stat;
+} zx_icache_t;
+
+extern int  zx_icache_init(zx_icache_t *ic, __u32 max);
+extern void zx_icache_destroy(zx_icache_t *ic);
+extern zx_icache_ent_t *zx_icache_get(zx_icache_t *ic, __u32 ino, int *fresh);
+extern void zx_icache_put(zx_icache_t *ic, zx_icache_ent_t *ie);
+extern void zx_icache_load(zx_inode_info_t *ii, const zx_icache_ent_t *ie);
+extern int  zx_icache_store(zx_icache_ent_t *ie, const zx_inode_info_t *ii);
+extern void zx_icache_dirty(zx_icache_t *ic, zx_icache_ent_t *ie);
+extern void zx_icache_times(zx_icache_t *ic, zx_icache_ent_t *ie);
+extern void zx_icache_expire(zx_icache_t *ic, __u32 max);
+extern __u32 zx_icache_sorted(zx_icache_t *ic);
+extern void zx_icache_clean(zx_icache_t *ic);
+
+/*
+ * Metadata journal, see zx_journal.c
+ */
+#define ZX_JNL_INTERVAL     5       /* seconds a change may wait for commit */
+
+typedef struct zx_jtx {
+    __u32   t_seq;
+    __u32   t_pos;                  /* first log block */
+    __u32   t_len;
+} zx_jtx_t;
+
+typedef struct zx_jnl_stat {
+    __u64   js_commits;
+    __u64   js_blocks;              /* log blocks written */
+    __u64   js_revokes;
+    __u64   js_waits;               /* waits for a commit of another op */
+    __u64   js_checkpoints;
+} zx_jnl_stat_t;
+
+typedef struct zx_journal {
+    zx_dev_t        *j_dev;
+    zx_cache_t      *j_cache;
+    pthread_mutex_t *j_lock;        /* fs lock */
+    pthread_cond_t  j_cond;         /* commit done */
+    __u32           j_bsize;
+    __u32           j_start;        /* device block of journal super */
+    __u32           j_blocks;       /* 0 if no journal */
+    __u32           j_log;          /* log blocks, j_blocks - 1 */
+    __u32           j_head;         /* as on disk */
+    __u32           j_tail;         /* log block after last transaction */
+    __u32           j_used;
+    __u32           j_limit;        /* commit running transaction at this size */
+    int             j_busy;         /* commit in progress */
+    int             j_error;        /* errno of failed commit */
+    time_t          j_tstart;       /* first change of running transaction */
+    zx_jtx_t        *j_tx;          /* ring of transactions in log */
+    __u32           j_txfirst;
+    __u32           j_ntx;
+    __u32           *j_revoke;      /* revoked in running transaction */
+    __u32           j_nrevoke;
+    __u32           j_maxrevoke;
+    __u32           *j_hbno;        /* logged block -> transaction */
+    __u32           *j_hseq;
+    __u32           j_hmask;
+    __u32           j_hcount;
+    zx_buf_t        **j_vec;
+    char            *j_buf;         /* transaction being committed */
+    zx_jnl_stat_t   j_stat;
+} zx_journal_t;
+
+extern int  zx_jrecover(zx_dev_t *dev, const zx_geom_t *g, int check);
+extern int  zx_jopen(zx_journal_t *j, zx_dev_t *dev, zx_cache_t *c,
+                     const zx_geom_t *g, pthread_mutex_t *lock);
+extern void zx_jclose(zx_journal_t *j);
+extern int  zx_jrevoke(zx_journal_t *j, __u32 bno, __u32 len);
+extern int  zx_jcommit(zx_journal_t *j, int hold);
+extern int  zx_jcheckpoint(zx_journal_t *j);
+extern int  zx_jend(zx_journal_t *j, int sync);
+
+/*
+ * Open file description
+ */
+typedef struct zx_file {
+    int     f_used;
+    int     f_flags;
+    __u32   f_ino;
+    off_t   f_pos;
+    off_t   f_ra_next;              /* where a sequential read goes on */
+    off_t   f_ra_end;               /* read ahead up to here */
+    size_t  f_ra_win;               /* bytes, 0 if not sequential */
+} zx_file_t;
+
+/*
+ * In core allocation group, rotors count from first inode (data
+ * block) of the group. Guarded by the fs lock like the rest of a
+ * mount, groups have no lock of their own.
+ */
+typedef struct zx_ag {
+    __u32   ag_free_inodes;
+    __u32   ag_free_blocks;
+    __u32   ag_itable_unused;
+    __u32   ag_inext;               /* inode search rotor */
+    __u32   ag_bnext;               /* block search rotor */
+} zx_ag_t;
+
+/*
+ * Data blocks freed by a transaction that is not on disk yet, bits
+ * count from first data block
+ */
+typedef struct zx_bfreed {
+    __u32   bf_seq;                 /* transaction that freed them */
+    __u32   bf_start;
+    __u32   bf_len;
+} zx_bfreed_t;
+
+/*
+ * Mounted zxfs instance
+ */
+typedef struct zx_fs {
+    zx_dev_t        dev;
+    int             flags;
+    zx_super_t      sb;             /* in core copy of super block */
+    zx_geom_t       geo;
+    zx_bitmap_t     imap;           /* in core inode bitmap */
+    zx_bitmap_t     bmap;           /* in core block bitmap */
+    zx_ag_t         *ag;            /* geo.g_groups allocation groups */
+    __u32           ag_next;        /* next home group to deal out */
+    zx_bfreed_t     *bfreed;        /* free on disk, still set in bmap */
+    __u32           nbfreed;
+    __u32           maxbfreed;
+    __u32           bfreed_blocks;
+    zx_cache_t      cache;          /* metadata blocks */
+    zx_icache_t     icache;         /* decoded inodes */
+    zx_journal_t    journal;
+    pthread_mutex_t lock;
+    zx_file_t       files[ZX_MAX_FILES];
+} zx_fs_t;
+
+/*
+ * Attributes returned by zx_stat()
+ */
+typedef struct zx_stat {
+    __u32   zs_ino;
+    __u16   zs_mode;
+    __u16   zs_links;
+    __u16   zs_uid;
+    __u16   zs_gid;
+    __u32   zs_size;
+    __u32   zs_blocks;
+    time_t  zs_atime;
+    time_t  zs_mtime;
+    time_t  zs_ctime;
+} zx_stat_t;
+
+/*
+ * zx_mount() flags besides O_RDONLY / O_RDWR and O_SYNC. By default
+ * atime is relative (see zx_atime_due()) and timestamps are lazy.
+ */
+#define ZX_NOLAZYTIME       0x10000000  /* timestamps go out like other changes */
+#define ZX_STRICTATIME      0x20000000  /* atime on every read */
+#define ZX_NOATIME          0x40000000  /* atime is never updated */
+
+extern zx_fs_t * zx_mount(const char *dev, int flags);
+extern int zx_umount(zx_fs_t *fs);
+extern int zx_sync(zx_fs_t *fs);
+extern int zx_freeze(zx_fs_t *fs);
+extern void zx_thaw(zx_fs_t *fs);
+extern int zx_fsync(zx_fs_t *fs, int fd);
+extern void zx_cachestat(zx_fs_t *fs, zx_cache_stat_t *cs);
+extern void zx_icachestat(zx_fs_t *fs, zx_icache_stat_t *is);
+extern int zx_jnlstat(zx_fs_t *fs, zx_jnl_stat_t *js);
+
+extern int zx_open(zx_fs_t *fs, const char *path, int flags, mode_t mode);
+extern int zx_close(zx_fs_t *fs, int fd);
+extern ssize_t zx_read(zx_fs_t *fs, int fd, void *buf, size_t count);
+extern ssize_t zx_write(zx_fs_t *fs, int fd, const void *buf, size_t count);
+extern ssize_t zx_pread(zx_fs_t *fs, int fd, void *buf, size_t count, off_t off);
+extern ssize_t zx_pwrite(zx_fs_t *fs, int fd, const void *buf, size_t count, off_t off);
+extern off_t zx_lseek(zx_fs_t *fs, int fd, off_t off, int whence);
+extern int zx_ftruncate(zx_fs_t *fs, int fd, off_t len);
+extern int zx_truncate(zx_fs_t *fs, const char *path, off_t len);
+extern int zx_stat(zx_fs_t *fs, const char *path, zx_stat_t *st);
+extern int zx_fstat(zx_fs_t *fs, int fd, zx_stat_t *st);
+extern int zx_mkdir(zx_fs_t *fs, const char *path, mode_t mode);
+extern int zx_rmdir(zx_fs_t *fs, const char *path);
+extern int zx_unlink(zx_fs_t *fs, const char *path);
+extern int zx_readdir(zx_fs_t *fs, int fd, zx_dirent_t *de);
+
+#endif /* LIBZX_H */
@@ -0,0 +1,207 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  lib/zx_bitmap.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Inode and block bitmaps.
+ *
+ *  Bit n lives in byte n / 8 at bit n % 8, so byte order of a 64 bit
+ *  little endian load matches bit order and bitmaps are scanned a
+ *  word at a time: a full word is skipped in one compare, first clear
+ *  (or set) bit of a word is one count trailing zeros. Bitmaps are
+ *  whole blocks long, so every word read is within the buffer; bits
+ *  past bm_nbits read as set.
+ *
+ *  Nothing here does I/O, callers write back what they changed.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+#include <endian.h>
+#include "libzx.h"
+
+#define ZX_BM_SCAN  (1U << 16)      /* bits looked at for a full run */
+
+static __u64
+zx_bm_word(const __u8 *map, __u64 w)
+{
+    __u64 v;
+
+    memcpy(&v, map + (w << 3), sizeof(v));
+    return le64toh(v);
+}
+
+/*
+ * Word w with bits past nbits forced set
+ */
+static __u64
+zx_bm_get(const zx_bitmap_t *bm, __u64 w)
+{
+    __u64 v = zx_bm_word(bm->bm_map, w);
+    __u64 end = (w + 1) << 6;
+
+    if (end > bm->bm_nbits) {
+        v |= ~0ULL << (bm->bm_nbits & 63);
+    }
+    return v;
+}
+
+/*
+ * First bit in [from, to) equal to val, to if there is none
+ */
+static __u32
+zx_bm_scan(const zx_bitmap_t *bm, __u32 from, __u32 to, int val)
+{
+    __u64 n, w;
+
+    for (n = from; n < to; n = (n | 63) + 1) {
+        w = zx_bm_get(bm, n >> 6);
+        if (!val) {
+            w = ~w;
+        }
+        w &= ~0ULL << (n & 63);
+        if (w != 0) {
+            n = (n & ~63ULL) + __builtin_ctzll(w);
+            return (n < to) ? n : to;
+        }
+    }
+    return to;
+}
+
+/*
+ * Number of set bits in first nbits of map
+ */
+__u32
+zx_bm_count(const __u8 *map, __u32 nbits)
+{
+    __u64 w, nw = nbits >> 6;
+    __u32 n = 0;
+
+    for (w = 0; w < nw; w++) {
+        n += __builtin_popcountll(zx_bm_word(map, w));
+    }
+    if (nbits & 63) {
+        n += __builtin_popcountll(zx_bm_word(map, nw) & ~(~0ULL << (nbits & 63)));
+    }
+    return n;
+}
+
+/*
+ * Number of set bits in [from, to)
+ */
+__u32
+zx_bm_used(const zx_bitmap_t *bm, __u32 from, __u32 to)
+{
+    __u64 n, w, end;
+    __u32 cnt = 0;
+
+    for (n = from; n < to; n = end) {
+        end = (n | 63) + 1;
+        w = zx_bm_word(bm->bm_map, n >> 6) & (~0ULL << (n & 63));
+        if (to < end) {
+            w &= ~(~0ULL << (to & 63));
+        }
+        cnt += __builtin_popcountll(w);
+    }
+    return cnt;
+}
+
+void
+zx_bm_init(zx_bitmap_t *bm, __u8 *map, __u32 nbits)
+{
+    bm->bm_map = map;
+    bm->bm_nbits = nbits;
+    bm->bm_free = nbits - zx_bm_count(map, nbits);
+    bm->bm_next = 0;
+}
+
+/*
+ * First clear bit in [from, to), to if there is none
+ */
+__u32
+zx_bm_find(const zx_bitmap_t *bm, __u32 from, __u32 to)
+{
+    if (to > bm->bm_nbits) {
+        to = bm->bm_nbits;
+    }
+    return zx_bm_scan(bm, from, to, 0);
+}
+
+/*
+ * Find want clear bits in a row, as close after goal as possible,
+ * wrapping around at the end. A run starting right at goal is taken
+ * whatever its length, so callers extend in place first. Otherwise
+ * first full length run wins; when none turns up within ZX_BM_SCAN
+ * bits the longest one seen is returned. Returns first bit of run
+ * and its length in *len, *len is 0 when bitmap is full.
+ */
+__u32
+zx_bm_run(const zx_bitmap_t *bm, __u32 goal, __u32 want, __u32 *len)
+{
+    __u32 lo, hi, s, e, pass, best = 0, bestlen = 0;
+    __u64 seen = 0;
+
+    if (goal >= bm->bm_nbits) {
+        goal = 0;
+    }
+    for (pass = 0; pass < 2; pass++) {
+        lo = pass ? 0 : goal;
+        hi = pass ? goal : bm->bm_nbits;
+        for (s = lo; s < hi; s = e) {
+            if ((s = zx_bm_scan(bm, s, hi, 0)) >= hi) {
+                break;
+            }
+            e = zx_bm_scan(bm, s, (hi - s > want) ? s + want : hi, 1);
+            if (e - s >= want || (pass == 0 && s == goal)) {
+                *len = e - s;
+                return s;
+            }
+            if (e - s > bestlen) {
+                best = s;
+                bestlen = e - s;
+            }
+            seen += e - lo;
+            if (seen > ZX_BM_SCAN && bestlen > 0) {
+                *len = bestlen;
+                return best;
+            }
+            lo = e;
+        }
+    }
+
+    *len = bestlen;
+    return best;
+}
+
+/*
+ * Mark len bits from n used, search rotor moves past them
+ */
+void
+zx_bm_set(zx_bitmap_t *bm, __u32 n, __u32 len)
+{
+    __u32 i;
+
+    for (i = n; i < n + len; i++) {
+        bm->bm_map[i >> 3] |= (1 << (i & 7));
+    }
+    bm->bm_free -= len;
+    bm->bm_next = (n + len < bm->bm_nbits) ? n + len : 0;
+}
+
+void
+zx_bm_clear(zx_bitmap_t *bm, __u32 n, __u32 len)
+{
+    __u32 i;
+
+    for (i = n; i < n + len; i++) {
+        bm->bm_map[i >> 3] &= ~(1 << (i & 7));
+    }
+    bm->bm_free += len;
+}
@@ -0,0 +1,349 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  lib/zx_cache.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Write back cache of metadata blocks.
+ *
+ *  A fixed set of block buffers is allocated at mount. Buffers are
+ *  found through a hash of block number and replaced in CLOCK order:
+ *  every access sets a buffer's reference bit, the hand clears bits
+ *  as it sweeps and takes the first buffer found without one.
+ *
+ *  Writes only dirty the buffer. Dirty buffers go out together, in
+ *  block order with runs of adjacent blocks merged into one write,
+ *  when the hand reaches a dirty victim, when too many are dirty and
+ *  on zx_cache_flush(). A cache opened write through (O_SYNC mount)
+ *  writes every change to the device right away.
+ *
+ *  With a journal, each dirty buffer carries the transaction that
+ *  last changed it and stays pinned until that transaction is
+ *  committed (b_seq > c_durable), so nothing reaches its home block
+ *  ahead of the log.
+ *
+ *  Callers serialize, the cache has no lock of its own.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "libzx.h"
+
+#define ZX_CACHE_IOV    256         /* blocks per write back I/O */
+
+#define ZX_BUF_OFF(c, bno)  ((off_t) (bno) * (c)->c_bsize)
+
+#define zx_buf_pinned(c, b) \
+    (((b)->b_flags & ZX_BUF_DIRTY) && (b)->b_seq > (c)->c_durable)
+
+static zx_buf_t **
+zx_cache_bucket(zx_cache_t *c, __u32 bno)
+{
+    return &c->c_hash[(bno ^ (bno >> 12)) & c->c_hmask];
+}
+
+static zx_buf_t *
+zx_cache_lookup(zx_cache_t *c, __u32 bno)
+{
+    zx_buf_t *b;
+
+    for (b = *zx_cache_bucket(c, bno); b != NULL; b = b->b_hnext) {
+        if (b->b_bno == bno) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void
+zx_cache_unhash(zx_cache_t *c, zx_buf_t *b)
+{
+    zx_buf_t **pp;
+
+    for (pp = zx_cache_bucket(c, b->b_bno); *pp != NULL; pp = &(*pp)->b_hnext) {
+        if (*pp == b) {
+            *pp = b->b_hnext;
+            break;
+        }
+    }
+    if (b->b_flags & ZX_BUF_DIRTY) {
+        c->c_ndirty--;
+    }
+    b->b_flags = 0;
+}
+
+int
+zx_cache_init(zx_cache_t *c, zx_dev_t *dev, __u32 bsize, __u32 nbufs, int wthru)
+{
+    __u32 i, n;
+
+    memset(c, 0, sizeof(zx_cache_t));
+    for (n = 1; n < nbufs; n <<= 1)
+        ;
+    c->c_dev = dev;
+    c->c_bsize = bsize;
+    c->c_wthru = wthru;
+    c->c_nbufs = nbufs;
+    c->c_hmask = n - 1;
+    c->c_hash = (zx_buf_t **) calloc(n, sizeof(zx_buf_t *));
+    c->c_bufs = (zx_buf_t *) calloc(nbufs, sizeof(zx_buf_t));
+    c->c_sort = (zx_buf_t **) malloc(nbufs * sizeof(zx_buf_t *));
+    if (c->c_hash == NULL || c->c_bufs == NULL || c->c_sort == NULL ||
+        posix_memalign((void **) &c->c_mem, 4096, (size_t) nbufs * c->c_bsize) != 0) {
+        zx_cache_destroy(c);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < nbufs; i++) {
+        c->c_bufs[i].b_data = c->c_mem + ((size_t) i * c->c_bsize);
+    }
+
+    return 0;
+}
+
+/*
+ * Release everything, dirty buffers are lost, flush first
+ */
+void
+zx_cache_destroy(zx_cache_t *c)
+{
+    free(c->c_hash);
+    free(c->c_bufs);
+    free(c->c_sort);
+    free(c->c_mem);
+    c->c_hash = NULL;
+    c->c_bufs = NULL;
+    c->c_sort = NULL;
+    c->c_mem = NULL;
+}
+
+static int
+zx_buf_cmp(const void *a, const void *b)
+{
+    const zx_buf_t *x = *(const zx_buf_t **) a;
+    const zx_buf_t *y = *(const zx_buf_t **) b;
+
+    return (x->b_bno < y->b_bno) ? -1 : (x->b_bno > y->b_bno);
+}
+
+/*
+ * Write back all dirty buffers that are not pinned in block order,
+ * one I/O per run of adjacent blocks
+ */
+int
+zx_cache_flush(zx_cache_t *c)
+{
+    struct iovec iov[ZX_CACHE_IOV];
+    __u32 i, j, k, n = 0;
+
+    if (c->c_ndirty == 0) {
+        return 0;
+    }
+    for (i = 0; i < c->c_nbufs; i++) {
+        if ((c->c_bufs[i].b_flags & ZX_BUF_DIRTY) && !zx_buf_pinned(c, &c->c_bufs[i])) {
+            c->c_sort[n++] = &c->c_bufs[i];
+        }
+    }
+    qsort(c->c_sort, n, sizeof(zx_buf_t *), zx_buf_cmp);
+
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && j - i < ZX_CACHE_IOV &&
+             c->c_sort[j]->b_bno == c->c_sort[j - 1]->b_bno + 1; j++)
+            ;
+        for (k = i; k < j; k++) {
+            iov[k - i].iov_base = c->c_sort[k]->b_data;
+            iov[k - i].iov_len = c->c_bsize;
+        }
+        if (zx_dev_pwritev(c->c_dev, iov, j - i, ZX_BUF_OFF(c, c->c_sort[i]->b_bno)) == -1) {
+            return -1;
+        }
+        for (k = i; k < j; k++) {
+            c->c_sort[k]->b_flags &= ~ZX_BUF_DIRTY;
+            c->c_sort[k]->b_lseq = 0;
+        }
+        c->c_ndirty -= j - i;
+        c->c_stat.cs_writeback += j - i;
+        c->c_stat.cs_writes++;
+    }
+
+    return 0;
+}
+
+/*
+ * Buffer for block bno, read from device unless whole block is
+ * about to be overwritten
+ */
+static zx_buf_t *
+zx_cache_get(zx_cache_t *c, __u32 bno, int fill)
+{
+    zx_buf_t *b, **pp;
+    __u32 sweep = 0;
+
+    if ((b = zx_cache_lookup(c, bno)) != NULL) {
+        c->c_stat.cs_hits++;
+        b->b_flags |= ZX_BUF_REF;
+        return b;
+    }
+    c->c_stat.cs_misses++;
+
+    for (;;) {
+        b = &c->c_bufs[c->c_hand];
+        c->c_hand = (c->c_hand + 1 == c->c_nbufs) ? 0 : c->c_hand + 1;
+        if (!(b->b_flags & ZX_BUF_VALID)) {
+            break;
+        }
+        if (++sweep > 2 * c->c_nbufs) {
+            errno = ENOBUFS;            /* everything pinned */
+            return NULL;
+        }
+        if (b->b_flags & ZX_BUF_REF) {
+            b->b_flags &= ~ZX_BUF_REF;
+            continue;
+        }
+        if (zx_buf_pinned(c, b)) {
+            continue;
+        }
+        if ((b->b_flags & ZX_BUF_DIRTY) && zx_cache_flush(c) == -1) {
+            return NULL;
+        }
+        zx_cache_unhash(c, b);
+        c->c_stat.cs_evictions++;
+        break;
+    }
+
+    if (fill && zx_dev_pread(c->c_dev, b->b_data, c->c_bsize, ZX_BUF_OFF(c, bno)) == -1) {
+        return NULL;
+    }
+    b->b_bno = bno;
+    b->b_flags = ZX_BUF_VALID | ZX_BUF_REF;
+    b->b_seq = 0;
+    b->b_lseq = 0;
+    pp = zx_cache_bucket(c, bno);
+    b->b_hnext = *pp;
+    *pp = b;
+
+    return b;
+}
+
+int
+zx_cache_read(zx_cache_t *c, void *buf, size_t len, off_t off)
+{
+    zx_buf_t *b;
+    size_t n, boff;
+    char *p = (char *) buf;
+
+    while (len > 0) {
+        boff = off % c->c_bsize;
+        n = (len < c->c_bsize - boff) ? len : c->c_bsize - boff;
+        if ((b = zx_cache_get(c, off / c->c_bsize, 1)) == NULL) {
+            return -1;
+        }
+        memcpy(p, b->b_data + boff, n);
+        p += n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int
+zx_cache_write(zx_cache_t *c, const void *buf, size_t len, off_t off)
+{
+    zx_buf_t *b;
+    size_t n, boff;
+    const char *p = (const char *) buf;
+
+    if (c->c_wthru && zx_dev_pwrite(c->c_dev, buf, len, off) == -1) {
+        return -1;
+    }
+    while (len > 0) {
+        boff = off % c->c_bsize;
+        n = (len < c->c_bsize - boff) ? len : c->c_bsize - boff;
+        if ((b = zx_cache_get(c, off / c->c_bsize, n != c->c_bsize)) == NULL) {
+            return -1;
+        }
+        memcpy(b->b_data + boff, p, n);
+        if (!c->c_wthru && !(b->b_flags & ZX_BUF_DIRTY)) {
+            b->b_flags |= ZX_BUF_DIRTY;
+            c->c_ndirty++;
+        }
+        if (c->c_seq != 0 && b->b_seq != c->c_seq) {
+            b->b_seq = c->c_seq;
+            c->c_txblocks++;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+
+    /*
+     * Keep at least a quarter of the cache clean so that eviction
+     * rarely has to wait for a write back
+     */
+    if (c->c_ndirty > c->c_nbufs - c->c_nbufs / 4) {
+        return zx_cache_flush(c);
+    }
+    return 0;
+}
+
+/*
+ * Drop blocks [bno, bno + len) without writing them back, they were
+ * freed and may come back as file data that bypasses the cache
+ */
+void
+zx_cache_forget(zx_cache_t *c, __u32 bno, __u32 len)
+{
+    zx_buf_t *b;
+    __u32 i;
+
+    for (i = 0; i < len; i++) {
+        if ((b = zx_cache_lookup(c, bno + i)) != NULL) {
+            zx_cache_unhash(c, b);
+        }
+    }
+}
+
+/*
+ * Dirty buffers of transaction seq in block order, they stay pinned
+ * until the caller moves c_durable past seq
+ */
+__u32
+zx_cache_tx(zx_cache_t *c, __u32 seq, zx_buf_t **v)
+{
+    __u32 i, n = 0;
+
+    for (i = 0; i < c->c_nbufs; i++) {
+        if ((c->c_bufs[i].b_flags & ZX_BUF_DIRTY) && c->c_bufs[i].b_seq == seq) {
+            v[n++] = &c->c_bufs[i];
+        }
+    }
+    qsort(v, n, sizeof(zx_buf_t *), zx_buf_cmp);
+
+    return n;
+}
+
+/*
+ * Oldest transaction whose copy of some block is still needed in the
+ * log, 0 if the log holds nothing that is not at home
+ */
+__u32
+zx_cache_horizon(zx_cache_t *c)
+{
+    __u32 i, h = 0;
+
+    for (i = 0; i < c->c_nbufs; i++) {
+        if ((c->c_bufs[i].b_flags & ZX_BUF_DIRTY) && c->c_bufs[i].b_lseq != 0 &&
+            (h == 0 || c->c_bufs[i].b_lseq < h)) {
+            h = c->c_bufs[i].b_lseq;
+        }
+    }
+
+    return h;
+}
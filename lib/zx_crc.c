@@ -0,0 +1,176 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  lib/zx_crc.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  CRC32C (Castagnoli) of zxfs metadata.
+ *
+ *  On x86-64 with SSE4.2 the crc32 instruction does 8 bytes a step,
+ *  everywhere else a slice-by-8 table does the same in software. Both
+ *  give the same value, so images move freely between machines.
+ *
+ */
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include "libzx.h"
+
+#define ZX_CRC_POLY     0x82f63b78      /* reflected Castagnoli */
+
+static __u32 zx_crc_tab[8][256];
+static pthread_once_t zx_crc_once = PTHREAD_ONCE_INIT;
+static int zx_crc_hw = -1;
+
+static void
+zx_crc_init(void)
+{
+    __u32 c;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c >> 1) ^ ((c & 1) ? ZX_CRC_POLY : 0);
+        }
+        zx_crc_tab[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            c = zx_crc_tab[j - 1][i];
+            zx_crc_tab[j][i] = (c >> 8) ^ zx_crc_tab[0][c & 0xff];
+        }
+    }
+}
+
+static __u32
+zx_crc_sw(__u32 crc, const __u8 *p, size_t len)
+{
+    __u64 v;
+
+    pthread_once(&zx_crc_once, zx_crc_init);
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&v, p, 8);
+        v = le64toh(v) ^ crc;
+        crc = zx_crc_tab[7][v & 0xff] ^
+              zx_crc_tab[6][(v >> 8) & 0xff] ^
+              zx_crc_tab[5][(v >> 16) & 0xff] ^
+              zx_crc_tab[4][(v >> 24) & 0xff] ^
+              zx_crc_tab[3][(v >> 32) & 0xff] ^
+              zx_crc_tab[2][(v >> 40) & 0xff] ^
+              zx_crc_tab[1][(v >> 48) & 0xff] ^
+              zx_crc_tab[0][v >> 56];
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ zx_crc_tab[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static __u32
+zx_crc_sse42(__u32 crc, const __u8 *p, size_t len)
+{
+    __u64 c = crc, v;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    crc = (__u32) c;
+    while (len-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+/*
+ * CRC32C of len bytes at buf continuing crc, start with crc 0.
+ * zx_crc32c(zx_crc32c(0, a, n), b, m) is CRC32C of a and b in a row.
+ */
+__u32
+zx_crc32c(__u32 crc, const void *buf, size_t len)
+{
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (zx_crc_hw == -1) {
+        __builtin_cpu_init();
+        zx_crc_hw = __builtin_cpu_supports("sse4.2");
+    }
+    if (zx_crc_hw) {
+        return ~zx_crc_sse42(crc, (const __u8 *) buf, len);
+    }
+#endif
+    return ~zx_crc_sw(crc, (const __u8 *) buf, len);
+}
+
+/*
+ * CRC32C of len bytes at buf with the 4 byte checksum field at off
+ * taken as zero
+ */
+static __u32
+zx_csum(__u32 crc, const void *buf, size_t len, size_t off)
+{
+    static const __u8 zero[4];
+
+    crc = zx_crc32c(crc, buf, off);
+    crc = zx_crc32c(crc, zero, sizeof(zero));
+    return zx_crc32c(crc, (const __u8 *) buf + off + 4, len - off - 4);
+}
+
+__u32
+zx_super_csum(const zx_super_t *sb)
+{
+    return zx_csum(0, sb, ZX_SUPER_SIZE, offsetof(zx_super_t, s_checksum));
+}
+
+/*
+ * Inodes are seeded with their number, an inode written to the wrong
+ * slot does not check out
+ */
+__u32
+zx_inode_csum(const zx_inode_t *in, __u32 ino)
+{
+    __le32 seed = htole32(ino);
+
+    return zx_csum(zx_crc32c(0, &seed, sizeof(seed)), in, ZX_INODE_SIZE,
+                   offsetof(zx_inode_t, i_checksum));
+}
+
+/*
+ * Directory block, seeded with inode number of the directory
+ */
+__u32
+zx_dir_csum(const zx_dirent_t *de, __u32 ino, __u32 bsize)
+{
+    __le32 seed = htole32(ino);
+
+    return zx_csum(zx_crc32c(0, &seed, sizeof(seed)), de, bsize,
+                   ZX_DIR_TAIL(bsize) * ZX_DIR_SIZE + offsetof(zx_dirent_t, d_inode));
+}
+
+/*
+ * Group descriptor, seeded with group number
+ */
+__u32
+zx_group_csum(const zx_group_t *gd, __u32 ag)
+{
+    __le32 seed = htole32(ag);
+
+    return zx_csum(zx_crc32c(0, &seed, sizeof(seed)), gd, ZX_GROUP_SIZE,
+                   offsetof(zx_group_t, gd_checksum));
+}
+
+__u32
+zx_jsuper_csum(const zx_jsuper_t *js)
+{
+    return zx_csum(0, js, sizeof(zx_jsuper_t), offsetof(zx_jsuper_t, j_checksum));
+}
@@ -0,0 +1,186 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  lib/zx_dev.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Raw access to the device (or image file) holding zxfs.
+ *
+ */
+
+#define _GNU_SOURCE                 /* fallocate() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "libzx.h"
+
+/*
+ * Open given path, it can be either a block device or a regular
+ * image file.
+ */
+int
+zx_dev_open(zx_dev_t *dev, const char *path, int flags)
+{
+    struct stat stbuf;
+    __u64 bytes;
+
+    if ((dev->fd = open(path, flags)) == -1) {
+        return -1;
+    }
+
+    if (fstat(dev->fd, &stbuf) == -1) {
+        close(dev->fd);
+        return -1;
+    }
+
+    if (S_ISBLK(stbuf.st_mode)) {
+        if (ioctl(dev->fd, BLKGETSIZE64, &bytes) == -1) {
+            close(dev->fd);
+            return -1;
+        }
+        dev->size = (off_t) bytes;
+    } else if (S_ISREG(stbuf.st_mode)) {
+        dev->size = stbuf.st_size;
+    } else {
+        close(dev->fd);
+        errno = ENOTBLK;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+zx_dev_close(zx_dev_t *dev)
+{
+    if (dev->fd != -1) {
+        close(dev->fd);
+        dev->fd = -1;
+    }
+}
+
+/*
+ * Read exactly len bytes at off, short reads are retried and
+ * reading past the end of device is an error (EIO).
+ */
+int
+zx_dev_pread(zx_dev_t *dev, void *buf, size_t len, off_t off)
+{
+    ssize_t n;
+    char *p = (char *) buf;
+
+    while (len > 0) {
+        if ((n = pread(dev->fd, p, len, off)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int
+zx_dev_pwrite(zx_dev_t *dev, const void *buf, size_t len, off_t off)
+{
+    ssize_t n;
+    const char *p = (const char *) buf;
+
+    while (len > 0) {
+        if ((n = pwrite(dev->fd, p, len, off)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Gather write of cnt buffers at off, iov is used up on the way
+ */
+int
+zx_dev_pwritev(zx_dev_t *dev, struct iovec *iov, int cnt, off_t off)
+{
+    ssize_t n;
+
+    while (cnt > 0) {
+        if ((n = pwritev(dev->fd, iov, cnt, off)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        off += n;
+        while (cnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Tell the device len bytes at off hold nothing worth keeping, a
+ * block device gets a discard and an image file a hole punched in
+ * it. Fails with EOPNOTSUPP (or ENOTTY) where that is not supported.
+ */
+int
+zx_dev_discard(zx_dev_t *dev, off_t off, off_t len)
+{
+    struct stat stbuf;
+    __u64 range[2];
+
+    if (fstat(dev->fd, &stbuf) == -1) {
+        return -1;
+    }
+    if (S_ISBLK(stbuf.st_mode)) {
+        range[0] = off;
+        range[1] = len;
+        return ioctl(dev->fd, BLKDISCARD, range);
+    }
+    return fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+}
+
+/*
+ * Start reading len bytes at off into host page cache without
+ * waiting for them, a later zx_dev_pread() of the range finds them
+ * there. Only a hint, nothing is guaranteed.
+ */
+int
+zx_dev_readahead(zx_dev_t *dev, off_t off, off_t len)
+{
+    if ((errno = posix_fadvise(dev->fd, off, len, POSIX_FADV_WILLNEED)) != 0) {
+        return -1;
+    }
+    return 0;
+}
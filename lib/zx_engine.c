@@ -0,0 +1,2764 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  lib/zx_engine.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  User space implementation of zxfs namespace and data paths.
+ *
+ *  Layout handled here is the one written by mkzx:
+ *    - super block at byte ZX_SUPER_OFFSET, it gives block size,
+ *      place and size of everything else (see zx_geom_t)
+ *    - inode ino at s_inode_start block + (ino * ZX_INODE_SIZE)
+ *    - bit n of block bitmap is data block s_data_start + n
+ *    - file data is mapped by extents of device blocks, in file
+ *      order and without holes, first ZX_INODE_EXTENTS in the inode
+ *      and the rest in block i_xblock; a regular file of up to
+ *      ZX_INLINE_MAX bytes has none and keeps its data in i_pad
+ *    - directory is i_size bytes of zx_dirent_t, a slot with empty
+ *      d_name is free; directories of ZX_DX_MIN_BLOCKS and more get
+ *      a hash index (i_dxroot) on top
+ *    - super block, inodes and directory blocks are checksummed,
+ *      a read that does not check out fails with EIO
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include "libzx.h"
+
+#define TRUE    1
+
+#define ZX_MAX_FILE_SIZE    ((off_t) 0xffffffff)    /* i_size is 32 bit */
+#define ZX_ZERO_SIZE        (64 * 1024)
+#define ZX_ZERO_IOV         16      /* zero buffers per write */
+#define ZX_RA_MIN           (16 * 1024)         /* first read ahead window */
+#define ZX_RA_MAX           (1024 * 1024)
+#define ZX_RELATIME_AGE     (24 * 60 * 60)      /* seconds */
+
+#define ZX_BS(fs)               ((fs)->geo.g_bsize)
+#define ZX_INODE_OFF(fs, ino)   (((off_t) (fs)->geo.g_inode_start * ZX_BS(fs)) + \
+                                 ((off_t) (ino) * ZX_INODE_SIZE))
+#define ZX_BLOCK_OFF(fs, bno)   ((off_t) (bno) * ZX_BS(fs))
+#define ZX_INLINE(ii)           (le16toh((ii)->ii_raw.i_flags) & ZX_INODE_INLINE)
+
+#define ZX_DX_MIN_BLOCKS    4       /* index directories from this size on */
+#define ZX_DX_MAX_SLOTS     ((1U << ZX_DX_SLOT_BITS) - 2)
+#define ZX_DX_NONE          ((__u32) -1)
+#define ZX_DX_TAG(h)        ((h) >> ZX_DX_SLOT_BITS)
+#define ZX_DX_ENT(h, slot)  ((ZX_DX_TAG(h) << ZX_DX_SLOT_BITS) | ((slot) + 2))
+#define ZX_DX_SLOT(e)       (((e) & ((1U << ZX_DX_SLOT_BITS) - 1)) - 2)
+
+/*
+ * Host endian directory index root
+ */
+typedef struct zx_dx {
+    __u32   dx_bno;                     /* root block */
+    __u32   dx_order;
+    __u32   dx_count;
+    __u32   dx_deleted;
+    __u32   dx_free;
+    __u32   dx_block[ZX_DX_MAX_BLOCKS];
+} zx_dx_t;
+
+static const char zx_zero[ZX_ZERO_SIZE];
+
+/*
+ * Super block and bitmaps
+ */
+static int
+zx_sb_write(zx_fs_t *fs)
+{
+    fs->sb.s_checksum = htole32(zx_super_csum(&fs->sb));
+    return zx_cache_write(&fs->cache, &fs->sb, ZX_SUPER_SIZE,
+                          ZX_SUPER_OFFSET);
+}
+
+/*
+ * Write back bitmap blocks holding bits [n, n + len). Blocks waiting
+ * in fs->bfreed are set in core only, on disk they are free.
+ */
+static int
+zx_bm_write(zx_fs_t *fs, zx_bitmap_t *bm, __u32 start, __u32 n, __u32 len)
+{
+    __u32 bpb = ZX_BITS_PER_BLOCK(ZX_BS(fs));
+    __u32 first = n / bpb, last = (n + len - 1) / bpb;
+    __u8 blk[ZX_MAX_BLOCK_SIZE];
+    zx_bfreed_t *f;
+    __u32 i, k, s, e;
+
+    if (bm != &fs->bmap || fs->nbfreed == 0) {
+        return zx_cache_write(&fs->cache, bm->bm_map + ((size_t) first * ZX_BS(fs)),
+                              (size_t) (last - first + 1) * ZX_BS(fs),
+                              ((off_t) start + first) * ZX_BS(fs));
+    }
+
+    for (i = first; i <= last; i++) {
+        memcpy(blk, bm->bm_map + ((size_t) i * ZX_BS(fs)), ZX_BS(fs));
+        for (k = 0; k < fs->nbfreed; k++) {
+            f = &fs->bfreed[k];
+            if (f->bf_start >= (i + 1) * bpb || f->bf_start + f->bf_len <= i * bpb) {
+                continue;
+            }
+            s = (f->bf_start > i * bpb) ? f->bf_start - i * bpb : 0;
+            e = (f->bf_start + f->bf_len < (i + 1) * bpb) ? f->bf_start + f->bf_len - i * bpb : bpb;
+            for (; s < e; s++) {
+                blk[s >> 3] &= ~(1 << (s & 7));
+            }
+        }
+        if (zx_cache_write(&fs->cache, blk, ZX_BS(fs), ((off_t) start + i) * ZX_BS(fs)) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+zx_inode_used(zx_fs_t *fs, __u32 ino)
+{
+    return zx_test_bit(fs->imap.bm_map, ino);
+}
+
+/*
+ * Allocation groups
+ */
+#define ZX_AG_OF(fs, ino)   ((ino) / (fs)->geo.g_ag_inodes)
+
+/*
+ * Write back descriptor of group ag. Without group table only
+ * s_itable_unused of the one group is kept, in the super block the
+ * caller writes.
+ */
+static int
+zx_ag_write(zx_fs_t *fs, __u32 ag)
+{
+    zx_group_t gd;
+
+    if (fs->geo.g_gdt_blocks == 0) {
+        fs->sb.s_itable_unused = htole32(fs->ag[ag].ag_itable_unused);
+        return 0;
+    }
+    gd.gd_free_inodes = htole32(fs->ag[ag].ag_free_inodes);
+    gd.gd_free_blocks = htole32(fs->ag[ag].ag_free_blocks);
+    gd.gd_itable_unused = htole32(fs->ag[ag].ag_itable_unused);
+    gd.gd_checksum = htole32(zx_group_csum(&gd, ag));
+    return zx_cache_write(&fs->cache, &gd, ZX_GROUP_SIZE,
+                          ZX_BLOCK_OFF(fs, fs->geo.g_gdt_start) + ((off_t) ag * ZX_GROUP_SIZE));
+}
+
+/*
+ * Count len data blocks from b as taken (or given back) in the
+ * groups they fall in
+ */
+static int
+zx_ag_blocks(zx_fs_t *fs, __u32 b, __u32 len, int used)
+{
+    __u32 ag, n;
+
+    for (; len > 0; b += n, len -= n) {
+        ag = b / fs->geo.g_ag_blocks;
+        n = ((__u64) ag + 1) * fs->geo.g_ag_blocks - b;
+        if (n > len) {
+            n = len;
+        }
+        if (used) {
+            fs->ag[ag].ag_free_blocks -= n;
+        } else {
+            fs->ag[ag].ag_free_blocks += n;
+        }
+        if (zx_ag_write(fs, ag) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Group new directories of the calling thread go to. Threads are
+ * dealt groups of fs in turn on first use, so trees made by different
+ * threads land in different bitmap and inode table blocks. Only the
+ * home in the last fs used is kept, a thread moving to another fs is
+ * dealt a new one there.
+ */
+static __u32
+zx_ag_home(zx_fs_t *fs)
+{
+    static __thread zx_fs_t *home_fs;
+    static __thread __u32 home;
+
+    if (home_fs != fs) {
+        home_fs = fs;
+        home = fs->ag_next++;
+    }
+    return home % fs->geo.g_groups;
+}
+
+/*
+ * Device block a file without blocks starts looking from, the rotor
+ * of its inode's group
+ */
+static __u32
+zx_ag_goal(zx_fs_t *fs, __u32 ino)
+{
+    __u32 ag = ZX_AG_OF(fs, ino);
+
+    return fs->geo.g_data_start + (ag * fs->geo.g_ag_blocks) + fs->ag[ag].ag_bnext;
+}
+
+/*
+ * Clear inode table blocks mkzx left unwritten in the group of ino,
+ * up to the one holding it. Allocation moves up from the group rotor
+ * so this is mostly one block.
+ */
+static int
+zx_itable_init(zx_fs_t *fs, __u32 ino)
+{
+    __u32 ipb = ZX_INODE_PER_BLOCK(ZX_BS(fs));
+    zx_ag_t *ag = &fs->ag[ZX_AG_OF(fs, ino)];
+    __u32 first, n, next;
+
+    n = zx_geom_ag_inodes(&fs->geo, ZX_AG_OF(fs, ino), &first);
+    while ((next = (n + ipb - 1) / ipb - ag->ag_itable_unused) <= (ino - first) / ipb) {
+        if (zx_cache_write(&fs->cache, zx_zero, ZX_BS(fs),
+                           ZX_BLOCK_OFF(fs, fs->geo.g_inode_start + (first / ipb) + next)) == -1) {
+            return -1;
+        }
+        ag->ag_itable_unused--;
+    }
+
+    return 0;
+}
+
+/*
+ * Take a free inode from group ag, or from the groups after it when
+ * it is full. Within a group inode numbers are handed out round robin
+ * from its rotor, so a create does not rescan all the inodes in use
+ * below it.
+ */
+static int
+zx_ialloc(zx_fs_t *fs, __u32 ag, __u32 *ino)
+{
+    zx_bitmap_t *bm = &fs->imap;
+    zx_ag_t *a;
+    __u32 i, n, first, cnt;
+
+    for (n = 0; ; n++, ag = (ag + 1 == fs->geo.g_groups) ? 0 : ag + 1) {
+        if (n == fs->geo.g_groups) {
+            errno = ENOSPC;
+            return -1;
+        }
+        a = &fs->ag[ag];
+        cnt = zx_geom_ag_inodes(&fs->geo, ag, &first);
+        if (a->ag_free_inodes > 0 &&
+            ((i = zx_bm_find(bm, first + a->ag_inext, first + cnt)) < first + cnt ||
+             (i = zx_bm_find(bm, first, first + a->ag_inext)) < first + a->ag_inext)) {
+            break;
+        }
+    }
+
+    if (zx_itable_init(fs, i) == -1) {
+        return -1;
+    }
+    zx_bm_set(bm, i, 1);
+    if (zx_bm_write(fs, bm, fs->geo.g_imap_start, i, 1) == -1) {
+        return -1;
+    }
+    a->ag_free_inodes--;
+    a->ag_inext = (i + 1 - first < cnt) ? i + 1 - first : 0;
+    if (zx_ag_write(fs, ag) == -1) {
+        return -1;
+    }
+    fs->sb.s_free_inodes = htole32(bm->bm_free);
+    *ino = i;
+
+    return zx_sb_write(fs);
+}
+
+static int
+zx_ifree(zx_fs_t *fs, __u32 ino)
+{
+    zx_bm_clear(&fs->imap, ino, 1);
+    if (zx_bm_write(fs, &fs->imap, fs->geo.g_imap_start, ino, 1) == -1) {
+        return -1;
+    }
+    fs->ag[ZX_AG_OF(fs, ino)].ag_free_inodes++;
+    if (zx_ag_write(fs, ZX_AG_OF(fs, ino)) == -1) {
+        return -1;
+    }
+    fs->sb.s_free_inodes = htole32(fs->imap.bm_free);
+
+    return zx_sb_write(fs);
+}
+
+/*
+ * Hand blocks freed by committed transactions to the allocator
+ */
+static void
+zx_bfreed_put(zx_fs_t *fs)
+{
+    zx_bfreed_t *f;
+    __u32 i, k;
+
+    for (i = 0, k = 0; i < fs->nbfreed; i++) {
+        f = &fs->bfreed[i];
+        if (f->bf_seq <= fs->cache.c_durable) {
+            zx_bm_clear(&fs->bmap, f->bf_start, f->bf_len);
+            fs->bfreed_blocks -= f->bf_len;
+        } else {
+            fs->bfreed[k++] = *f;
+        }
+    }
+    fs->nbfreed = k;
+}
+
+/*
+ * Allocate up to want contiguous data blocks, right at goal (device
+ * block number) when that is free so a file keeps growing in place,
+ * otherwise in the first long enough free run after it. With no goal
+ * search starts where last allocation ended. The group the run ends
+ * in picks up from there next time. *bno / *len tell what was got.
+ * Blocks are not cleared, see zx_zero_range().
+ */
+static int
+zx_balloc(zx_fs_t *fs, __u32 goal, __u32 want, __u32 *bno, __u32 *len)
+{
+    zx_bitmap_t *bm = &fs->bmap;
+    __u32 b = 0, ag, g = bm->bm_next;
+
+    if (goal >= fs->geo.g_data_start &&
+        goal - fs->geo.g_data_start < fs->geo.g_blocks) {
+        g = goal - fs->geo.g_data_start;
+    }
+    zx_bfreed_put(fs);
+    *len = 0;
+    if (bm->bm_free > 0) {
+        b = zx_bm_run(bm, g, want, len);
+    }
+    if (*len == 0) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    zx_bm_set(bm, b, *len);
+    if (zx_bm_write(fs, bm, fs->geo.g_bmap_start, b, *len) == -1 ||
+        zx_ag_blocks(fs, b, *len, 1) == -1) {
+        return -1;
+    }
+    ag = (b + *len - 1) / fs->geo.g_ag_blocks;
+    fs->ag[ag].ag_bnext = b + *len - (ag * fs->geo.g_ag_blocks);
+    fs->sb.s_free_blocks = htole32(bm->bm_free + fs->bfreed_blocks);
+    *bno = fs->geo.g_data_start + b;
+
+    return zx_sb_write(fs);
+}
+
+/*
+ * Blocks go back free on disk in the running transaction but stay
+ * set in core until it is committed. File data is not journaled,
+ * handed out any earlier a crash could leave the old owner pointing
+ * at data of the new one.
+ */
+static int
+zx_bfree(zx_fs_t *fs, __u32 bno, __u32 len)
+{
+    __u32 b = bno - fs->geo.g_data_start;
+    zx_bfreed_t *f;
+
+    if (fs->journal.j_blocks == 0) {
+        zx_bm_clear(&fs->bmap, b, len);
+    } else {
+        if (fs->nbfreed == fs->maxbfreed) {
+            fs->maxbfreed = fs->maxbfreed ? 2 * fs->maxbfreed : 64;
+            if ((f = (zx_bfreed_t *) realloc(fs->bfreed, fs->maxbfreed * sizeof(zx_bfreed_t))) == NULL) {
+                fs->maxbfreed = fs->nbfreed;
+                errno = ENOMEM;
+                return -1;
+            }
+            fs->bfreed = f;
+        }
+        fs->bfreed[fs->nbfreed++] = (zx_bfreed_t) { fs->cache.c_seq, b, len };
+        fs->bfreed_blocks += len;
+    }
+    zx_cache_forget(&fs->cache, bno, len);
+    if (zx_jrevoke(&fs->journal, bno, len) == -1 ||
+        zx_bm_write(fs, &fs->bmap, fs->geo.g_bmap_start, b, len) == -1 ||
+        zx_ag_blocks(fs, b, len, 0) == -1) {
+        return -1;
+    }
+    fs->sb.s_free_blocks = htole32(fs->bmap.bm_free + fs->bfreed_blocks);
+
+    return zx_sb_write(fs);
+}
+
+/*
+ * Inodes
+ */
+/*
+ * Decode inode ino from inode table
+ */
+static int
+zx_idecode(zx_fs_t *fs, __u32 ino, zx_inode_info_t *ii)
+{
+    zx_extent_t xb[ZX_XBLOCK_EXTENTS(ZX_MAX_BLOCK_SIZE)];
+    zx_extent_t *ex = ii->ii_raw.i_extent;
+    __u32 i;
+
+    if (zx_cache_read(&fs->cache, &ii->ii_raw, ZX_INODE_SIZE, ZX_INODE_OFF(fs, ino)) == -1) {
+        return -1;
+    }
+    ii->ii_ino = ino;
+    ii->ii_xdirty = 0;
+    ii->ii_nrun = le16toh(ii->ii_raw.i_nextents);
+    if (le32toh(ii->ii_raw.i_checksum) != zx_inode_csum(&ii->ii_raw, ino) ||
+        ii->ii_nrun > ZX_MAX_EXTENTS(ZX_BS(fs)) ||
+        (ZX_INLINE(ii) && (ii->ii_nrun != 0 || le32toh(ii->ii_raw.i_size) > ZX_INLINE_MAX))) {
+        errno = EIO;
+        return -1;
+    }
+
+    for (i = 0; i < ii->ii_nrun; i++) {
+        if (i == ZX_INODE_EXTENTS) {
+            if (zx_cache_read(&fs->cache, xb, ZX_BS(fs),
+                              ZX_BLOCK_OFF(fs, le32toh(ii->ii_raw.i_xblock))) == -1) {
+                return -1;
+            }
+            ex = xb - ZX_INODE_EXTENTS;
+        }
+        ii->ii_run[i].r_start = le32toh(ex[i].e_start);
+        ii->ii_run[i].r_len = le32toh(ex[i].e_len);
+    }
+
+    return 0;
+}
+
+/*
+ * Copy of inode ino, decoded once and kept in inode cache
+ */
+static int
+zx_iread(zx_fs_t *fs, __u32 ino, zx_inode_info_t *ii)
+{
+    zx_icache_ent_t *ie;
+    int fresh;
+
+    if ((ie = zx_icache_get(&fs->icache, ino, &fresh)) == NULL) {
+        return -1;
+    }
+    if (fresh) {
+        if (zx_idecode(fs, ino, ii) == -1 || zx_icache_store(ie, ii) == -1) {
+            zx_icache_put(&fs->icache, ie);
+            return -1;
+        }
+        return 0;
+    }
+    zx_icache_load(ii, ie);
+
+    return 0;
+}
+
+/*
+ * Write inode back, and its overflow extent block when that changed.
+ * Overflow block is allocated or released here as extent count
+ * crosses ZX_INODE_EXTENTS.
+ */
+static int
+zx_iwrite(zx_fs_t *fs, zx_inode_info_t *ii)
+{
+    zx_extent_t xb[ZX_XBLOCK_EXTENTS(ZX_MAX_BLOCK_SIZE)];
+    zx_inode_t *raw = &ii->ii_raw;
+    zx_extent_t *ex = raw->i_extent;
+    zx_icache_ent_t *ie;
+    __u32 i, len, xbno = le32toh(raw->i_xblock);
+    int fresh;
+
+    if (ii->ii_nrun <= ZX_INODE_EXTENTS && xbno != 0) {
+        if (zx_bfree(fs, xbno, 1) == -1) {
+            return -1;
+        }
+        xbno = 0;
+    } else if (ii->ii_nrun > ZX_INODE_EXTENTS && xbno == 0) {
+        if (zx_balloc(fs, ii->ii_run[ZX_INODE_EXTENTS - 1].r_start, 1, &xbno, &len) == -1) {
+            return -1;
+        }
+        ii->ii_xdirty = 1;
+    }
+    raw->i_xblock = htole32(xbno);
+    raw->i_nextents = htole16(ii->ii_nrun);
+
+    memset(raw->i_extent, 0, sizeof(raw->i_extent));
+    memset(xb, 0, ZX_BS(fs));
+    for (i = 0; i < ii->ii_nrun; i++) {
+        if (i == ZX_INODE_EXTENTS) {
+            ex = xb - ZX_INODE_EXTENTS;
+        }
+        ex[i].e_start = htole32(ii->ii_run[i].r_start);
+        ex[i].e_len = htole32(ii->ii_run[i].r_len);
+    }
+
+    if (xbno != 0 && ii->ii_xdirty) {
+        if (zx_cache_write(&fs->cache, xb, ZX_BS(fs), ZX_BLOCK_OFF(fs, xbno)) == -1) {
+            return -1;
+        }
+    }
+    ii->ii_xdirty = 0;
+
+    /*
+     * Inode itself goes to inode table at the end of operation, see
+     * zx_iflush()
+     */
+    if ((ie = zx_icache_get(&fs->icache, ii->ii_ino, &fresh)) == NULL ||
+        zx_icache_store(ie, ii) == -1) {
+        return -1;
+    }
+    zx_icache_dirty(&fs->icache, ie);
+
+    return 0;
+}
+
+/*
+ * Timestamps of inode changed and nothing else, unless mounted with
+ * ZX_NOLAZYTIME that is only kept in inode cache for a while
+ */
+static int
+zx_itouch(zx_fs_t *fs, zx_inode_info_t *ii)
+{
+    zx_icache_ent_t *ie;
+    int fresh;
+
+    if (fs->flags & ZX_NOLAZYTIME) {
+        return zx_iwrite(fs, ii);
+    }
+    if ((ie = zx_icache_get(&fs->icache, ii->ii_ino, &fresh)) == NULL ||
+        zx_icache_store(ie, ii) == -1) {
+        return -1;
+    }
+    zx_icache_times(&fs->icache, ie);
+
+    return 0;
+}
+
+/*
+ * Inodes with only timestamps changed that go out along with one
+ * operation. With a journal they are part of its transaction, see
+ * zx_geom_jnl_need().
+ */
+static __u32
+zx_ibatch(zx_fs_t *fs)
+{
+    if (fs->journal.j_blocks == 0) {
+        return ~0U;
+    }
+    return (fs->journal.j_limit < 8) ? 2 : fs->journal.j_limit / 4;
+}
+
+/*
+ * Write dirty inodes into inode table, one read-modify-write per
+ * inode table block they fall in. A batch of timestamp changes goes
+ * along when all is set, when they got old or too many.
+ */
+static int
+zx_iflush(zx_fs_t *fs, int all)
+{
+    zx_icache_t *ic = &fs->icache;
+    zx_inode_t blk[ZX_INODE_PER_BLOCK(ZX_MAX_BLOCK_SIZE)];
+    zx_icache_ent_t *ie;
+    __u32 ipb = ZX_INODE_PER_BLOCK(ZX_BS(fs));
+    __u32 i, j, n, bno;
+
+    if (ic->ic_ntimes > 0 &&
+        (all || ic->ic_ntlist > ic->ic_max / 4 ||
+         time(NULL) - ic->ic_tstart >= ZX_LAZY_INTERVAL)) {
+        zx_icache_expire(ic, zx_ibatch(fs));
+    }
+    if (ic->ic_ndirty == 0) {
+        return 0;
+    }
+    n = zx_icache_sorted(ic);
+    for (i = 0; i < n; i = j) {
+        bno = ic->ic_sort[i]->ie_ino / ipb;
+        if (zx_cache_read(&fs->cache, blk, ZX_BS(fs),
+                          ZX_BLOCK_OFF(fs, fs->geo.g_inode_start + bno)) == -1) {
+            return -1;
+        }
+        for (j = i; j < n && ic->ic_sort[j]->ie_ino / ipb == bno; j++) {
+            ie = ic->ic_sort[j];
+            ie->ie_raw.i_checksum = htole32(zx_inode_csum(&ie->ie_raw, ie->ie_ino));
+            memcpy(&blk[ie->ie_ino % ipb], &ie->ie_raw, ZX_INODE_SIZE);
+        }
+        if (zx_cache_write(&fs->cache, blk, ZX_BS(fs),
+                           ZX_BLOCK_OFF(fs, fs->geo.g_inode_start + bno)) == -1) {
+            return -1;
+        }
+        ic->ic_stat.is_writes++;
+    }
+    zx_icache_clean(ic);
+
+    return 0;
+}
+
+/*
+ * Map file block lblk to device block, *run is number of blocks
+ * contiguous on device from there on, runs that happen to follow
+ * each other on device are taken as one.
+ */
+static int
+zx_bmap(zx_inode_info_t *ii, __u32 lblk, __u32 *pblk, __u32 *run)
+{
+    __u32 i;
+
+    for (i = 0; i < ii->ii_nrun; i++) {
+        if (lblk < ii->ii_run[i].r_len) {
+            *pblk = ii->ii_run[i].r_start + lblk;
+            *run = ii->ii_run[i].r_len - lblk;
+            for (i++; i < ii->ii_nrun && ii->ii_run[i].r_start == *pblk + *run; i++) {
+                *run += ii->ii_run[i].r_len;
+            }
+            return 0;
+        }
+        lblk -= ii->ii_run[i].r_len;
+    }
+
+    errno = EIO;
+    return -1;
+}
+
+/*
+ * Bytes of an inode that have storage behind them
+ */
+static off_t
+zx_mapped(zx_fs_t *fs, zx_inode_info_t *ii)
+{
+    if (ZX_INLINE(ii)) {
+        return ZX_INLINE_MAX;
+    }
+    return (off_t) le32toh(ii->ii_raw.i_blocks) * ZX_BS(fs);
+}
+
+/*
+ * Move inline data out to a data block of its own, rest of the block
+ * is cleared
+ */
+static int
+zx_inline_out(zx_fs_t *fs, zx_inode_info_t *ii)
+{
+    char blk[ZX_MAX_BLOCK_SIZE];
+    __u32 bno, len;
+
+    if (zx_balloc(fs, zx_ag_goal(fs, ii->ii_ino), 1, &bno, &len) == -1) {
+        return -1;
+    }
+    memset(blk, 0, ZX_BS(fs));
+    memcpy(blk, ii->ii_raw.i_pad, le32toh(ii->ii_raw.i_size));
+    if (zx_dev_pwrite(&fs->dev, blk, ZX_BS(fs), ZX_BLOCK_OFF(fs, bno)) == -1) {
+        zx_bfree(fs, bno, 1);
+        return -1;
+    }
+
+    ii->ii_raw.i_flags = htole16(le16toh(ii->ii_raw.i_flags) & ~ZX_INODE_INLINE);
+    memset(ii->ii_raw.i_pad, 0, ZX_INLINE_MAX);
+    ii->ii_raw.i_blocks = htole32(1);
+    ii->ii_run[0].r_start = bno;
+    ii->ii_run[0].r_len = 1;
+    ii->ii_nrun = 1;
+
+    return 0;
+}
+
+/*
+ * Grow or shrink inode to hold size bytes. Growing asks allocator for
+ * all missing blocks at once, right after last extent first, so a
+ * file lands in as few extents as free space allows. Blocks are
+ * released from the tail, a whole extent at a time. An inline inode
+ * stays inline while size fits, bytes past size are kept zero. A grow
+ * that cannot get all it wants gives back what it got, those blocks
+ * were never cleared.
+ */
+static int
+zx_resize(zx_fs_t *fs, zx_inode_info_t *ii, off_t size)
+{
+    zx_run_t *r;
+    __u32 want, have, start, bno, len, goal;
+    int err = 0;
+
+    if (size > ZX_MAX_FILE_SIZE) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (ZX_INLINE(ii)) {
+        if (size <= ZX_INLINE_MAX) {
+            memset(ii->ii_raw.i_pad + size, 0, ZX_INLINE_MAX - size);
+            ii->ii_raw.i_size = htole32(size);
+            return 0;
+        }
+        if (zx_inline_out(fs, ii) == -1) {
+            return -1;
+        }
+    }
+
+    want = (size + ZX_BS(fs) - 1) / ZX_BS(fs);
+    have = start = le32toh(ii->ii_raw.i_blocks);
+
+    while (have < want) {
+        r = (ii->ii_nrun > 0) ? &ii->ii_run[ii->ii_nrun - 1] : NULL;
+        goal = (r != NULL) ? r->r_start + r->r_len : zx_ag_goal(fs, ii->ii_ino);
+        if (ii->ii_nrun == ZX_MAX_EXTENTS(ZX_BS(fs)) &&
+            (goal - fs->geo.g_data_start >= fs->geo.g_blocks ||
+             zx_test_bit(fs->bmap.bm_map, goal - fs->geo.g_data_start))) {
+            /* out of extents and last one cannot grow */
+            errno = EFBIG;
+            break;
+        }
+        if (zx_balloc(fs, goal, want - have, &bno, &len) == -1) {
+            break;
+        }
+        if (r != NULL && bno == goal) {
+            r->r_len += len;
+        } else {
+            r = &ii->ii_run[ii->ii_nrun++];
+            r->r_start = bno;
+            r->r_len = len;
+        }
+        if (ii->ii_nrun > ZX_INODE_EXTENTS) {
+            ii->ii_xdirty = 1;
+        }
+        have += len;
+    }
+    if (have < want) {
+        err = errno;
+        want = start;
+    }
+    while (have > want) {
+        r = &ii->ii_run[ii->ii_nrun - 1];
+        len = (r->r_len < have - want) ? r->r_len : have - want;
+        if (zx_bfree(fs, r->r_start + r->r_len - len, len) == -1) {
+            break;
+        }
+        if (ii->ii_nrun > ZX_INODE_EXTENTS) {
+            ii->ii_xdirty = 1;
+        }
+        if ((r->r_len -= len) == 0) {
+            ii->ii_nrun--;
+        }
+        have -= len;
+    }
+
+    ii->ii_raw.i_blocks = htole32(have);
+    if (err != 0 || have != want) {
+        if ((off_t) have * ZX_BS(fs) < le32toh(ii->ii_raw.i_size)) {
+            ii->ii_raw.i_size = htole32(have * ZX_BS(fs));
+        }
+        if (err != 0) {
+            errno = err;
+        }
+        return -1;
+    }
+    ii->ii_raw.i_size = htole32(size);
+
+    return 0;
+}
+
+/*
+ * Copy data in and out of an inode, range must already be mapped.
+ * Each piece that is contiguous on device takes one I/O, inline data
+ * is only copied and goes out with the inode.
+ */
+static int
+zx_irw(zx_fs_t *fs, zx_inode_info_t *ii, char *buf, size_t count, off_t off, int wr)
+{
+    __u32 pblk, run;
+    size_t len;
+    off_t addr;
+
+    if (ZX_INLINE(ii)) {
+        if (off + count > ZX_INLINE_MAX) {
+            errno = EIO;
+            return -1;
+        }
+        if (wr) {
+            memcpy(ii->ii_raw.i_pad + off, buf, count);
+        } else {
+            memcpy(buf, ii->ii_raw.i_pad + off, count);
+        }
+        return 0;
+    }
+    while (count > 0) {
+        if (zx_bmap(ii, off / ZX_BS(fs), &pblk, &run) == -1) {
+            return -1;
+        }
+        addr = ZX_BLOCK_OFF(fs, pblk) + (off % ZX_BS(fs));
+        len = ((size_t) run * ZX_BS(fs)) - (off % ZX_BS(fs));
+        if (len > count) {
+            len = count;
+        }
+        if (wr) {
+            if (zx_dev_pwrite(&fs->dev, buf, len, addr) == -1) {
+                return -1;
+            }
+        } else {
+            if (zx_dev_pread(&fs->dev, buf, len, addr) == -1) {
+                return -1;
+            }
+        }
+        buf += len;
+        off += len;
+        count -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Clear bytes [from, to) of an inode. Bytes past i_size up to end of
+ * the last block are always kept zero, callers clear whatever a grow
+ * maps that they do not write themselves.
+ */
+static int
+zx_zero_range(zx_fs_t *fs, zx_inode_info_t *ii, off_t from, off_t to)
+{
+    struct iovec iov[ZX_ZERO_IOV];
+    __u32 pblk, run;
+    size_t len, n;
+    int cnt;
+
+    if (ZX_INLINE(ii)) {
+        return (from < to) ? zx_irw(fs, ii, (char *) zx_zero, to - from, from, 1) : 0;
+    }
+
+    /*
+     * One gathered write per run of blocks on device, every buffer
+     * of it is the same zero one
+     */
+    while (from < to) {
+        if (zx_bmap(ii, from / ZX_BS(fs), &pblk, &run) == -1) {
+            return -1;
+        }
+        len = ((size_t) run * ZX_BS(fs)) - (from % ZX_BS(fs));
+        if (len > (size_t) (to - from)) {
+            len = to - from;
+        }
+        if (len > ZX_ZERO_IOV * ZX_ZERO_SIZE) {
+            len = ZX_ZERO_IOV * ZX_ZERO_SIZE;
+        }
+        for (cnt = 0, n = 0; n < len; n += iov[cnt++].iov_len) {
+            iov[cnt].iov_base = (void *) zx_zero;
+            iov[cnt].iov_len = (len - n > ZX_ZERO_SIZE) ? ZX_ZERO_SIZE : len - n;
+        }
+        if (zx_dev_pwritev(&fs->dev, iov, cnt, ZX_BLOCK_OFF(fs, pblk) + (from % ZX_BS(fs))) == -1) {
+            return -1;
+        }
+        from += len;
+    }
+
+    return 0;
+}
+
+/*
+ * Whether a read should update atime. By default (relatime) only
+ * when atime is not past mtime and ctime or is a day old, so that a
+ * file read over and over is not written over and over.
+ */
+static int
+zx_atime_due(zx_fs_t *fs, zx_inode_info_t *ii, time_t now)
+{
+    time_t atime = le32toh(ii->ii_raw.i_atime);
+
+    if ((fs->flags & ZX_NOATIME) || atime == now) {
+        return 0;
+    }
+    return (fs->flags & ZX_STRICTATIME) ||
+           atime <= (time_t) le32toh(ii->ii_raw.i_mtime) ||
+           atime <= (time_t) le32toh(ii->ii_raw.i_ctime) ||
+           now - atime >= ZX_RELATIME_AGE;
+}
+
+/*
+ * Reads of a descriptor that go on where the last one ended get the
+ * blocks after them prefetched. Window starts at ZX_RA_MIN and
+ * doubles, up to ZX_RA_MAX, each time the reader gets within half a
+ * window of its end. A read anywhere else starts over.
+ */
+static void
+zx_readahead(zx_fs_t *fs, zx_file_t *f, zx_inode_info_t *ii, off_t off, size_t count)
+{
+    off_t from, to, size = le32toh(ii->ii_raw.i_size);
+    __u32 pblk, run;
+    off_t len;
+
+    if (off != f->f_ra_next) {
+        f->f_ra_next = off + count;
+        f->f_ra_end = 0;
+        f->f_ra_win = 0;
+        return;
+    }
+    f->f_ra_next = off + count;
+    if (ZX_INLINE(ii) || off + (off_t) (count + f->f_ra_win / 2) < f->f_ra_end) {
+        return;
+    }
+    if (f->f_ra_win == 0) {
+        f->f_ra_win = ZX_RA_MIN;
+    } else if (f->f_ra_win < ZX_RA_MAX) {
+        f->f_ra_win *= 2;
+    }
+
+    from = (f->f_ra_end > off + (off_t) count) ? f->f_ra_end : off + (off_t) count;
+    to = (from + (off_t) f->f_ra_win < size) ? from + (off_t) f->f_ra_win : size;
+    f->f_ra_end = to;
+    for (from -= from % ZX_BS(fs); from < to; from += len) {
+        if (zx_bmap(ii, from / ZX_BS(fs), &pblk, &run) == -1) {
+            return;
+        }
+        len = ((off_t) run * ZX_BS(fs) < to - from) ? (off_t) run * ZX_BS(fs) : to - from;
+        zx_dev_readahead(&fs->dev, ZX_BLOCK_OFF(fs, pblk), len);
+    }
+}
+
+/*
+ * Directories
+ */
+static int
+zx_name_ok(const char *name, size_t len)
+{
+    if (len == 0) {
+        errno = ENOENT;
+        return 0;
+    }
+    if (len >= ZX_MAX_NAME) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Read directory block lblk, *pblk tells where it lives on device
+ */
+static int
+zx_dir_read(zx_fs_t *fs, zx_inode_info_t *dir, __u32 lblk, zx_dirent_t *de, __u32 *pblk)
+{
+    __u32 run;
+
+    if (zx_bmap(dir, lblk, pblk, &run) == -1 ||
+        zx_cache_read(&fs->cache, de, ZX_BS(fs), ZX_BLOCK_OFF(fs, *pblk)) == -1) {
+        return -1;
+    }
+    if (le32toh(de[ZX_DIR_TAIL(ZX_BS(fs))].d_inode) != zx_dir_csum(de, dir->ii_ino, ZX_BS(fs))) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Put checksum of directory block in its tail dirent
+ */
+static void
+zx_dir_seal(zx_fs_t *fs, zx_dirent_t *de, __u32 ino)
+{
+    memset(&de[ZX_DIR_TAIL(ZX_BS(fs))], 0, ZX_DIR_SIZE);
+    de[ZX_DIR_TAIL(ZX_BS(fs))].d_inode = htole32(zx_dir_csum(de, ino, ZX_BS(fs)));
+}
+
+static int
+zx_dir_write(zx_fs_t *fs, zx_inode_info_t *dir, __u32 pblk, zx_dirent_t *de)
+{
+    zx_dir_seal(fs, de, dir->ii_ino);
+    return zx_cache_write(&fs->cache, de, ZX_BS(fs), ZX_BLOCK_OFF(fs, pblk));
+}
+
+/*
+ * Replace dirent at byte offset slot of directory, whole block is
+ * rewritten to keep its checksum right
+ */
+static int
+zx_dir_put(zx_fs_t *fs, zx_inode_info_t *dir, off_t slot, const zx_dirent_t *ent)
+{
+    zx_dirent_t de[ZX_DIR_PER_BLOCK(ZX_MAX_BLOCK_SIZE)];
+    __u32 pblk;
+
+    if (zx_dir_read(fs, dir, slot / ZX_BS(fs), de, &pblk) == -1) {
+        return -1;
+    }
+    memcpy(&de[(slot % ZX_BS(fs)) / ZX_DIR_SIZE], ent, ZX_DIR_SIZE);
+    return zx_dir_write(fs, dir, pblk, de);
+}
+
+/*
+ * Directory hash index, see zx_dx_root_t for on disk format
+ */
+static int zx_dir_add(zx_fs_t *fs, zx_inode_info_t *dir, const char *name,
+                      size_t len, __u32 ino);
+
+static __u32
+zx_dx_hash(const char *name, size_t len)
+{
+    __u32 h = 2166136261U;
+
+    while (len-- > 0) {
+        h ^= (__u8) *name++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static __u32
+zx_dx_order(zx_fs_t *fs, __u32 count)
+{
+    __u32 order = 0;
+
+    while (order < ZX_DX_MAX_ORDER && (count + 1) * 2 > (ZX_DX_ENTRIES(ZX_BS(fs)) << order)) {
+        order++;
+    }
+    return order;
+}
+
+static int
+zx_dx_load(zx_fs_t *fs, zx_inode_info_t *dir, zx_dx_t *dx)
+{
+    zx_dx_root_t root;
+    __u32 i;
+
+    dx->dx_bno = le32toh(dir->ii_raw.i_dxroot);
+    if (zx_cache_read(&fs->cache, &root, sizeof(root), ZX_BLOCK_OFF(fs, dx->dx_bno)) == -1) {
+        return -1;
+    }
+    if (le32toh(root.dx_magic) != ZX_DX_MAGIC ||
+        le32toh(root.dx_order) > ZX_DX_MAX_ORDER) {
+        errno = EIO;
+        return -1;
+    }
+
+    dx->dx_order = le32toh(root.dx_order);
+    dx->dx_count = le32toh(root.dx_count);
+    dx->dx_deleted = le32toh(root.dx_deleted);
+    dx->dx_free = le32toh(root.dx_free);
+    for (i = 0; i < ZX_DX_MAX_BLOCKS; i++) {
+        dx->dx_block[i] = le32toh(root.dx_block[i]);
+    }
+
+    return 0;
+}
+
+static int
+zx_dx_store(zx_fs_t *fs, zx_dx_t *dx)
+{
+    zx_dx_root_t root;
+    __u32 i;
+
+    root.dx_magic = htole32(ZX_DX_MAGIC);
+    root.dx_order = htole32(dx->dx_order);
+    root.dx_count = htole32(dx->dx_count);
+    root.dx_deleted = htole32(dx->dx_deleted);
+    root.dx_free = htole32(dx->dx_free);
+    for (i = 0; i < ZX_DX_MAX_BLOCKS; i++) {
+        root.dx_block[i] = htole32(dx->dx_block[i]);
+    }
+
+    return zx_cache_write(&fs->cache, &root, sizeof(root), ZX_BLOCK_OFF(fs, dx->dx_bno));
+}
+
+/*
+ * Read table entry pos into *e, tb caches table block *tblk
+ */
+static int
+zx_dx_get(zx_fs_t *fs, zx_dx_t *dx, __u32 pos, __le32 *tb, __u32 *tblk, __u32 *e)
+{
+    if (pos / ZX_DX_ENTRIES(ZX_BS(fs)) != *tblk) {
+        *tblk = pos / ZX_DX_ENTRIES(ZX_BS(fs));
+        if (zx_cache_read(&fs->cache, tb, ZX_BS(fs),
+                          ZX_BLOCK_OFF(fs, dx->dx_block[*tblk])) == -1) {
+            return -1;
+        }
+    }
+    *e = le32toh(tb[pos % ZX_DX_ENTRIES(ZX_BS(fs))]);
+    return 0;
+}
+
+static int
+zx_dx_set(zx_fs_t *fs, zx_dx_t *dx, __u32 pos, __u32 e)
+{
+    __le32 v = htole32(e);
+
+    return zx_cache_write(&fs->cache, &v, sizeof(v),
+                          ZX_BLOCK_OFF(fs, dx->dx_block[pos / ZX_DX_ENTRIES(ZX_BS(fs))]) +
+                          (pos % ZX_DX_ENTRIES(ZX_BS(fs))) * sizeof(__le32));
+}
+
+static int
+zx_dx_find(zx_fs_t *fs, zx_inode_info_t *dir, zx_dx_t *dx, const char *name,
+           size_t len, __u32 *ino, off_t *slot)
+{
+    __le32 tb[ZX_DX_ENTRIES(ZX_MAX_BLOCK_SIZE)];
+    zx_dirent_t de[ZX_DIR_PER_BLOCK(ZX_MAX_BLOCK_SIZE)], *d;
+    __u32 h = zx_dx_hash(name, len), n = ZX_DX_ENTRIES(ZX_BS(fs)) << dx->dx_order;
+    __u32 i, e, pos, pblk, tblk = ZX_DX_NONE;
+
+    for (i = 0, pos = h & (n - 1); i < n; i++, pos = (pos + 1) & (n - 1)) {
+        if (zx_dx_get(fs, dx, pos, tb, &tblk, &e) == -1) {
+            return -1;
+        }
+        if (e == ZX_DX_EMPTY) {
+            break;
+        }
+        if (e == ZX_DX_DELETED || ZX_DX_TAG(e) != ZX_DX_TAG(h)) {
+            continue;
+        }
+        if (zx_dir_read(fs, dir, ZX_DX_SLOT(e) / ZX_DIR_PER_BLOCK(ZX_BS(fs)), de, &pblk) == -1) {
+            return -1;
+        }
+        d = &de[ZX_DX_SLOT(e) % ZX_DIR_PER_BLOCK(ZX_BS(fs))];
+        if (strncmp(d->d_name, name, len) == 0 && d->d_name[len] == '\0') {
+            *ino = le32toh(d->d_inode);
+            if (slot) {
+                *slot = (off_t) ZX_DX_SLOT(e) * ZX_DIR_SIZE;
+            }
+            return 0;
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+static int
+zx_dx_insert(zx_fs_t *fs, zx_dx_t *dx, __u32 h, __u32 slot)
+{
+    __le32 tb[ZX_DX_ENTRIES(ZX_MAX_BLOCK_SIZE)];
+    __u32 i, e, pos, tblk = ZX_DX_NONE, n = ZX_DX_ENTRIES(ZX_BS(fs)) << dx->dx_order;
+
+    for (i = 0, pos = h & (n - 1); i < n; i++, pos = (pos + 1) & (n - 1)) {
+        if (zx_dx_get(fs, dx, pos, tb, &tblk, &e) == -1) {
+            return -1;
+        }
+        if (e == ZX_DX_EMPTY || e == ZX_DX_DELETED) {
+            if (e == ZX_DX_DELETED) {
+                dx->dx_deleted--;
+            }
+            dx->dx_count++;
+            return zx_dx_set(fs, dx, pos, ZX_DX_ENT(h, slot));
+        }
+    }
+
+    errno = ENOSPC;
+    return -1;
+}
+
+static int
+zx_dx_remove(zx_fs_t *fs, zx_dx_t *dx, __u32 h, __u32 slot)
+{
+    __le32 tb[ZX_DX_ENTRIES(ZX_MAX_BLOCK_SIZE)];
+    __u32 i, e, pos, tblk = ZX_DX_NONE, n = ZX_DX_ENTRIES(ZX_BS(fs)) << dx->dx_order;
+
+    for (i = 0, pos = h & (n - 1); i < n; i++, pos = (pos + 1) & (n - 1)) {
+        if (zx_dx_get(fs, dx, pos, tb, &tblk, &e) == -1) {
+            return -1;
+        }
+        if (e == ZX_DX_EMPTY) {
+            break;
+        }
+        if (e == ZX_DX_ENT(h, slot)) {
+            dx->dx_count--;
+            dx->dx_deleted++;
+            return zx_dx_set(fs, dx, pos, ZX_DX_DELETED);
+        }
+    }
+
+    errno = EIO;
+    return -1;
+}
+
+/*
+ * Release index of directory, it goes back to plain linear lookup.
+ * Caller writes the inode.
+ */
+static int
+zx_dx_drop(zx_fs_t *fs, zx_inode_info_t *dir)
+{
+    zx_dx_t dx;
+    __u32 i;
+
+    if (dir->ii_raw.i_dxroot == 0) {
+        return 0;
+    }
+    if (zx_dx_load(fs, dir, &dx) == -1) {
+        return -1;
+    }
+    for (i = 0; i < (1U << dx.dx_order); i++) {
+        if (zx_bfree(fs, dx.dx_block[i], 1) == -1) {
+            return -1;
+        }
+    }
+    if (zx_bfree(fs, dx.dx_bno, 1) == -1) {
+        return -1;
+    }
+    dir->ii_raw.i_dxroot = 0;
+
+    return 0;
+}
+
+/*
+ * (Re)build index of directory from its dirents with a table sized
+ * for count entries, free chain is rebuilt on the way. Previous table
+ * is released once the new one is on disk. Caller writes the inode,
+ * and drops the index if this fails.
+ */
+static int
+zx_dx_build(zx_fs_t *fs, zx_inode_info_t *dir, __u32 count)
+{
+    zx_dx_t dx, old;
+    zx_dirent_t de[ZX_DIR_PER_BLOCK(ZX_MAX_BLOCK_SIZE)];
+    __le32 *tab = NULL;
+    __u32 i, j, h, n, pos, pblk, slot, goal, bno, len, nalloc = 0;
+    __u32 nblk = le32toh(dir->ii_raw.i_blocks);
+    int ret = -1;
+
+    if ((count + 1) * 8 > (ZX_DX_ENTRIES(ZX_BS(fs)) << ZX_DX_MAX_ORDER) * 7 ||
+        nblk * ZX_DIR_PER_BLOCK(ZX_BS(fs)) >= ZX_DX_MAX_SLOTS) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    memset(&dx, 0, sizeof(dx));
+    memset(&old, 0, sizeof(old));
+    if (dir->ii_raw.i_dxroot != 0 && zx_dx_load(fs, dir, &old) == -1) {
+        return -1;
+    }
+    dx.dx_order = zx_dx_order(fs, count);
+    n = ZX_DX_ENTRIES(ZX_BS(fs)) << dx.dx_order;
+    if ((tab = (__le32 *) calloc(n, sizeof(__le32))) == NULL) {
+        return -1;
+    }
+
+    /*
+     * Walk dirents backwards so free chain comes out in slot order
+     */
+    for (i = nblk; i-- > 0; ) {
+        if (zx_dir_read(fs, dir, i, de, &pblk) == -1) {
+            goto out;
+        }
+        for (j = ZX_DIR_TAIL(ZX_BS(fs)); j-- > 0; ) {
+            slot = (i * ZX_DIR_PER_BLOCK(ZX_BS(fs))) + j;
+            if (de[j].d_name[0] == '\0') {
+                de[j].d_inode = htole32(dx.dx_free);
+                dx.dx_free = slot + 1;
+                continue;
+            }
+            if (dx.dx_count + 1 >= n) {
+                errno = EFBIG;
+                goto out;
+            }
+            h = zx_dx_hash(de[j].d_name, strnlen(de[j].d_name, ZX_MAX_NAME));
+            for (pos = h & (n - 1); tab[pos] != 0; pos = (pos + 1) & (n - 1))
+                ;
+            tab[pos] = htole32(ZX_DX_ENT(h, slot));
+            dx.dx_count++;
+        }
+        if (zx_dir_write(fs, dir, pblk, de) == -1) {
+            goto out;
+        }
+    }
+
+    /*
+     * Table goes in as few runs as allocator gives, each one written
+     * with a single I/O
+     */
+    dx.dx_bno = old.dx_bno;
+    goal = dir->ii_run[dir->ii_nrun - 1].r_start + dir->ii_run[dir->ii_nrun - 1].r_len;
+    if (dx.dx_bno == 0 && zx_balloc(fs, goal, 1, &dx.dx_bno, &len) == -1) {
+        goto out;
+    }
+    goal = dx.dx_bno + 1;
+    while (nalloc < (1U << dx.dx_order)) {
+        if (zx_balloc(fs, goal, (1U << dx.dx_order) - nalloc, &bno, &len) == -1) {
+            goto out;
+        }
+        for (j = 0; j < len; j++) {
+            dx.dx_block[nalloc + j] = bno + j;
+        }
+        nalloc += len;
+        if (zx_cache_write(&fs->cache, tab + ((nalloc - len) * ZX_DX_ENTRIES(ZX_BS(fs))),
+                           (size_t) len * ZX_BS(fs), ZX_BLOCK_OFF(fs, bno)) == -1) {
+            goto out;
+        }
+        goal = bno + len;
+    }
+    if (zx_dx_store(fs, &dx) == -1) {
+        goto out;
+    }
+    dir->ii_raw.i_dxroot = htole32(dx.dx_bno);
+
+    for (i = 0; old.dx_bno != 0 && i < (1U << old.dx_order); i++) {
+        zx_bfree(fs, old.dx_block[i], 1);
+    }
+    nalloc = 0;
+    ret = 0;
+
+out:
+    while (nalloc > 0) {
+        zx_bfree(fs, dx.dx_block[--nalloc], 1);
+    }
+    if (ret == -1 && old.dx_bno == 0 && dx.dx_bno != 0) {
+        zx_bfree(fs, dx.dx_bno, 1);
+    }
+    free(tab);
+    return ret;
+}
+
+/*
+ * Add name to an indexed directory. Slot comes off free chain, or
+ * from a new block whose other slots are chained. Table is rebuilt
+ * when it gets 3/4 full (tombstones included), and directory falls
+ * back to linear lookup when that is not possible.
+ */
+static int
+zx_dx_add(zx_fs_t *fs, zx_inode_info_t *dir, const char *name, size_t len, __u32 ino)
+{
+    zx_dx_t dx;
+    zx_dirent_t de[ZX_DIR_PER_BLOCK(ZX_MAX_BLOCK_SIZE)];
+    __u32 j, slot, pblk, run, nblk, h = zx_dx_hash(name, len);
+
+    if (zx_dx_load(fs, dir, &dx) == -1) {
+        return -1;
+    }
+    if ((dx.dx_count + dx.dx_deleted + 1) * 4 > (ZX_DX_ENTRIES(ZX_BS(fs)) << dx.dx_order) * 3) {
+        if (zx_dx_build(fs, dir, dx.dx_count + 1) == -1 ||
+            zx_dx_load(fs, dir, &dx) == -1) {
+            if (zx_dx_drop(fs, dir) == -1) {
+                return -1;
+            }
+            return zx_dir_add(fs, dir, name, len, ino);
+        }
+    }
+
+    if (dx.dx_free != 0) {
+        slot = dx.dx_free - 1;
+        if (zx_dir_read(fs, dir, slot / ZX_DIR_PER_BLOCK(ZX_BS(fs)), de, &pblk) == -1) {
+            return -1;
+        }
+        j = slot % ZX_DIR_PER_BLOCK(ZX_BS(fs));
+        dx.dx_free = le32toh(de[j].d_inode);
+        memset(&de[j], 0, ZX_DIR_SIZE);
+        de[j].d_inode = htole32(ino);
+        memcpy(de[j].d_name, name, len);
+    } else {
+        nblk = le32toh(dir->ii_raw.i_blocks);
+        if (zx_resize(fs, dir, (off_t) (nblk + 1) * ZX_BS(fs)) == -1) {
+            if (errno == EFBIG) {
+                errno = ENOSPC;
+            }
+            zx_iwrite(fs, dir);
+            return -1;
+        }
+        slot = nblk * ZX_DIR_PER_BLOCK(ZX_BS(fs));
+        memset(de, 0, ZX_BS(fs));
+        de[0].d_inode = htole32(ino);
+        memcpy(de[0].d_name, name, len);
+        for (j = 1; j < ZX_DIR_TAIL(ZX_BS(fs)) - 1; j++) {
+            de[j].d_inode = htole32(slot + j + 2);
+        }
+        dx.dx_free = slot + 2;
+        if (zx_bmap(dir, nblk, &pblk, &run) == -1) {
+            return -1;
+        }
+    }
+    if (zx_dir_write(fs, dir, pblk, de) == -1) {
+        return -1;
+    }
+
+    if (zx_dx_insert(fs, &dx, h, slot) == -1 || zx_dx_store(fs, &dx) == -1) {
+        return -1;
+    }
+
+    dir->ii_raw.i_mtime = dir->ii_raw.i_ctime = htole32(time(NULL));
+    return zx_iwrite(fs, dir);
+}
+
+/*
+ * Look name up in directory, on success *slot is byte offset of
+ * dirent within directory.
+ */
+static int
+zx_dir_find(zx_fs_t *fs, zx_inode_info_t *dir, const char *name, size_t len,
+            __u32 *ino, off_t *slot)
+{
+    zx_dirent_t de[ZX_DIR_PER_BLOCK(ZX_MAX_BLOCK_SIZE)];
+    zx_dx_t dx;
+    __u32 i, j, pblk, nblk = le32toh(dir->ii_raw.i_blocks);
+
+    if (dir->ii_raw.i_dxroot != 0) {
+        if (zx_dx_load(fs, dir, &dx) == -1) {
+            return -1;
+        }
+        return zx_dx_find(fs, dir, &dx, name, len, ino, slot);
+    }
+
+    for (i = 0; i < nblk; i++) {
+        if (zx_dir_read(fs, dir, i, de, &pblk) == -1) {
+            return -1;
+        }
+        for (j = 0; j < ZX_DIR_TAIL(ZX_BS(fs)); j++) {
+            if (de[j].d_name[0] != '\0' &&
+                strncmp(de[j].d_name, name, len) == 0 &&
+                de[j].d_name[len] == '\0') {
+                *ino = le32toh(de[j].d_inode);
+                if (slot) {
+                    *slot = ((off_t) i * ZX_BS(fs)) + (j * ZX_DIR_SIZE);
+                }
+                return 0;
+            }
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+static int
+zx_dir_add(zx_fs_t *fs, zx_inode_info_t *dir, const char *name, size_t len, __u32 ino)
+{
+    zx_dirent_t de[ZX_DIR_PER_BLOCK(ZX_MAX_BLOCK_SIZE)];
+    __u32 i, j, pblk, run, nblk = le32toh(dir->ii_raw.i_blocks);
+
+    if (dir->ii_raw.i_dxroot != 0) {
+        return zx_dx_add(fs, dir, name, len, ino);
+    }
+
+    for (i = 0; i < nblk; i++) {
+        if (zx_dir_read(fs, dir, i, de, &pblk) == -1) {
+            return -1;
+        }
+        for (j = 0; j < ZX_DIR_TAIL(ZX_BS(fs)); j++) {
+            if (de[j].d_name[0] == '\0') {
+                goto found;
+            }
+        }
+    }
+
+    /*
+     * Directory is full, extend it by one cleared block
+     */
+    if (zx_resize(fs, dir, (off_t) (nblk + 1) * ZX_BS(fs)) == -1) {
+        if (errno == EFBIG) {
+            errno = ENOSPC;
+        }
+        zx_iwrite(fs, dir);
+        return -1;
+    }
+    memset(de, 0, ZX_BS(fs));
+    if (zx_bmap(dir, nblk, &pblk, &run) == -1) {
+        return -1;
+    }
+    j = 0;
+
+found:
+    memset(&de[j], 0, ZX_DIR_SIZE);
+    de[j].d_inode = htole32(ino);
+    memcpy(de[j].d_name, name, len);
+    if (zx_dir_write(fs, dir, pblk, de) == -1) {
+        return -1;
+    }
+
+    /*
+     * Directory got big enough to be worth an index. Not getting one
+     * is not an error, lookups just stay linear.
+     */
+    nblk = le32toh(dir->ii_raw.i_blocks);
+    if (nblk >= ZX_DX_MIN_BLOCKS) {
+        zx_dx_build(fs, dir, nblk * ZX_DIR_PER_BLOCK(ZX_BS(fs)));
+    }
+
+    dir->ii_raw.i_mtime = dir->ii_raw.i_ctime = htole32(time(NULL));
+    return zx_iwrite(fs, dir);
+}
+
+static int
+zx_dir_del(zx_fs_t *fs, zx_inode_info_t *dir, const char *name, size_t len, off_t slot)
+{
+    zx_dirent_t de;
+    zx_dx_t dx;
+
+    memset(&de, 0, ZX_DIR_SIZE);
+    if (dir->ii_raw.i_dxroot != 0) {
+        if (zx_dx_load(fs, dir, &dx) == -1 ||
+            zx_dx_remove(fs, &dx, zx_dx_hash(name, len), slot / ZX_DIR_SIZE) == -1) {
+            return -1;
+        }
+        de.d_inode = htole32(dx.dx_free);
+        dx.dx_free = (slot / ZX_DIR_SIZE) + 1;
+        if (zx_dx_store(fs, &dx) == -1) {
+            return -1;
+        }
+    }
+    if (zx_dir_put(fs, dir, slot, &de) == -1) {
+        return -1;
+    }
+
+    dir->ii_raw.i_mtime = dir->ii_raw.i_ctime = htole32(time(NULL));
+    return zx_iwrite(fs, dir);
+}
+
+static int
+zx_dir_empty(zx_fs_t *fs, zx_inode_info_t *dir)
+{
+    zx_dirent_t de[ZX_DIR_PER_BLOCK(ZX_MAX_BLOCK_SIZE)];
+    zx_dx_t dx;
+    __u32 i, j, pblk, nblk = le32toh(dir->ii_raw.i_blocks);
+
+    if (dir->ii_raw.i_dxroot != 0) {
+        if (zx_dx_load(fs, dir, &dx) == -1) {
+            return -1;
+        }
+        /* only . and .. left */
+        return dx.dx_count <= 2;
+    }
+
+    for (i = 0; i < nblk; i++) {
+        if (zx_dir_read(fs, dir, i, de, &pblk) == -1) {
+            return -1;
+        }
+        for (j = 0; j < ZX_DIR_TAIL(ZX_BS(fs)); j++) {
+            if (de[j].d_name[0] == '\0' ||
+                strcmp(de[j].d_name, ".") == 0 ||
+                strcmp(de[j].d_name, "..") == 0) {
+                continue;
+            }
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Path walk. zx_namei() resolves whole path, zx_nameiparent() resolves
+ * everything but last component and returns it in *name / *len.
+ */
+static int
+zx_walk(zx_fs_t *fs, const char *path, __u32 *ino, const char **last, size_t *llen)
+{
+    zx_inode_info_t in;
+    const char *p = path, *e;
+    size_t len;
+    __u32 cur = ZX_ROOT_INODE;
+
+    *last = NULL;
+    *llen = 0;
+    while (TRUE) {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        for (e = p; *e != '\0' && *e != '/'; e++)
+            ;
+        len = e - p;
+        if (!zx_name_ok(p, len)) {
+            return -1;
+        }
+
+        /*
+         * Stop at last component, caller wants its parent
+         */
+        while (*e == '/') {
+            e++;
+        }
+        if (*e == '\0') {
+            *last = p;
+            *llen = len;
+            break;
+        }
+
+        if (zx_iread(fs, cur, &in) == -1) {
+            return -1;
+        }
+        if (!S_ISDIR(le16toh(in.ii_raw.i_mode))) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        if (zx_dir_find(fs, &in, p, len, &cur, NULL) == -1) {
+            return -1;
+        }
+        p = e;
+    }
+
+    *ino = cur;
+    return 0;
+}
+
+static int
+zx_nameiparent(zx_fs_t *fs, const char *path, zx_inode_info_t *dir,
+               const char **name, size_t *len)
+{
+    __u32 dino;
+
+    if (zx_walk(fs, path, &dino, name, len) == -1) {
+        return -1;
+    }
+    if (*name == NULL) {
+        /* path names root itself */
+        errno = EEXIST;
+        return -1;
+    }
+    if (zx_iread(fs, dino, dir) == -1) {
+        return -1;
+    }
+    if (!S_ISDIR(le16toh(dir->ii_raw.i_mode))) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+zx_namei(zx_fs_t *fs, const char *path, __u32 *ino)
+{
+    zx_inode_info_t dir;
+    const char *name;
+    size_t len;
+
+    if (zx_walk(fs, path, ino, &name, &len) == -1) {
+        return -1;
+    }
+    if (name == NULL) {
+        return 0;
+    }
+    if (zx_iread(fs, *ino, &dir) == -1) {
+        return -1;
+    }
+    if (!S_ISDIR(le16toh(dir.ii_raw.i_mode))) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    return zx_dir_find(fs, &dir, name, len, ino, NULL);
+}
+
+/*
+ * Release inode and all its blocks
+ */
+static int
+zx_idrop(zx_fs_t *fs, __u32 ino)
+{
+    zx_inode_info_t in;
+
+    if (zx_iread(fs, ino, &in) == -1 || zx_dx_drop(fs, &in) == -1) {
+        return -1;
+    }
+    if (zx_resize(fs, &in, 0) == -1) {
+        zx_iwrite(fs, &in);
+        return -1;
+    }
+    if (zx_iwrite(fs, &in) == -1) {
+        return -1;
+    }
+    memset(&in.ii_raw, 0, ZX_INODE_SIZE);
+    if (zx_iwrite(fs, &in) == -1) {
+        return -1;
+    }
+
+    return zx_ifree(fs, ino);
+}
+
+static int
+zx_iopen(zx_fs_t *fs, __u32 ino)
+{
+    int i;
+
+    for (i = 0; i < ZX_MAX_FILES; i++) {
+        if (fs->files[i].f_used && fs->files[i].f_ino == ino) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static zx_file_t *
+zx_getfile(zx_fs_t *fs, int fd)
+{
+    if (fd < 0 || fd >= ZX_MAX_FILES || !fs->files[fd].f_used) {
+        errno = EBADF;
+        return NULL;
+    }
+    return &fs->files[fd];
+}
+
+static int
+zx_writable(zx_fs_t *fs)
+{
+    if ((fs->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EROFS;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Mount and unmount
+ */
+static int
+zx_sb_read(zx_fs_t *fs)
+{
+    if (zx_dev_pread(&fs->dev, &fs->sb, ZX_SUPER_SIZE,
+                     ZX_SUPER_OFFSET) == -1) {
+        return -1;
+    }
+    zx_geom_load(&fs->geo, &fs->sb);
+    if (le32toh(fs->sb.s_magic) != ZX_MAGIC_NUMBER ||
+        zx_geom_check(&fs->geo, fs->dev.size) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (le32toh(fs->sb.s_checksum) != zx_super_csum(&fs->sb)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Build in core groups, free counts come from the bitmaps. Returns 1
+ * when group table did not agree with them and has to be written.
+ */
+static int
+zx_ag_load(zx_fs_t *fs)
+{
+    zx_group_t *gdt = NULL;
+    size_t len = (size_t) fs->geo.g_gdt_blocks * ZX_BS(fs);
+    __u32 ipb = ZX_INODE_PER_BLOCK(ZX_BS(fs));
+    __u32 ag, n, first, stale = 0;
+
+    if ((fs->ag = (zx_ag_t *) calloc(fs->geo.g_groups, sizeof(zx_ag_t))) == NULL ||
+        (len != 0 && (gdt = (zx_group_t *) malloc(len)) == NULL)) {
+        return -1;
+    }
+    if (gdt == NULL) {
+        fs->ag[0].ag_itable_unused = fs->geo.g_itable_unused;
+    } else if (zx_dev_pread(&fs->dev, gdt, len, ZX_BLOCK_OFF(fs, fs->geo.g_gdt_start)) == -1) {
+        free(gdt);
+        return -1;
+    }
+
+    for (ag = 0; ag < fs->geo.g_groups; ag++) {
+        n = zx_geom_ag_inodes(&fs->geo, ag, &first);
+        fs->ag[ag].ag_free_inodes = n - zx_bm_used(&fs->imap, first, first + n);
+        n = zx_geom_ag_blocks(&fs->geo, ag, &first);
+        fs->ag[ag].ag_free_blocks = n - zx_bm_used(&fs->bmap, first, first + n);
+        if (gdt == NULL) {
+            continue;
+        }
+        n = zx_geom_ag_inodes(&fs->geo, ag, &first);
+        if (le32toh(gdt[ag].gd_checksum) != zx_group_csum(&gdt[ag], ag) ||
+            le32toh(gdt[ag].gd_itable_unused) > (n + ipb - 1) / ipb) {
+            free(gdt);
+            errno = EIO;
+            return -1;
+        }
+        fs->ag[ag].ag_itable_unused = le32toh(gdt[ag].gd_itable_unused);
+        if (le32toh(gdt[ag].gd_free_inodes) != fs->ag[ag].ag_free_inodes ||
+            le32toh(gdt[ag].gd_free_blocks) != fs->ag[ag].ag_free_blocks) {
+            stale = 1;
+        }
+    }
+    free(gdt);
+
+    return stale;
+}
+
+zx_fs_t *
+zx_mount(const char *dev, int flags)
+{
+    zx_fs_t *fs;
+    __u8 *imap, *bmap;
+    __u32 ag;
+    int n = 0, stale;
+
+    if ((fs = (zx_fs_t *) calloc(1, sizeof(zx_fs_t))) == NULL) {
+        return NULL;
+    }
+    fs->flags = flags;
+
+    if (zx_dev_open(&fs->dev, dev, flags & (O_ACCMODE | O_SYNC)) == -1) {
+        free(fs);
+        return NULL;
+    }
+
+    /*
+     * Committed transactions left in journal are replayed before
+     * anything else is read, super block may be among them
+     */
+    if (zx_sb_read(fs) == -1 ||
+        (n = zx_jrecover(&fs->dev, &fs->geo, !zx_writable(fs))) == -1 ||
+        (n > 0 && !zx_writable(fs)) ||
+        (n > 0 && zx_sb_read(fs) == -1)) {
+        zx_dev_close(&fs->dev);
+        free(fs);
+        return NULL;
+    }
+
+    /*
+     * Keep both bitmaps in core, allocation never reads them back
+     */
+    imap = (__u8 *) malloc((size_t) fs->geo.g_imap_blocks * ZX_BS(fs));
+    bmap = (__u8 *) malloc((size_t) fs->geo.g_bmap_blocks * ZX_BS(fs));
+    if (imap == NULL || bmap == NULL ||
+        zx_dev_pread(&fs->dev, imap, (size_t) fs->geo.g_imap_blocks * ZX_BS(fs),
+                     (off_t) fs->geo.g_imap_start * ZX_BS(fs)) == -1 ||
+        zx_dev_pread(&fs->dev, bmap, (size_t) fs->geo.g_bmap_blocks * ZX_BS(fs),
+                     (off_t) fs->geo.g_bmap_start * ZX_BS(fs)) == -1) {
+        free(imap);
+        free(bmap);
+        zx_dev_close(&fs->dev);
+        free(fs);
+        return NULL;
+    }
+    zx_bm_init(&fs->imap, imap, fs->geo.g_inodes);
+    zx_bm_init(&fs->bmap, bmap, fs->geo.g_blocks);
+    if ((stale = zx_ag_load(fs)) == -1) {
+        free(fs->ag);
+        free(imap);
+        free(bmap);
+        zx_dev_close(&fs->dev);
+        free(fs);
+        return NULL;
+    }
+
+    /*
+     * O_SYNC writes through the cache unless there is a journal,
+     * then every operation commits instead
+     */
+    if (zx_cache_init(&fs->cache, &fs->dev, ZX_BS(fs), ZX_CACHE_SIZE / ZX_BS(fs),
+                      (flags & O_SYNC) && fs->geo.g_jnl_blocks == 0) == -1 ||
+        zx_icache_init(&fs->icache, ZX_ICACHE_INODES) == -1 ||
+        ((flags & O_ACCMODE) != O_RDONLY &&
+         zx_jopen(&fs->journal, &fs->dev, &fs->cache, &fs->geo, &fs->lock) == -1)) {
+        zx_cache_destroy(&fs->cache);
+        zx_icache_destroy(&fs->icache);
+        free(fs->ag);
+        free(imap);
+        free(bmap);
+        zx_dev_close(&fs->dev);
+        free(fs);
+        return NULL;
+    }
+
+    /*
+     * Free counts in super block and group table follow the bitmaps
+     * from here on, fix them up if they were off.
+     */
+    if (stale && (flags & O_ACCMODE) != O_RDONLY) {
+        for (ag = 0; ag < fs->geo.g_groups; ag++) {
+            zx_ag_write(fs, ag);
+        }
+    }
+    if (le32toh(fs->sb.s_free_inodes) != fs->imap.bm_free ||
+        le32toh(fs->sb.s_free_blocks) != fs->bmap.bm_free) {
+        fs->sb.s_free_inodes = htole32(fs->imap.bm_free);
+        fs->sb.s_free_blocks = htole32(fs->bmap.bm_free);
+        if ((flags & O_ACCMODE) != O_RDONLY) {
+            zx_sb_write(fs);
+        }
+    }
+
+    pthread_mutex_init(&fs->lock, NULL);
+
+    return fs;
+}
+
+/*
+ * Write out every changed inode. With a journal timestamp changes go
+ * a batch per transaction, each one committed here, the fs lock is
+ * dropped meanwhile unless hold is set.
+ */
+static int
+zx_iflush_all(zx_fs_t *fs, int hold)
+{
+    do {
+        if (zx_iflush(fs, 1) == -1) {
+            return -1;
+        }
+        if (fs->journal.j_blocks == 0) {
+            return 0;
+        }
+        if (zx_jcommit(&fs->journal, hold) == -1) {
+            return -1;
+        }
+    } while (fs->icache.ic_ntimes > 0);
+
+    return 0;
+}
+
+/*
+ * Write back cached metadata, then make it all stable. With a
+ * journal running transaction is committed first, the fs lock is
+ * dropped meanwhile unless hold is set.
+ */
+static int
+zx_do_sync(zx_fs_t *fs, int hold)
+{
+    if (zx_iflush_all(fs, hold) == -1) {
+        return -1;
+    }
+    if (fs->journal.j_blocks != 0) {
+        return zx_jcheckpoint(&fs->journal);
+    }
+    if (zx_cache_flush(&fs->cache) == -1) {
+        return -1;
+    }
+    return fsync(fs->dev.fd);
+}
+
+/*
+ * A call failed with ENOSPC while blocks freed earlier wait for their
+ * transaction to commit. Calls that undo themselves on failure end
+ * right there, so commit, unless a commit in progress would mean
+ * dropping the lock, and let the call try once more.
+ */
+static int
+zx_nospc_commit(zx_fs_t *fs)
+{
+    if (errno != ENOSPC || fs->nbfreed == 0 || fs->journal.j_busy) {
+        return -1;
+    }
+    if (zx_iflush(fs, 0) == -1 || zx_jcommit(&fs->journal, 1) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * End of an operation holding fs lock, ret is what it returns
+ */
+static long long
+zx_opdone(zx_fs_t *fs, long long ret)
+{
+    if (zx_iflush(fs, 0) == -1) {
+        ret = -1;
+    }
+    if (zx_jend(&fs->journal, (fs->flags & O_SYNC) != 0) == -1) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+int
+zx_sync(zx_fs_t *fs)
+{
+    int ret;
+
+    pthread_mutex_lock(&fs->lock);
+    ret = zx_do_sync(fs, 0);
+    pthread_mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+/*
+ * Get changes made so far and data of fd on disk. With a journal
+ * that is one commit, shared by everyone calling at the same time.
+ */
+int
+zx_fsync(zx_fs_t *fs, int fd)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    if (zx_getfile(fs, fd) != NULL) {
+        if (fs->journal.j_blocks == 0) {
+            ret = zx_do_sync(fs, 0);
+        } else {
+            ret = zx_iflush_all(fs, 0);
+        }
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+/*
+ * Sync and keep every other call out until zx_thaw(), image stays
+ * consistent even if the process dies while frozen
+ */
+int
+zx_freeze(zx_fs_t *fs)
+{
+    pthread_mutex_lock(&fs->lock);
+    if (zx_do_sync(fs, 1) == -1) {
+        pthread_mutex_unlock(&fs->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void
+zx_thaw(zx_fs_t *fs)
+{
+    pthread_mutex_unlock(&fs->lock);
+}
+
+/*
+ * Counters are read without fs lock, so this works on a frozen fs
+ */
+void
+zx_cachestat(zx_fs_t *fs, zx_cache_stat_t *cs)
+{
+    *cs = fs->cache.c_stat;
+}
+
+void
+zx_icachestat(zx_fs_t *fs, zx_icache_stat_t *is)
+{
+    *is = fs->icache.ic_stat;
+}
+
+int
+zx_jnlstat(zx_fs_t *fs, zx_jnl_stat_t *js)
+{
+    if (fs->journal.j_blocks == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    *js = fs->journal.j_stat;
+    return 0;
+}
+
+int
+zx_umount(zx_fs_t *fs)
+{
+    int ret = 0;
+
+    if (zx_writable(fs)) {
+        ret = zx_do_sync(fs, 1);
+    }
+    zx_jclose(&fs->journal);
+    zx_cache_destroy(&fs->cache);
+    zx_icache_destroy(&fs->icache);
+    zx_dev_close(&fs->dev);
+    pthread_mutex_destroy(&fs->lock);
+    free(fs->imap.bm_map);
+    free(fs->bmap.bm_map);
+    free(fs->bfreed);
+    free(fs->ag);
+    free(fs);
+
+    return ret;
+}
+
+/*
+ * Namespace operations
+ */
+static int
+zx_create(zx_fs_t *fs, zx_inode_info_t *dir, const char *name,
+          size_t len, mode_t mode, __u32 *ino)
+{
+    zx_inode_info_t in;
+    time_t now = time(NULL);
+    __u32 ag;
+
+    /*
+     * Files stay with their directory, new directories spread out
+     * over the groups
+     */
+    ag = S_ISDIR(mode) ? zx_ag_home(fs) : ZX_AG_OF(fs, dir->ii_ino);
+    if (zx_ialloc(fs, ag, ino) == -1) {
+        return -1;
+    }
+
+    memset(&in, 0, sizeof(in));
+    in.ii_ino = *ino;
+    in.ii_raw.i_mode = htole16(mode);
+    in.ii_raw.i_links = htole16(1);
+    in.ii_raw.i_atime = in.ii_raw.i_mtime = in.ii_raw.i_ctime = htole32(now);
+    in.ii_raw.i_uid = htole16(getuid());
+    in.ii_raw.i_gid = htole16(getgid());
+    if (S_ISREG(mode)) {
+        in.ii_raw.i_flags = htole16(ZX_INODE_INLINE);
+    }
+
+    if (S_ISDIR(mode)) {
+        zx_dirent_t de[ZX_DIR_PER_BLOCK(ZX_MAX_BLOCK_SIZE)];
+        __u32 pblk, run;
+
+        if (zx_resize(fs, &in, ZX_BS(fs)) == -1 ||
+            zx_bmap(&in, 0, &pblk, &run) == -1) {
+            goto fail;
+        }
+        memset(de, 0, sizeof(de));
+        de[0].d_inode = htole32(*ino);
+        strcpy(de[0].d_name, ".");
+        de[1].d_inode = htole32(dir->ii_ino);
+        strcpy(de[1].d_name, "..");
+        in.ii_raw.i_links = htole16(ZX_ROOT_INIT_LNKS);
+        if (zx_dir_write(fs, &in, pblk, de) == -1) {
+            goto fail;
+        }
+    }
+
+    if (zx_iwrite(fs, &in) == -1 ||
+        zx_dir_add(fs, dir, name, len, *ino) == -1) {
+        goto fail;
+    }
+
+    if (S_ISDIR(mode)) {
+        dir->ii_raw.i_links = htole16(le16toh(dir->ii_raw.i_links) + 1);
+        return zx_iwrite(fs, dir);
+    }
+
+    return 0;
+
+fail:
+    zx_resize(fs, &in, 0);
+    memset(&in.ii_raw, 0, ZX_INODE_SIZE);
+    zx_iwrite(fs, &in);
+    zx_ifree(fs, *ino);
+    return -1;
+}
+
+int
+zx_open(zx_fs_t *fs, const char *path, int flags, mode_t mode)
+{
+    zx_inode_info_t dir, in;
+    const char *name;
+    size_t len;
+    __u32 dino, ino;
+    int fd, ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+
+    for (fd = 0; fd < ZX_MAX_FILES; fd++) {
+        if (!fs->files[fd].f_used) {
+            break;
+        }
+    }
+    if (fd == ZX_MAX_FILES) {
+        errno = EMFILE;
+        goto out;
+    }
+
+    if (((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC))) &&
+        !zx_writable(fs)) {
+        goto out;
+    }
+
+    if (zx_walk(fs, path, &dino, &name, &len) == -1) {
+        goto out;
+    }
+    if (name == NULL) {
+        ino = dino;
+    } else {
+        if (zx_iread(fs, dino, &dir) == -1) {
+            goto out;
+        }
+        if (!S_ISDIR(le16toh(dir.ii_raw.i_mode))) {
+            errno = ENOTDIR;
+            goto out;
+        }
+        if (zx_dir_find(fs, &dir, name, len, &ino, NULL) == -1) {
+            if (errno != ENOENT || !(flags & O_CREAT)) {
+                goto out;
+            }
+            if (zx_create(fs, &dir, name, len,
+                          S_IFREG | (mode & 0777), &ino) == -1) {
+                goto out;
+            }
+        } else if ((flags & O_CREAT) && (flags & O_EXCL)) {
+            errno = EEXIST;
+            goto out;
+        }
+    }
+
+    if (zx_iread(fs, ino, &in) == -1) {
+        goto out;
+    }
+    if (S_ISDIR(le16toh(in.ii_raw.i_mode)) && (flags & O_ACCMODE) != O_RDONLY) {
+        errno = EISDIR;
+        goto out;
+    }
+    if ((flags & O_DIRECTORY) && !S_ISDIR(le16toh(in.ii_raw.i_mode))) {
+        errno = ENOTDIR;
+        goto out;
+    }
+    if ((flags & O_TRUNC) && S_ISREG(le16toh(in.ii_raw.i_mode))) {
+        if (zx_resize(fs, &in, 0) == -1) {
+            zx_iwrite(fs, &in);
+            goto out;
+        }
+        in.ii_raw.i_mtime = in.ii_raw.i_ctime = htole32(time(NULL));
+        if (zx_iwrite(fs, &in) == -1) {
+            goto out;
+        }
+    }
+
+    fs->files[fd].f_used = 1;
+    fs->files[fd].f_flags = flags;
+    fs->files[fd].f_ino = ino;
+    fs->files[fd].f_pos = 0;
+    fs->files[fd].f_ra_next = 0;
+    fs->files[fd].f_ra_end = 0;
+    fs->files[fd].f_ra_win = 0;
+    ret = fd;
+
+out:
+    return zx_opdone(fs, ret);
+}
+
+int
+zx_close(zx_fs_t *fs, int fd)
+{
+    zx_file_t *f;
+    zx_inode_info_t in;
+    int ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+
+    if ((f = zx_getfile(fs, fd)) == NULL) {
+        goto out;
+    }
+    f->f_used = 0;
+    ret = 0;
+
+    /*
+     * Last close of an unlinked inode releases it
+     */
+    if (!zx_iopen(fs, f->f_ino) &&
+        zx_iread(fs, f->f_ino, &in) == 0 &&
+        le16toh(in.ii_raw.i_links) == 0 &&
+        zx_inode_used(fs, f->f_ino)) {
+        ret = zx_idrop(fs, f->f_ino);
+    }
+
+out:
+    return zx_opdone(fs, ret);
+}
+
+/*
+ * Data path, caller holds fs lock
+ */
+static ssize_t
+zx_do_read(zx_fs_t *fs, zx_file_t *f, void *buf, size_t count, off_t off)
+{
+    zx_inode_info_t in;
+    off_t size;
+    time_t now = time(NULL);
+
+    if ((f->f_flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if (off < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (zx_iread(fs, f->f_ino, &in) == -1) {
+        return -1;
+    }
+    if (S_ISDIR(le16toh(in.ii_raw.i_mode))) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    size = le32toh(in.ii_raw.i_size);
+    if (off >= size) {
+        return 0;
+    }
+    if (count > size - off) {
+        count = size - off;
+    }
+    zx_readahead(fs, f, &in, off, count);
+    if (zx_irw(fs, &in, (char *) buf, count, off, 0) == -1) {
+        return -1;
+    }
+
+    if (zx_writable(fs) && zx_atime_due(fs, &in, now)) {
+        in.ii_raw.i_atime = htole32(now);
+        zx_itouch(fs, &in);
+    }
+
+    return count;
+}
+
+static ssize_t
+zx_do_write(zx_fs_t *fs, zx_file_t *f, const void *buf, size_t count, off_t off)
+{
+    zx_inode_info_t in;
+    off_t size, old, end;
+    time_t now = time(NULL);
+    int grew = 0, err;
+
+    if ((f->f_flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if (off < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (zx_iread(fs, f->f_ino, &in) == -1) {
+        return -1;
+    }
+    if (f->f_flags & O_APPEND) {
+        off = le32toh(in.ii_raw.i_size);
+    }
+    if (off + count > ZX_MAX_FILE_SIZE) {
+        if (off >= ZX_MAX_FILE_SIZE) {
+            errno = EFBIG;
+            return -1;
+        }
+        count = ZX_MAX_FILE_SIZE - off;
+    }
+
+    /*
+     * Newly mapped blocks are not cleared by allocator, zero only
+     * the parts of them this write does not cover.
+     */
+    size = le32toh(in.ii_raw.i_size);
+    if (off + count > size) {
+        old = zx_mapped(fs, &in);
+        if (zx_resize(fs, &in, off + count) == -1) {
+            zx_iwrite(fs, &in);
+            return -1;
+        }
+        end = zx_mapped(fs, &in);
+        if (zx_zero_range(fs, &in, old, off) == -1 ||
+            zx_zero_range(fs, &in, (off + count > old) ? off + count : old, end) == -1) {
+            goto undo;
+        }
+        grew = 1;
+    }
+    if (zx_irw(fs, &in, (char *) buf, count, off, 1) == -1) {
+        goto undo;
+    }
+
+    /*
+     * Overwriting blocks in place only touches timestamps, data of
+     * an inline file lives in the inode though
+     */
+    in.ii_raw.i_mtime = in.ii_raw.i_ctime = htole32(now);
+    if (grew || ZX_INLINE(&in)) {
+        if (zx_iwrite(fs, &in) == -1) {
+            return -1;
+        }
+    } else if (zx_itouch(fs, &in) == -1) {
+        return -1;
+    }
+
+    return count;
+
+    /*
+     * Blocks the grow mapped may hold anything, drop them again
+     */
+undo:
+    if (off + count > size) {
+        err = errno;
+        zx_resize(fs, &in, size);
+        zx_iwrite(fs, &in);
+        errno = err;
+    }
+    return -1;
+}
+
+ssize_t
+zx_pread(zx_fs_t *fs, int fd, void *buf, size_t count, off_t off)
+{
+    zx_file_t *f;
+    ssize_t ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((f = zx_getfile(fs, fd)) != NULL) {
+        ret = zx_do_read(fs, f, buf, count, off);
+    }
+    return zx_opdone(fs, ret);
+}
+
+ssize_t
+zx_pwrite(zx_fs_t *fs, int fd, const void *buf, size_t count, off_t off)
+{
+    zx_file_t *f;
+    ssize_t ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((f = zx_getfile(fs, fd)) != NULL) {
+        if ((ret = zx_do_write(fs, f, buf, count, off)) == -1 && zx_nospc_commit(fs) == 0) {
+            ret = zx_do_write(fs, f, buf, count, off);
+        }
+    }
+    return zx_opdone(fs, ret);
+}
+
+ssize_t
+zx_read(zx_fs_t *fs, int fd, void *buf, size_t count)
+{
+    zx_file_t *f;
+    ssize_t ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((f = zx_getfile(fs, fd)) != NULL) {
+        if ((ret = zx_do_read(fs, f, buf, count, f->f_pos)) > 0) {
+            f->f_pos += ret;
+        }
+    }
+    return zx_opdone(fs, ret);
+}
+
+ssize_t
+zx_write(zx_fs_t *fs, int fd, const void *buf, size_t count)
+{
+    zx_file_t *f;
+    zx_inode_info_t in;
+    ssize_t ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((f = zx_getfile(fs, fd)) != NULL) {
+        if ((ret = zx_do_write(fs, f, buf, count, f->f_pos)) == -1 && zx_nospc_commit(fs) == 0) {
+            ret = zx_do_write(fs, f, buf, count, f->f_pos);
+        }
+        if (ret > 0) {
+            if ((f->f_flags & O_APPEND) && zx_iread(fs, f->f_ino, &in) == 0) {
+                f->f_pos = le32toh(in.ii_raw.i_size);
+            } else {
+                f->f_pos += ret;
+            }
+        }
+    }
+    return zx_opdone(fs, ret);
+}
+
+off_t
+zx_lseek(zx_fs_t *fs, int fd, off_t off, int whence)
+{
+    zx_file_t *f;
+    zx_inode_info_t in;
+    off_t ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((f = zx_getfile(fs, fd)) == NULL) {
+        goto out;
+    }
+    switch (whence) {
+        case SEEK_SET:
+            break;
+        case SEEK_CUR:
+            off += f->f_pos;
+            break;
+        case SEEK_END:
+            if (zx_iread(fs, f->f_ino, &in) == -1) {
+                goto out;
+            }
+            off += le32toh(in.ii_raw.i_size);
+            break;
+        default:
+            errno = EINVAL;
+            goto out;
+    }
+    if (off < 0) {
+        errno = EINVAL;
+        goto out;
+    }
+    ret = f->f_pos = off;
+
+out:
+    return zx_opdone(fs, ret);
+}
+
+static int
+zx_do_truncate(zx_fs_t *fs, __u32 ino, off_t len)
+{
+    zx_inode_info_t in;
+    off_t size, old;
+    int err;
+
+    if (len < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (zx_iread(fs, ino, &in) == -1) {
+        return -1;
+    }
+    if (S_ISDIR(le16toh(in.ii_raw.i_mode))) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    /*
+     * Shrinking inside last block leaves stale bytes behind, clear
+     * them so a later grow reads back zeros. Growing clears blocks
+     * it maps. Inline data is cleared by zx_resize().
+     */
+    if (!ZX_INLINE(&in) && len < le32toh(in.ii_raw.i_size) && (len % ZX_BS(fs)) != 0) {
+        if (zx_zero_range(fs, &in, len, len - (len % ZX_BS(fs)) + ZX_BS(fs)) == -1) {
+            return -1;
+        }
+    }
+    size = le32toh(in.ii_raw.i_size);
+    old = zx_mapped(fs, &in);
+    if (zx_resize(fs, &in, len) == -1) {
+        zx_iwrite(fs, &in);
+        return -1;
+    }
+    if (zx_zero_range(fs, &in, old, zx_mapped(fs, &in)) == -1) {
+        err = errno;
+        zx_resize(fs, &in, size);
+        zx_iwrite(fs, &in);
+        errno = err;
+        return -1;
+    }
+
+    in.ii_raw.i_mtime = in.ii_raw.i_ctime = htole32(time(NULL));
+    return zx_iwrite(fs, &in);
+}
+
+int
+zx_ftruncate(zx_fs_t *fs, int fd, off_t len)
+{
+    zx_file_t *f;
+    int ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((f = zx_getfile(fs, fd)) != NULL) {
+        if ((f->f_flags & O_ACCMODE) == O_RDONLY) {
+            errno = EBADF;
+        } else {
+            if ((ret = zx_do_truncate(fs, f->f_ino, len)) == -1 && zx_nospc_commit(fs) == 0) {
+                ret = zx_do_truncate(fs, f->f_ino, len);
+            }
+        }
+    }
+    return zx_opdone(fs, ret);
+}
+
+int
+zx_truncate(zx_fs_t *fs, const char *path, off_t len)
+{
+    __u32 ino;
+    int ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    if (zx_writable(fs) && zx_namei(fs, path, &ino) == 0) {
+        if ((ret = zx_do_truncate(fs, ino, len)) == -1 && zx_nospc_commit(fs) == 0) {
+            ret = zx_do_truncate(fs, ino, len);
+        }
+    }
+    return zx_opdone(fs, ret);
+}
+
+static int
+zx_do_stat(zx_fs_t *fs, __u32 ino, zx_stat_t *st)
+{
+    zx_inode_info_t in;
+
+    if (zx_iread(fs, ino, &in) == -1) {
+        return -1;
+    }
+
+    st->zs_ino = ino;
+    st->zs_mode = le16toh(in.ii_raw.i_mode);
+    st->zs_links = le16toh(in.ii_raw.i_links);
+    st->zs_uid = le16toh(in.ii_raw.i_uid);
+    st->zs_gid = le16toh(in.ii_raw.i_gid);
+    st->zs_size = le32toh(in.ii_raw.i_size);
+    st->zs_blocks = le32toh(in.ii_raw.i_blocks);
+    st->zs_atime = le32toh(in.ii_raw.i_atime);
+    st->zs_mtime = le32toh(in.ii_raw.i_mtime);
+    st->zs_ctime = le32toh(in.ii_raw.i_ctime);
+
+    return 0;
+}
+
+int
+zx_stat(zx_fs_t *fs, const char *path, zx_stat_t *st)
+{
+    __u32 ino;
+    int ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    if (zx_namei(fs, path, &ino) == 0) {
+        ret = zx_do_stat(fs, ino, st);
+    }
+    return zx_opdone(fs, ret);
+}
+
+int
+zx_fstat(zx_fs_t *fs, int fd, zx_stat_t *st)
+{
+    zx_file_t *f;
+    int ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((f = zx_getfile(fs, fd)) != NULL) {
+        ret = zx_do_stat(fs, f->f_ino, st);
+    }
+    return zx_opdone(fs, ret);
+}
+
+int
+zx_mkdir(zx_fs_t *fs, const char *path, mode_t mode)
+{
+    zx_inode_info_t dir;
+    const char *name;
+    size_t len;
+    __u32 ino;
+    int ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+
+    if (!zx_writable(fs) ||
+        zx_nameiparent(fs, path, &dir, &name, &len) == -1) {
+        goto out;
+    }
+    if (zx_dir_find(fs, &dir, name, len, &ino, NULL) == 0) {
+        errno = EEXIST;
+        goto out;
+    }
+    if (errno != ENOENT) {
+        goto out;
+    }
+    ret = zx_create(fs, &dir, name, len, S_IFDIR | (mode & 0777), &ino);
+
+out:
+    return zx_opdone(fs, ret);
+}
+
+/*
+ * Common part of unlink and rmdir
+ */
+static int
+zx_remove(zx_fs_t *fs, const char *path, int isdir)
+{
+    zx_inode_info_t dir, in;
+    const char *name;
+    size_t len;
+    __u32 ino;
+    off_t slot;
+
+    if (!zx_writable(fs) ||
+        zx_nameiparent(fs, path, &dir, &name, &len) == -1) {
+        return -1;
+    }
+    if ((len == 1 && name[0] == '.') ||
+        (len == 2 && name[0] == '.' && name[1] == '.')) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (zx_dir_find(fs, &dir, name, len, &ino, &slot) == -1 ||
+        zx_iread(fs, ino, &in) == -1) {
+        return -1;
+    }
+
+    if (isdir) {
+        if (!S_ISDIR(le16toh(in.ii_raw.i_mode))) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        switch (zx_dir_empty(fs, &in)) {
+            case -1:
+                return -1;
+            case 0:
+                errno = ENOTEMPTY;
+                return -1;
+        }
+    } else if (S_ISDIR(le16toh(in.ii_raw.i_mode))) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    if (zx_dir_del(fs, &dir, name, len, slot) == -1) {
+        return -1;
+    }
+
+    if (isdir) {
+        dir.ii_raw.i_links = htole16(le16toh(dir.ii_raw.i_links) - 1);
+        if (zx_iwrite(fs, &dir) == -1) {
+            return -1;
+        }
+        return zx_idrop(fs, ino);
+    }
+
+    in.ii_raw.i_links = htole16(le16toh(in.ii_raw.i_links) - 1);
+    in.ii_raw.i_ctime = htole32(time(NULL));
+    if (zx_iwrite(fs, &in) == -1) {
+        return -1;
+    }
+    if (le16toh(in.ii_raw.i_links) == 0 && !zx_iopen(fs, ino)) {
+        return zx_idrop(fs, ino);
+    }
+
+    return 0;
+}
+
+int
+zx_unlink(zx_fs_t *fs, const char *path)
+{
+    int ret;
+
+    pthread_mutex_lock(&fs->lock);
+    ret = zx_remove(fs, path, 0);
+    return zx_opdone(fs, ret);
+}
+
+int
+zx_rmdir(zx_fs_t *fs, const char *path)
+{
+    int ret;
+
+    pthread_mutex_lock(&fs->lock);
+    ret = zx_remove(fs, path, 1);
+    return zx_opdone(fs, ret);
+}
+
+/*
+ * Return next entry of directory opened as fd: 1 when *de is filled,
+ * 0 at end of directory, -1 on error.
+ */
+int
+zx_readdir(zx_fs_t *fs, int fd, zx_dirent_t *de)
+{
+    zx_file_t *f;
+    zx_inode_info_t in;
+    zx_dirent_t blk[ZX_DIR_PER_BLOCK(ZX_MAX_BLOCK_SIZE)];
+    __u32 pblk, lblk = ZX_DX_NONE;
+    int ret = -1;
+
+    pthread_mutex_lock(&fs->lock);
+
+    if ((f = zx_getfile(fs, fd)) == NULL ||
+        zx_iread(fs, f->f_ino, &in) == -1) {
+        goto out;
+    }
+    if (!S_ISDIR(le16toh(in.ii_raw.i_mode))) {
+        errno = ENOTDIR;
+        goto out;
+    }
+
+    ret = 0;
+    while (f->f_pos + ZX_DIR_SIZE <= le32toh(in.ii_raw.i_size)) {
+        if (f->f_pos / ZX_BS(fs) != lblk) {
+            lblk = f->f_pos / ZX_BS(fs);
+            if (zx_dir_read(fs, &in, lblk, blk, &pblk) == -1) {
+                ret = -1;
+                break;
+            }
+        }
+        memcpy(de, &blk[(f->f_pos % ZX_BS(fs)) / ZX_DIR_SIZE], ZX_DIR_SIZE);
+        f->f_pos += ZX_DIR_SIZE;
+        if (de->d_name[0] != '\0') {
+            ret = 1;
+            break;
+        }
+    }
+
+out:
+    return zx_opdone(fs, ret);
+}
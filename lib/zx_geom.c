@@ -0,0 +1,275 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  lib/zx_geom.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Geometry of zxfs: where bitmaps, inode table and data blocks live
+ *  for given block size, number of inodes and device size.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <endian.h>
+#include "libzx.h"
+
+#define DIV_ROUND_UP(n, d)  (((n) + (d) - 1) / (d))
+
+/*
+ * Block size is a power of two from ZX_MIN_BLOCK_SIZE to
+ * ZX_MAX_BLOCK_SIZE, returns its s_log_bsize or -1
+ */
+int
+zx_geom_bshift(__u32 bsize)
+{
+    int shift;
+
+    for (shift = 0; (ZX_MIN_BLOCK_SIZE << shift) <= ZX_MAX_BLOCK_SIZE; shift++) {
+        if ((__u32) (ZX_MIN_BLOCK_SIZE << shift) == bsize) {
+            return shift;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Journal blocks a transaction may need at most. Commit is due when
+ * the running transaction reaches a quarter of the log, while the one
+ * before is written it may grow to half, then by one operation and
+ * the inodes with only timestamps changed going along with it (a
+ * sixteenth of the log). One operation changes at most every block
+ * bitmap and group table block, a directory index and
+ * ZX_JNL_OP_BLOCKS more, with three times that the transaction and
+ * its descriptors always fit the log.
+ */
+static __u32
+zx_geom_jnl_need(__u32 gdt_blocks, __u32 bmap_blocks)
+{
+    __u32 op = gdt_blocks + bmap_blocks + 1 + ZX_DX_MAX_BLOCKS + ZX_JNL_OP_BLOCKS;
+
+    return (3 * op < ZX_JNL_MIN) ? ZX_JNL_MIN : 3 * op;
+}
+
+/*
+ * Lay out a file system of dev_blocks blocks of bsize bytes with
+ * given number of inodes (0 picks one inode per ZX_BLOCKS_PER_INODE
+ * data blocks), a journal of up to jnl blocks, no more than 1/16
+ * of the device but never less than the largest operation needs (0
+ * makes none), and allocation groups of ag_blocks data blocks (0
+ * picks ZX_DEF_AG_BLOCKS). Extents hold 32 bit block numbers,
+ * anything past that is left unused.
+ */
+int
+zx_geom_make(zx_geom_t *g, __u32 bsize, __u64 dev_blocks, __u32 inodes,
+             __u32 jnl, __u32 ag_blocks)
+{
+    __u64 max_blocks = 0xffffffffULL;
+    __u64 left;
+    __u32 ipb = ZX_INODE_PER_BLOCK(bsize), need;
+
+    if (ag_blocks == 0) {
+        ag_blocks = ZX_DEF_AG_BLOCKS(bsize);
+    }
+    if (zx_geom_bshift(bsize) == -1 || ag_blocks % 8 != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (dev_blocks > max_blocks) {
+        dev_blocks = max_blocks;
+    }
+    if (dev_blocks <= ZX_SUPER_END(bsize)) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (inodes == 0) {
+        inodes = (dev_blocks - ZX_SUPER_END(bsize)) / ZX_BLOCKS_PER_INODE;
+        if (inodes < ZX_DEF_INODES) {
+            inodes = ZX_DEF_INODES;
+        }
+    }
+
+    g->g_bsize = bsize;
+    g->g_inodes = inodes;
+
+    /*
+     * Group table is sized for groups covering whole device, data
+     * region comes out smaller so it may have an entry or two spare
+     */
+    g->g_gdt_start = ZX_SUPER_END(bsize);
+    g->g_gdt_blocks = DIV_ROUND_UP(DIV_ROUND_UP(dev_blocks, ag_blocks),
+                                   ZX_GROUP_PER_BLOCK(bsize));
+    g->g_imap_start = g->g_gdt_start + g->g_gdt_blocks;
+    g->g_imap_blocks = DIV_ROUND_UP(inodes, ZX_BITS_PER_BLOCK(bsize));
+    g->g_inode_blocks = DIV_ROUND_UP((__u64) inodes * ZX_INODE_SIZE, bsize);
+    left = (__u64) g->g_imap_start + g->g_imap_blocks + g->g_inode_blocks;
+    if (jnl != 0 && dev_blocks > left) {
+        if (jnl > dev_blocks / 16) {
+            jnl = dev_blocks / 16;
+        }
+
+        /*
+         * Bitmap comes out smaller with the journal in place, size
+         * for it as if there was none
+         */
+        left = dev_blocks - left;
+        need = zx_geom_jnl_need(g->g_gdt_blocks, DIV_ROUND_UP(left, ZX_BITS_PER_BLOCK(bsize)));
+        if (jnl < need) {
+            jnl = need;
+        }
+    }
+    g->g_jnl_blocks = jnl;
+
+    /*
+     * Block bitmap size depends on number of data blocks and the
+     * other way round, size bitmap for everything left and give
+     * what it does not use to data.
+     */
+    if (dev_blocks < (__u64) g->g_imap_start + g->g_imap_blocks + g->g_inode_blocks +
+                     g->g_jnl_blocks + 2) {
+        errno = ENOSPC;
+        return -1;
+    }
+    left = dev_blocks - g->g_imap_start - g->g_imap_blocks - g->g_inode_blocks -
+           g->g_jnl_blocks;
+    g->g_bmap_start = g->g_imap_start + g->g_imap_blocks;
+    g->g_bmap_blocks = DIV_ROUND_UP(left, ZX_BITS_PER_BLOCK(bsize));
+    g->g_inode_start = g->g_bmap_start + g->g_bmap_blocks;
+    g->g_jnl_start = g->g_inode_start + g->g_inode_blocks;
+    g->g_data_start = g->g_jnl_start + g->g_jnl_blocks;
+    g->g_blocks = dev_blocks - g->g_data_start;
+    g->g_itable_unused = 0;
+
+    /*
+     * Inodes are dealt evenly to groups in whole inode table blocks
+     */
+    g->g_ag_blocks = ag_blocks;
+    g->g_groups = DIV_ROUND_UP(g->g_blocks, ag_blocks);
+    g->g_ag_inodes = DIV_ROUND_UP(DIV_ROUND_UP(inodes, g->g_groups), ipb) * ipb;
+
+    return 0;
+}
+
+void
+zx_geom_load(zx_geom_t *g, const zx_super_t *sb)
+{
+    __u32 shift = le32toh(sb->s_log_bsize);
+
+    g->g_bsize = (shift <= 3) ? ZX_MIN_BLOCK_SIZE << shift : 0;
+    g->g_inodes = le32toh(sb->s_inodes_count);
+    g->g_blocks = le32toh(sb->s_blocks_count);
+    g->g_imap_start = le32toh(sb->s_imap_start);
+    g->g_imap_blocks = le32toh(sb->s_imap_blocks);
+    g->g_bmap_start = le32toh(sb->s_bmap_start);
+    g->g_bmap_blocks = le32toh(sb->s_bmap_blocks);
+    g->g_inode_start = le32toh(sb->s_inode_start);
+    g->g_inode_blocks = le32toh(sb->s_inode_blocks);
+    g->g_jnl_start = le32toh(sb->s_jnl_start);
+    g->g_jnl_blocks = le32toh(sb->s_jnl_blocks);
+    g->g_data_start = le32toh(sb->s_data_start);
+    g->g_itable_unused = le32toh(sb->s_itable_unused);
+    g->g_gdt_start = le32toh(sb->s_gdt_start);
+    g->g_gdt_blocks = le32toh(sb->s_gdt_blocks);
+    g->g_ag_inodes = le32toh(sb->s_ag_inodes);
+    g->g_ag_blocks = le32toh(sb->s_ag_blocks);
+    if (g->g_gdt_blocks == 0) {
+        g->g_ag_inodes = g->g_inodes;
+        g->g_ag_blocks = g->g_blocks;
+    }
+    g->g_groups = (g->g_ag_blocks != 0) ? DIV_ROUND_UP(g->g_blocks, g->g_ag_blocks) : 0;
+}
+
+void
+zx_geom_store(const zx_geom_t *g, zx_super_t *sb)
+{
+    sb->s_inodes_count = htole32(g->g_inodes);
+    sb->s_blocks_count = htole32(g->g_blocks);
+    sb->s_imap_start = htole32(g->g_imap_start);
+    sb->s_imap_blocks = htole32(g->g_imap_blocks);
+    sb->s_bmap_start = htole32(g->g_bmap_start);
+    sb->s_bmap_blocks = htole32(g->g_bmap_blocks);
+    sb->s_inode_start = htole32(g->g_inode_start);
+    sb->s_inode_blocks = htole32(g->g_inode_blocks);
+    sb->s_jnl_start = htole32(g->g_jnl_start);
+    sb->s_jnl_blocks = htole32(g->g_jnl_blocks);
+    sb->s_data_start = htole32(g->g_data_start);
+    sb->s_log_bsize = htole32(zx_geom_bshift(g->g_bsize));
+    sb->s_itable_unused = htole32(g->g_itable_unused);
+    sb->s_gdt_start = htole32(g->g_gdt_start);
+    sb->s_gdt_blocks = htole32(g->g_gdt_blocks);
+    sb->s_ag_inodes = htole32(g->g_ag_inodes);
+    sb->s_ag_blocks = htole32(g->g_ag_blocks);
+}
+
+/*
+ * Sanity check geometry read from disk against device of dev_size
+ * bytes, regions must follow each other and fit on device.
+ */
+int
+zx_geom_check(const zx_geom_t *g, off_t dev_size)
+{
+    __u32 bs = g->g_bsize;
+
+    if (zx_geom_bshift(bs) == -1 || g->g_inodes == 0 || g->g_blocks == 0 ||
+        (g->g_gdt_blocks != 0 && (g->g_gdt_start != ZX_SUPER_END(bs) ||
+                                  g->g_gdt_blocks < DIV_ROUND_UP(g->g_groups, ZX_GROUP_PER_BLOCK(bs)) ||
+                                  g->g_ag_inodes % ZX_INODE_PER_BLOCK(bs) != 0 ||
+                                  g->g_ag_blocks % 8 != 0)) ||
+        g->g_ag_inodes == 0 || g->g_ag_blocks == 0 ||
+        (__u64) g->g_ag_inodes * g->g_groups < g->g_inodes ||
+        g->g_imap_start != ZX_SUPER_END(bs) + g->g_gdt_blocks ||
+        g->g_imap_blocks < DIV_ROUND_UP(g->g_inodes, ZX_BITS_PER_BLOCK(bs)) ||
+        g->g_bmap_start != g->g_imap_start + g->g_imap_blocks ||
+        g->g_bmap_blocks < DIV_ROUND_UP(g->g_blocks, ZX_BITS_PER_BLOCK(bs)) ||
+        g->g_inode_start != g->g_bmap_start + g->g_bmap_blocks ||
+        g->g_inode_blocks < DIV_ROUND_UP((__u64) g->g_inodes * ZX_INODE_SIZE, bs) ||
+        g->g_itable_unused >= g->g_inode_blocks ||
+        (g->g_jnl_blocks != 0 && (g->g_jnl_start != g->g_inode_start + g->g_inode_blocks ||
+                                  g->g_jnl_blocks < ZX_JNL_MIN)) ||
+        g->g_data_start != g->g_inode_start + g->g_inode_blocks + g->g_jnl_blocks ||
+        ((__u64) g->g_data_start + g->g_blocks) * bs > (__u64) dev_size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Inodes of allocation group ag, returns how many and first one in
+ * *first. Last groups may come out short or empty.
+ */
+__u32
+zx_geom_ag_inodes(const zx_geom_t *g, __u32 ag, __u32 *first)
+{
+    __u64 lo = (__u64) ag * g->g_ag_inodes;
+
+    if (lo >= g->g_inodes) {
+        *first = g->g_inodes;
+        return 0;
+    }
+    *first = lo;
+    return (g->g_inodes - lo < g->g_ag_inodes) ? g->g_inodes - lo : g->g_ag_inodes;
+}
+
+/*
+ * Data blocks of allocation group ag, as for zx_geom_ag_inodes().
+ * Numbers are data block (block bitmap bit) numbers, not device ones.
+ */
+__u32
+zx_geom_ag_blocks(const zx_geom_t *g, __u32 ag, __u32 *first)
+{
+    __u64 lo = (__u64) ag * g->g_ag_blocks;
+
+    if (lo >= g->g_blocks) {
+        *first = g->g_blocks;
+        return 0;
+    }
+    *first = lo;
+    return (g->g_blocks - lo < g->g_ag_blocks) ? g->g_blocks - lo : g->g_ag_blocks;
+}
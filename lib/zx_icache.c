@@ -0,0 +1,378 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  lib/zx_icache.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Cache of decoded inodes.
+ *
+ *  Inodes are found through a hash of inode number. They are carved
+ *  in chunks from an arena that only grows, up to ic_max of them,
+ *  past that the least recently used clean inode is reclaimed. Freed
+ *  ones go on a free list, nothing is given back before destroy.
+ *
+ *  A cached inode holds the on disk copy and the runs that fit in the
+ *  inode, callers get and give whole extent lists through
+ *  zx_icache_load() and zx_icache_store(). Only inodes with an
+ *  overflow extent block carry an array of the rest.
+ *
+ *  A changed inode is only marked dirty here. The engine writes all
+ *  dirty inodes out at the end of each operation, walking them in
+ *  inode number order (zx_icache_sorted()) so that inodes sharing an
+ *  inode table block go out together.
+ *
+ *  An inode whose timestamps alone changed is not dirty, it is kept
+ *  on the timestamp list instead and goes out with the next real
+ *  change to it or when zx_icache_expire() makes a batch from the
+ *  list dirty. Neither kind is reclaimed, nor is anything still on
+ *  the list.
+ *
+ *  Callers serialize, the cache has no lock of its own.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "libzx.h"
+
+#define ZX_ICACHE_CHUNK     64      /* inodes per arena chunk */
+
+static zx_icache_ent_t **
+zx_icache_bucket(zx_icache_t *ic, __u32 ino)
+{
+    return &ic->ic_hash[(ino ^ (ino >> 10)) & ic->ic_hmask];
+}
+
+static void
+zx_icache_unhash(zx_icache_t *ic, zx_icache_ent_t *ie)
+{
+    zx_icache_ent_t **pp;
+
+    for (pp = zx_icache_bucket(ic, ie->ie_ino); *pp != NULL; pp = &(*pp)->ie_hnext) {
+        if (*pp == ie) {
+            *pp = ie->ie_hnext;
+            break;
+        }
+    }
+}
+
+static void
+zx_lru_unlink(zx_icache_t *ic, zx_icache_ent_t *ie)
+{
+    if (ie->ie_prev != NULL) {
+        ie->ie_prev->ie_next = ie->ie_next;
+    } else {
+        ic->ic_head = ie->ie_next;
+    }
+    if (ie->ie_next != NULL) {
+        ie->ie_next->ie_prev = ie->ie_prev;
+    } else {
+        ic->ic_tail = ie->ie_prev;
+    }
+}
+
+static void
+zx_lru_push(zx_icache_t *ic, zx_icache_ent_t *ie)
+{
+    ie->ie_prev = NULL;
+    ie->ie_next = ic->ic_head;
+    if (ic->ic_head != NULL) {
+        ic->ic_head->ie_prev = ie;
+    } else {
+        ic->ic_tail = ie;
+    }
+    ic->ic_head = ie;
+}
+
+int
+zx_icache_init(zx_icache_t *ic, __u32 max)
+{
+    __u32 n;
+
+    memset(ic, 0, sizeof(zx_icache_t));
+    for (n = 1; n < max; n <<= 1)
+        ;
+    ic->ic_max = max;
+    ic->ic_hmask = n - 1;
+    ic->ic_hash = (zx_icache_ent_t **) calloc(n, sizeof(zx_icache_ent_t *));
+    ic->ic_sort = (zx_icache_ent_t **) malloc(max * sizeof(zx_icache_ent_t *));
+    ic->ic_arena = (char **) calloc((max + ZX_ICACHE_CHUNK - 1) / ZX_ICACHE_CHUNK,
+                                    sizeof(char *));
+    if (ic->ic_hash == NULL || ic->ic_sort == NULL || ic->ic_arena == NULL) {
+        zx_icache_destroy(ic);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Release everything, dirty inodes are lost
+ */
+void
+zx_icache_destroy(zx_icache_t *ic)
+{
+    zx_icache_ent_t *ie;
+    __u32 i;
+
+    for (ie = ic->ic_head; ie != NULL; ie = ie->ie_next) {
+        free(ie->ie_xrun);
+    }
+    for (i = 0; ic->ic_arena != NULL && i < ic->ic_narena; i++) {
+        free(ic->ic_arena[i]);
+    }
+    free(ic->ic_arena);
+    free(ic->ic_hash);
+    free(ic->ic_sort);
+    ic->ic_arena = NULL;
+    ic->ic_hash = NULL;
+    ic->ic_sort = NULL;
+}
+
+/*
+ * Unused inode: off the free list, carved from the arena or the
+ * least recently used clean one
+ */
+static zx_icache_ent_t *
+zx_icache_new(zx_icache_t *ic)
+{
+    zx_icache_ent_t *ie;
+    char *chunk;
+
+    if ((ie = ic->ic_free) != NULL) {
+        ic->ic_free = ie->ie_next;
+        return ie;
+    }
+    if (ic->ic_count < ic->ic_max) {
+        if (ic->ic_count % ZX_ICACHE_CHUNK == 0) {
+            if ((chunk = (char *) malloc(ZX_ICACHE_CHUNK * sizeof(zx_icache_ent_t))) == NULL) {
+                return NULL;
+            }
+            ic->ic_arena[ic->ic_narena++] = chunk;
+        }
+        ie = (zx_icache_ent_t *) ic->ic_arena[ic->ic_narena - 1];
+        return &ie[ic->ic_count++ % ZX_ICACHE_CHUNK];
+    }
+    for (ie = ic->ic_tail; ie != NULL; ie = ie->ie_prev) {
+        if (!(ie->ie_flags & (ZX_II_DIRTY | ZX_II_TIMES | ZX_II_TLIST))) {
+            zx_icache_unhash(ic, ie);
+            zx_lru_unlink(ic, ie);
+            free(ie->ie_xrun);
+            ic->ic_stat.is_reclaims++;
+            return ie;
+        }
+    }
+
+    errno = ENOBUFS;                    /* everything waits for write */
+    return NULL;
+}
+
+/*
+ * Cached inode ino, most recently used from now on. One that was not
+ * cached comes back with *fresh set and only ie_ino filled in.
+ */
+zx_icache_ent_t *
+zx_icache_get(zx_icache_t *ic, __u32 ino, int *fresh)
+{
+    zx_icache_ent_t *ie, **pp;
+
+    for (ie = *zx_icache_bucket(ic, ino); ie != NULL; ie = ie->ie_hnext) {
+        if (ie->ie_ino == ino) {
+            ic->ic_stat.is_hits++;
+            zx_lru_unlink(ic, ie);
+            zx_lru_push(ic, ie);
+            *fresh = 0;
+            return ie;
+        }
+    }
+    ic->ic_stat.is_misses++;
+
+    if ((ie = zx_icache_new(ic)) == NULL) {
+        return NULL;
+    }
+    ie->ie_ino = ino;
+    ie->ie_flags = 0;
+    ie->ie_nrun = 0;
+    ie->ie_xrun = NULL;
+    pp = zx_icache_bucket(ic, ino);
+    ie->ie_hnext = *pp;
+    *pp = ie;
+    zx_lru_push(ic, ie);
+    *fresh = 1;
+
+    return ie;
+}
+
+/*
+ * Give back a clean inode that should not stay cached
+ */
+void
+zx_icache_put(zx_icache_t *ic, zx_icache_ent_t *ie)
+{
+    zx_icache_unhash(ic, ie);
+    zx_lru_unlink(ic, ie);
+    free(ie->ie_xrun);
+    ie->ie_next = ic->ic_free;
+    ic->ic_free = ie;
+}
+
+/*
+ * Hand out a copy of cached inode, whole extent list decoded
+ */
+void
+zx_icache_load(zx_inode_info_t *ii, const zx_icache_ent_t *ie)
+{
+    __u32 n = (ie->ie_nrun < ZX_INODE_EXTENTS) ? ie->ie_nrun : ZX_INODE_EXTENTS;
+
+    ii->ii_ino = ie->ie_ino;
+    ii->ii_xdirty = 0;
+    ii->ii_nrun = ie->ie_nrun;
+    memcpy(&ii->ii_raw, &ie->ie_raw, ZX_INODE_SIZE);
+    memcpy(ii->ii_run, ie->ie_run, n * sizeof(zx_run_t));
+    if (ie->ie_nrun > n) {
+        memcpy(ii->ii_run + n, ie->ie_xrun, (ie->ie_nrun - n) * sizeof(zx_run_t));
+    }
+}
+
+/*
+ * Take in a copy of inode, overflow runs get their own array sized to
+ * fit. Cached inode is left as it was when that cannot be had.
+ */
+int
+zx_icache_store(zx_icache_ent_t *ie, const zx_inode_info_t *ii)
+{
+    __u32 n = (ii->ii_nrun < ZX_INODE_EXTENTS) ? ii->ii_nrun : ZX_INODE_EXTENTS;
+    zx_run_t *x = NULL;
+
+    if (ii->ii_nrun > ZX_INODE_EXTENTS) {
+        x = ie->ie_xrun;
+        if (ii->ii_nrun != ie->ie_nrun || x == NULL) {
+            if ((x = (zx_run_t *) realloc(x, (ii->ii_nrun - n) * sizeof(zx_run_t))) == NULL) {
+                return -1;
+            }
+        }
+        memcpy(x, ii->ii_run + n, (ii->ii_nrun - n) * sizeof(zx_run_t));
+    } else {
+        free(ie->ie_xrun);
+    }
+
+    ie->ie_xrun = x;
+    ie->ie_nrun = ii->ii_nrun;
+    memcpy(&ie->ie_raw, &ii->ii_raw, ZX_INODE_SIZE);
+    memcpy(ie->ie_run, ii->ii_run, n * sizeof(zx_run_t));
+    return 0;
+}
+
+void
+zx_icache_dirty(zx_icache_t *ic, zx_icache_ent_t *ie)
+{
+    if (!(ie->ie_flags & ZX_II_DIRTY)) {
+        ie->ie_flags |= ZX_II_DIRTY;
+        ie->ie_dnext = ic->ic_dirty;
+        ic->ic_dirty = ie;
+        ic->ic_ndirty++;
+    }
+}
+
+/*
+ * Timestamps of ie changed and nothing else
+ */
+void
+zx_icache_times(zx_icache_t *ic, zx_icache_ent_t *ie)
+{
+    if (ie->ie_flags & ZX_II_DIRTY) {
+        return;
+    }
+    ic->ic_stat.is_lazy++;
+    if (ie->ie_flags & ZX_II_TIMES) {
+        return;
+    }
+    if (ic->ic_ntimes++ == 0) {
+        ic->ic_tstart = time(NULL);
+    }
+    ie->ie_flags |= ZX_II_TIMES;
+    if (!(ie->ie_flags & ZX_II_TLIST)) {
+        ie->ie_flags |= ZX_II_TLIST;
+        ie->ie_tnext = ic->ic_times;
+        ic->ic_times = ie;
+        ic->ic_ntlist++;
+    }
+}
+
+/*
+ * Make up to max inodes with changed timestamps dirty, written next
+ * time dirty inodes are
+ */
+void
+zx_icache_expire(zx_icache_t *ic, __u32 max)
+{
+    zx_icache_ent_t *ie;
+    __u32 n = 0;
+
+    while ((ie = ic->ic_times) != NULL) {
+        if (ie->ie_flags & ZX_II_TIMES) {
+            if (n++ == max) {
+                break;
+            }
+            zx_icache_dirty(ic, ie);
+        }
+        ie->ie_flags &= ~ZX_II_TLIST;
+        ic->ic_times = ie->ie_tnext;
+        ic->ic_ntlist--;
+    }
+}
+
+static int
+zx_ie_cmp(const void *a, const void *b)
+{
+    const zx_icache_ent_t *x = *(const zx_icache_ent_t **) a;
+    const zx_icache_ent_t *y = *(const zx_icache_ent_t **) b;
+
+    return (x->ie_ino < y->ie_ino) ? -1 : (x->ie_ino > y->ie_ino);
+}
+
+/*
+ * Dirty inodes in inode number order in ic_sort, returns how many.
+ * They stay dirty until zx_icache_clean().
+ */
+__u32
+zx_icache_sorted(zx_icache_t *ic)
+{
+    zx_icache_ent_t *ie;
+    __u32 n = 0;
+
+    for (ie = ic->ic_dirty; ie != NULL; ie = ie->ie_dnext) {
+        ic->ic_sort[n++] = ie;
+    }
+    qsort(ic->ic_sort, n, sizeof(zx_icache_ent_t *), zx_ie_cmp);
+
+    return n;
+}
+
+/*
+ * All dirty inodes were written
+ */
+void
+zx_icache_clean(zx_icache_t *ic)
+{
+    zx_icache_ent_t *ie;
+
+    for (ie = ic->ic_dirty; ie != NULL; ie = ie->ie_dnext) {
+        if (ie->ie_flags & ZX_II_TIMES) {
+            ic->ic_ntimes--;
+        }
+        ie->ie_flags &= ~(ZX_II_DIRTY | ZX_II_TIMES);
+    }
+    ic->ic_stat.is_writeback += ic->ic_ndirty;
+    ic->ic_dirty = NULL;
+    ic->ic_ndirty = 0;
+    if (ic->ic_ntimes == 0 && ic->ic_times != NULL) {
+        zx_icache_expire(ic, 0);        /* only unlinks, nothing left on it */
+    }
+}
@@ -0,0 +1,663 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  lib/zx_journal.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Write ahead journal of metadata blocks.
+ *
+ *  Every change an operation makes to a cached metadata block puts
+ *  the block in the running transaction (b_seq). At the end of an
+ *  operation the transaction is committed if it got big, if its first
+ *  change is ZX_JNL_INTERVAL old or if the caller needs it on disk
+ *  (fsync, O_SYNC mount). Commit copies the blocks into a log image,
+ *  descriptors, blocks and commit record, and writes it with one
+ *  write and one flush with the fs lock dropped. Operations ending
+ *  meanwhile join the next transaction, those that need it on disk
+ *  wait and are all covered by the next single commit.
+ *
+ *  Blocks are pinned in the cache until their transaction is on disk
+ *  and only then written home. Checkpoint writes back what it can and
+ *  moves log head past transactions no longer needed.
+ *
+ *  A freed block may come back as file data, which is not journaled.
+ *  Its older copies in the log are revoked so recovery does not write
+ *  them over the data.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include "libzx.h"
+
+/*
+ * Log block i of transaction at log position pos
+ */
+#define ZX_JPOS(L, pos, i)      ((((pos) - 1 + (i)) % (L)) + 1)
+#define ZX_JBLK(jnl, bs, L, pos, i) ((jnl) + (size_t) ZX_JPOS(L, pos, i) * (bs))
+
+struct zx_jrev {
+    __u32   r_bno;
+    __u32   r_seq;
+};
+
+static int
+zx_jsuper_ok(const zx_jsuper_t *js, __u32 blocks)
+{
+    return le32toh(js->j_magic) == ZX_JNL_MAGIC &&
+           le32toh(js->j_blocks) == blocks &&
+           le32toh(js->j_head) >= 1 && le32toh(js->j_head) < blocks &&
+           le32toh(js->j_checksum) == zx_jsuper_csum(js);
+}
+
+static __u32
+zx_jtx_csum(__u32 seq)
+{
+    __le32 s = htole32(seq);
+
+    return zx_crc32c(0, &s, sizeof(s));
+}
+
+/*
+ * Length in log blocks of transaction seq at pos, 0 unless it is
+ * complete and checks out
+ */
+static __u32
+zx_jtx_len(const char *jnl, __u32 bs, __u32 L, __u32 pos, __u32 seq)
+{
+    const zx_jdesc_t *jd;
+    const zx_jcommit_t *jc;
+    __u32 i = 0, k, crc;
+
+    while (i < L) {
+        jd = (const zx_jdesc_t *) ZX_JBLK(jnl, bs, L, pos, i);
+        if (le32toh(jd->jd_magic) != ZX_JDESC_MAGIC || le32toh(jd->jd_seq) != seq) {
+            break;
+        }
+        if (le16toh(jd->jd_count) + le16toh(jd->jd_revoke) > ZX_JDESC_TAGS(bs)) {
+            return 0;
+        }
+        i += 1 + le16toh(jd->jd_count);
+    }
+    if (i == 0 || i >= L) {
+        return 0;
+    }
+
+    jc = (const zx_jcommit_t *) ZX_JBLK(jnl, bs, L, pos, i);
+    if (le32toh(jc->jc_magic) != ZX_JCOMMIT_MAGIC || le32toh(jc->jc_seq) != seq ||
+        le32toh(jc->jc_blocks) != i) {
+        return 0;
+    }
+    crc = zx_jtx_csum(seq);
+    for (k = 0; k < i; k++) {
+        crc = zx_crc32c(crc, ZX_JBLK(jnl, bs, L, pos, k), bs);
+    }
+    if (crc != le32toh(jc->jc_checksum)) {
+        return 0;
+    }
+
+    return i + 1;
+}
+
+static int
+zx_jrev_cmp(const void *a, const void *b)
+{
+    const struct zx_jrev *x = (const struct zx_jrev *) a;
+    const struct zx_jrev *y = (const struct zx_jrev *) b;
+
+    if (x->r_bno != y->r_bno) {
+        return (x->r_bno < y->r_bno) ? -1 : 1;
+    }
+    return (x->r_seq < y->r_seq) ? -1 : (x->r_seq > y->r_seq);
+}
+
+/*
+ * Copy of bno in transaction seq is stale if a later one revoked it
+ */
+static int
+zx_jrevoked(const struct zx_jrev *rev, __u32 nrev, __u32 bno, __u32 seq)
+{
+    __u32 lo = 0, hi = nrev, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (rev[mid].r_bno < bno) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < nrev && rev[lo].r_bno == bno; lo++) {
+        if (rev[lo].r_seq > seq) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Replay committed transactions of journal on dev, returns how many
+ * there were. With check nothing is written, only counted.
+ */
+int
+zx_jrecover(zx_dev_t *dev, const zx_geom_t *g, int check)
+{
+    __u32 bs = g->g_bsize;
+    size_t size = (size_t) g->g_jnl_blocks * bs;
+    __u32 L = g->g_jnl_blocks - 1;
+    __u32 pos, seq, len, used, i, k, count, bno, nrev = 0, maxrev = 0, ntx = 0, t;
+    struct zx_jrev *rev = NULL, *r;
+    const zx_jdesc_t *jd;
+    zx_jsuper_t *js;
+    char *jnl;
+    int ret = -1;
+
+    if (g->g_jnl_blocks == 0) {
+        return 0;
+    }
+    if ((jnl = (char *) malloc(size)) == NULL) {
+        return -1;
+    }
+    if (zx_dev_pread(dev, jnl, size, (off_t) g->g_jnl_start * bs) == -1) {
+        goto out;
+    }
+    js = (zx_jsuper_t *) jnl;
+    if (!zx_jsuper_ok(js, g->g_jnl_blocks)) {
+        errno = EIO;
+        goto out;
+    }
+
+    /*
+     * Find where committed transactions end and collect revokes
+     */
+    pos = le32toh(js->j_head);
+    seq = le32toh(js->j_seq);
+    for (used = 0; (len = zx_jtx_len(jnl, bs, L, pos, seq)) != 0 && used + len <= L; used += len) {
+        for (i = 0; i + 1 < len; i += 1 + count) {
+            jd = (const zx_jdesc_t *) ZX_JBLK(jnl, bs, L, pos, i);
+            count = le16toh(jd->jd_count);
+            for (k = 0; k < le16toh(jd->jd_revoke); k++) {
+                if (nrev == maxrev) {
+                    maxrev = maxrev ? 2 * maxrev : 256;
+                    if ((r = (struct zx_jrev *) realloc(rev, maxrev * sizeof(*rev))) == NULL) {
+                        goto out;
+                    }
+                    rev = r;
+                }
+                rev[nrev].r_bno = le32toh(jd->jd_tag[count + k]);
+                rev[nrev++].r_seq = seq;
+            }
+        }
+        pos = ZX_JPOS(L, pos, len);
+        seq++;
+        ntx++;
+    }
+    if (check || ntx == 0) {
+        ret = ntx;
+        goto out;
+    }
+    qsort(rev, nrev, sizeof(*rev), zx_jrev_cmp);
+
+    /*
+     * Write blocks home oldest transaction first, so last copy wins
+     */
+    pos = le32toh(js->j_head);
+    seq = le32toh(js->j_seq);
+    for (t = 0; t < ntx; t++) {
+        len = zx_jtx_len(jnl, bs, L, pos, seq);
+        for (i = 0; i + 1 < len; i += 1 + count) {
+            jd = (const zx_jdesc_t *) ZX_JBLK(jnl, bs, L, pos, i);
+            count = le16toh(jd->jd_count);
+            for (k = 0; k < count; k++) {
+                bno = le32toh(jd->jd_tag[k]);
+                if (bno < ZX_SUPER_OFFSET / bs || bno >= g->g_data_start + g->g_blocks ||
+                    (bno >= g->g_jnl_start && bno < g->g_data_start) ||
+                    zx_jrevoked(rev, nrev, bno, seq)) {
+                    continue;
+                }
+                if (zx_dev_pwrite(dev, ZX_JBLK(jnl, bs, L, pos, i + 1 + k), bs,
+                                  (off_t) bno * bs) == -1) {
+                    goto out;
+                }
+            }
+        }
+        pos = ZX_JPOS(L, pos, len);
+        seq++;
+    }
+    if (fsync(dev->fd) == -1) {
+        goto out;
+    }
+
+    js->j_head = htole32(pos);
+    js->j_seq = htole32(seq);
+    js->j_checksum = htole32(zx_jsuper_csum(js));
+    if (zx_dev_pwrite(dev, jnl, bs, (off_t) g->g_jnl_start * bs) == -1 ||
+        fsync(dev->fd) == -1) {
+        goto out;
+    }
+    ret = ntx;
+
+out:
+    free(rev);
+    free(jnl);
+    return ret;
+}
+
+/*
+ * Blocks logged by transactions still in log, a block in here needs
+ * a revoke when freed
+ */
+static __u32
+zx_jhash_slot(const zx_journal_t *j, __u32 bno)
+{
+    __u32 h = (bno * 0x9e3779b1U) & j->j_hmask;
+
+    while (j->j_hbno[h] != 0 && j->j_hbno[h] != bno) {
+        h = (h + 1) & j->j_hmask;
+    }
+    return h;
+}
+
+static void
+zx_jhash_put(zx_journal_t *j, __u32 bno, __u32 seq)
+{
+    __u32 h = zx_jhash_slot(j, bno);
+
+    if (j->j_hbno[h] == 0) {
+        j->j_hbno[h] = bno;
+        j->j_hcount++;
+    }
+    j->j_hseq[h] = seq;
+}
+
+/*
+ * Drop entries of transactions before keep, they left the log
+ */
+static void
+zx_jhash_trim(zx_journal_t *j, __u32 keep)
+{
+    __u32 *obno = j->j_hbno, *oseq = j->j_hseq;
+    __u32 i, n = j->j_hmask + 1;
+
+    j->j_hbno = (__u32 *) calloc(n, sizeof(__u32));
+    j->j_hseq = (__u32 *) calloc(n, sizeof(__u32));
+    if (j->j_hbno == NULL || j->j_hseq == NULL) {
+        free(j->j_hbno);
+        free(j->j_hseq);
+        j->j_hbno = obno;
+        j->j_hseq = oseq;
+        return;
+    }
+    j->j_hcount = 0;
+    for (i = 0; i < n; i++) {
+        if (obno[i] != 0 && oseq[i] >= keep) {
+            zx_jhash_put(j, obno[i], oseq[i]);
+        }
+    }
+    free(obno);
+    free(oseq);
+}
+
+int
+zx_jopen(zx_journal_t *j, zx_dev_t *dev, zx_cache_t *c,
+         const zx_geom_t *g, pthread_mutex_t *lock)
+{
+    char blk[ZX_MAX_BLOCK_SIZE];
+    zx_jsuper_t *js = (zx_jsuper_t *) blk;
+    __u32 n;
+
+    memset(j, 0, sizeof(zx_journal_t));
+    if (g->g_jnl_blocks == 0) {
+        return 0;
+    }
+    if (zx_dev_pread(dev, blk, g->g_bsize, (off_t) g->g_jnl_start * g->g_bsize) == -1) {
+        return -1;
+    }
+    if (!zx_jsuper_ok(js, g->g_jnl_blocks)) {
+        errno = EIO;
+        return -1;
+    }
+
+    j->j_dev = dev;
+    j->j_cache = c;
+    j->j_lock = lock;
+    j->j_bsize = g->g_bsize;
+    j->j_start = g->g_jnl_start;
+    j->j_log = g->g_jnl_blocks - 1;
+    j->j_head = j->j_tail = le32toh(js->j_head);
+    j->j_limit = j->j_log / 4;
+    if (j->j_limit > c->c_nbufs / 8) {
+        j->j_limit = c->c_nbufs / 8;
+    }
+    for (n = 1; n < 4 * j->j_log; n <<= 1)
+        ;
+    j->j_hmask = n - 1;
+    j->j_maxrevoke = n;
+
+    j->j_tx = (zx_jtx_t *) calloc(j->j_log, sizeof(zx_jtx_t));
+    j->j_revoke = (__u32 *) calloc(n, sizeof(__u32));
+    j->j_hbno = (__u32 *) calloc(n, sizeof(__u32));
+    j->j_hseq = (__u32 *) calloc(n, sizeof(__u32));
+    j->j_vec = (zx_buf_t **) calloc(c->c_nbufs, sizeof(zx_buf_t *));
+    j->j_buf = (char *) malloc((size_t) j->j_log * j->j_bsize);
+    pthread_cond_init(&j->j_cond, NULL);
+    j->j_blocks = g->g_jnl_blocks;
+    if (j->j_tx == NULL || j->j_revoke == NULL || j->j_hbno == NULL ||
+        j->j_hseq == NULL || j->j_vec == NULL || j->j_buf == NULL) {
+        zx_jclose(j);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    c->c_seq = le32toh(js->j_seq);
+    c->c_durable = c->c_seq - 1;
+    c->c_txblocks = 0;
+
+    return 0;
+}
+
+void
+zx_jclose(zx_journal_t *j)
+{
+    if (j->j_blocks == 0) {
+        return;
+    }
+    free(j->j_tx);
+    free(j->j_revoke);
+    free(j->j_hbno);
+    free(j->j_hseq);
+    free(j->j_vec);
+    free(j->j_buf);
+    pthread_cond_destroy(&j->j_cond);
+    memset(j, 0, sizeof(zx_journal_t));
+}
+
+/*
+ * Blocks [bno, bno + len) were freed. A revoke must not get lost or
+ * replay would write an old copy over whatever the block holds next,
+ * so the list grows as needed.
+ */
+int
+zx_jrevoke(zx_journal_t *j, __u32 bno, __u32 len)
+{
+    __u32 i, h, *r;
+
+    if (j->j_blocks == 0) {
+        return 0;
+    }
+    for (i = 0; i < len; i++) {
+        h = zx_jhash_slot(j, bno + i);
+        if (j->j_hbno[h] != bno + i || j->j_hseq[h] == 0) {
+            continue;
+        }
+        if (j->j_nrevoke == j->j_maxrevoke) {
+            if ((r = (__u32 *) realloc(j->j_revoke, 2 * j->j_maxrevoke * sizeof(__u32))) == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            j->j_revoke = r;
+            j->j_maxrevoke *= 2;
+        }
+        j->j_revoke[j->j_nrevoke++] = bno + i;
+        j->j_hseq[h] = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Write back everything committed and let the log go of transactions
+ * no block needs any more. Called with fs lock held.
+ */
+int
+zx_jcheckpoint(zx_journal_t *j)
+{
+    zx_cache_t *c = j->j_cache;
+    char blk[ZX_MAX_BLOCK_SIZE];
+    zx_jsuper_t *js = (zx_jsuper_t *) blk;
+    __u32 keep, h, head, seq;
+
+    if (zx_cache_flush(c) == -1 || fsync(j->j_dev->fd) == -1) {
+        return -1;
+    }
+
+    keep = c->c_durable + 1;
+    if ((h = zx_cache_horizon(c)) != 0 && h < keep) {
+        keep = h;
+    }
+    while (j->j_ntx > 0 && j->j_tx[j->j_txfirst].t_seq < keep) {
+        j->j_used -= j->j_tx[j->j_txfirst].t_len;
+        j->j_txfirst = (j->j_txfirst + 1) % j->j_log;
+        j->j_ntx--;
+    }
+    head = j->j_ntx ? j->j_tx[j->j_txfirst].t_pos : j->j_tail;
+    seq = j->j_ntx ? j->j_tx[j->j_txfirst].t_seq : c->c_seq;
+    if (head == j->j_head) {
+        return 0;
+    }
+
+    /*
+     * New head must be on disk before its log space is used again
+     */
+    memset(blk, 0, sizeof(blk));
+    js->j_magic = htole32(ZX_JNL_MAGIC);
+    js->j_blocks = htole32(j->j_blocks);
+    js->j_head = htole32(head);
+    js->j_seq = htole32(seq);
+    js->j_checksum = htole32(zx_jsuper_csum(js));
+    if (zx_dev_pwrite(j->j_dev, blk, j->j_bsize, (off_t) j->j_start * j->j_bsize) == -1 ||
+        fdatasync(j->j_dev->fd) == -1) {
+        return -1;
+    }
+    j->j_head = head;
+    zx_jhash_trim(j, keep);
+    j->j_stat.js_checkpoints++;
+
+    return 0;
+}
+
+/*
+ * Commit running transaction, fs lock is dropped for the I/O unless
+ * hold is set
+ */
+static int
+zx_jdo_commit(zx_journal_t *j, int hold)
+{
+    zx_cache_t *c = j->j_cache;
+    zx_jdesc_t *jd;
+    zx_jcommit_t *jc;
+    zx_buf_t *b;
+    __u32 seq = c->c_seq, n, nrev = j->j_nrevoke, len, pos, first;
+    __u32 t = 0, r = 0, k = 0, cnt, rcnt;
+    int ret = 0;
+
+    if (j->j_error) {
+        errno = j->j_error;
+        return -1;
+    }
+    j->j_busy = 1;
+    n = zx_cache_tx(c, seq, j->j_vec);
+    len = (n + nrev + ZX_JDESC_TAGS(j->j_bsize) - 1) / ZX_JDESC_TAGS(j->j_bsize) + n + 1;
+
+    /*
+     * Nothing logged, only data written so far has to be stable
+     */
+    if (n == 0 && nrev == 0) {
+        c->c_txblocks = 0;
+        j->j_tstart = 0;
+        if (!hold) {
+            pthread_mutex_unlock(j->j_lock);
+        }
+        ret = fdatasync(j->j_dev->fd);
+        if (!hold) {
+            pthread_mutex_lock(j->j_lock);
+        }
+        goto done;
+    }
+
+    if (j->j_used + len > j->j_log || j->j_hcount + n > j->j_hmask / 2) {
+        if (zx_jcheckpoint(j) == -1) {
+            ret = -1;
+            goto done;
+        }
+    }
+
+    /*
+     * Bigger than the whole log. zx_geom_make() sizes the log for the
+     * largest operation so this does not happen, if it does nothing
+     * goes home unprotected: blocks stay pinned and fs is done.
+     */
+    if (j->j_used + len > j->j_log) {
+        j->j_error = EFBIG;
+        errno = EFBIG;
+        ret = -1;
+        goto done;
+    }
+
+    while (t < n || r < nrev) {
+        jd = (zx_jdesc_t *) (j->j_buf + (size_t) k++ * j->j_bsize);
+        memset(jd, 0, j->j_bsize);
+        jd->jd_magic = htole32(ZX_JDESC_MAGIC);
+        jd->jd_seq = htole32(seq);
+        for (cnt = 0; t < n && cnt < ZX_JDESC_TAGS(j->j_bsize); cnt++, t++) {
+            b = j->j_vec[t];
+            jd->jd_tag[cnt] = htole32(b->b_bno);
+            memcpy(j->j_buf + (size_t) k++ * j->j_bsize, b->b_data, j->j_bsize);
+            zx_jhash_put(j, b->b_bno, seq);
+        }
+        for (rcnt = 0; r < nrev && cnt + rcnt < ZX_JDESC_TAGS(j->j_bsize); rcnt++, r++) {
+            jd->jd_tag[cnt + rcnt] = htole32(j->j_revoke[r]);
+        }
+        jd->jd_count = htole16(cnt);
+        jd->jd_revoke = htole16(rcnt);
+    }
+    jc = (zx_jcommit_t *) (j->j_buf + (size_t) k * j->j_bsize);
+    memset(jc, 0, j->j_bsize);
+    jc->jc_magic = htole32(ZX_JCOMMIT_MAGIC);
+    jc->jc_seq = htole32(seq);
+    jc->jc_blocks = htole32(k);
+    jc->jc_checksum = htole32(zx_crc32c(zx_jtx_csum(seq), j->j_buf, (size_t) k * j->j_bsize));
+
+    /*
+     * Take log space and start next transaction, then write with
+     * the lock dropped
+     */
+    pos = j->j_tail;
+    j->j_tail = ZX_JPOS(j->j_log, pos, len);
+    j->j_used += len;
+    j->j_tx[(j->j_txfirst + j->j_ntx++) % j->j_log] = (zx_jtx_t) { seq, pos, len };
+    c->c_seq = seq + 1;
+    c->c_txblocks = 0;
+    j->j_nrevoke = 0;
+    j->j_tstart = 0;
+
+    if (!hold) {
+        pthread_mutex_unlock(j->j_lock);
+    }
+    first = (len < j->j_log - pos + 1) ? len : j->j_log - pos + 1;
+    if (zx_dev_pwrite(j->j_dev, j->j_buf, (size_t) first * j->j_bsize,
+                      (off_t) (j->j_start + pos) * j->j_bsize) == -1 ||
+        (len > first &&
+         zx_dev_pwrite(j->j_dev, j->j_buf + (size_t) first * j->j_bsize,
+                       (size_t) (len - first) * j->j_bsize,
+                       (off_t) (j->j_start + 1) * j->j_bsize) == -1) ||
+        fdatasync(j->j_dev->fd) == -1) {
+        ret = -1;
+    }
+    if (!hold) {
+        pthread_mutex_lock(j->j_lock);
+    }
+
+    if (ret == -1) {
+        j->j_error = errno;             /* blocks stay pinned, fs is done */
+        goto done;
+    }
+
+    /*
+     * Committed, blocks may go home now. Until they do the log must
+     * keep this transaction.
+     */
+    c->c_durable = seq;
+    for (t = 0, k = 0; t < n; k += 1 + cnt) {
+        jd = (zx_jdesc_t *) (j->j_buf + (size_t) k * j->j_bsize);
+        cnt = le16toh(jd->jd_count);
+        for (rcnt = 0; rcnt < cnt; rcnt++, t++) {
+            b = j->j_vec[t];
+            if (b->b_bno == le32toh(jd->jd_tag[rcnt]) && (b->b_flags & ZX_BUF_DIRTY) &&
+                b->b_lseq < seq) {
+                b->b_lseq = seq;
+            }
+        }
+    }
+    j->j_stat.js_commits++;
+    j->j_stat.js_blocks += len;
+    j->j_stat.js_revokes += nrev;
+
+done:
+    j->j_busy = 0;
+    pthread_cond_broadcast(&j->j_cond);
+    return ret;
+}
+
+/*
+ * Get everything done so far on disk, a commit in progress covers
+ * only what was there when it started, so wait for it and maybe
+ * commit once more. Called with fs lock held.
+ */
+int
+zx_jcommit(zx_journal_t *j, int hold)
+{
+    __u32 want = j->j_cache->c_seq;
+
+    while (j->j_busy) {
+        j->j_stat.js_waits++;
+        pthread_cond_wait(&j->j_cond, j->j_lock);
+    }
+    if (j->j_cache->c_durable >= want) {
+        return 0;
+    }
+    return zx_jdo_commit(j, hold);
+}
+
+/*
+ * End of an operation, commit if the caller needs it on disk or the
+ * running transaction is due
+ */
+int
+zx_jend(zx_journal_t *j, int sync)
+{
+    zx_cache_t *c = j->j_cache;
+
+    if (j->j_blocks == 0) {
+        return 0;
+    }
+    if (sync) {
+        return zx_jcommit(j, 0);
+    }
+    if (c->c_txblocks == 0 && j->j_nrevoke == 0) {
+        return 0;
+    }
+    if (j->j_tstart == 0) {
+        j->j_tstart = time(NULL);
+    }
+
+    /*
+     * Running transaction grows while a commit is in progress, past
+     * twice the limit wait for it rather than pin more of the cache
+     */
+    if (c->c_txblocks >= 2 * j->j_limit) {
+        return zx_jcommit(j, 0);
+    }
+    if (!j->j_busy && (c->c_txblocks >= j->j_limit || j->j_nrevoke >= j->j_limit ||
+                       time(NULL) - j->j_tstart >= ZX_JNL_INTERVAL)) {
+        return zx_jdo_commit(j, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  lib/zx_map.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Read only memory mapped view of zxfs metadata and data.
+ *
+ *  Super block, bitmaps, inode table and data region are mapped once
+ *  and structures are decoded in place, so walking a whole image
+ *  costs page faults instead of one read() per structure.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include "libzx.h"
+
+int
+zx_map_open(zx_map_t *m, const char *path)
+{
+    zx_super_t sb;
+    size_t len;
+
+    if (zx_dev_open(&m->dev, path, O_RDONLY) == -1) {
+        return -1;
+    }
+    if (m->dev.size < (off_t) ZX_SUPER_OFFSET + ZX_MIN_BLOCK_SIZE ||
+        zx_dev_pread(&m->dev, &sb, ZX_SUPER_SIZE, ZX_SUPER_OFFSET) == -1) {
+        zx_dev_close(&m->dev);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    /*
+     * Map up to end of data region, or whole device in blocks of
+     * ZX_MIN_BLOCK_SIZE if super block does not describe a sane layout.
+     */
+    zx_geom_load(&m->geo, &sb);
+    if (le32toh(sb.s_magic) == ZX_MAGIC_NUMBER &&
+        zx_geom_check(&m->geo, m->dev.size) == 0) {
+        len = ((size_t) m->geo.g_data_start + m->geo.g_blocks) * m->geo.g_bsize;
+    } else {
+        memset(&m->geo, 0, sizeof(zx_geom_t));
+        m->geo.g_bsize = ZX_MIN_BLOCK_SIZE;
+        len = m->dev.size;
+    }
+
+    m->base = (char *) mmap(NULL, len, PROT_READ, MAP_SHARED, m->dev.fd, 0);
+    if (m->base == MAP_FAILED) {
+        zx_dev_close(&m->dev);
+        return -1;
+    }
+    madvise(m->base, len, MADV_WILLNEED);
+
+    m->len = len;
+    m->sb = (zx_super_t *) (m->base + ZX_SUPER_OFFSET);
+    m->gdt = (m->geo.g_gdt_blocks == 0) ? NULL :
+             (zx_group_t *) (m->base + ((size_t) m->geo.g_gdt_start * m->geo.g_bsize));
+    m->imap = (__u8 *) (m->base + ((size_t) m->geo.g_imap_start * m->geo.g_bsize));
+    m->bmap = (__u8 *) (m->base + ((size_t) m->geo.g_bmap_start * m->geo.g_bsize));
+    m->itab = (zx_inode_t *) (m->base + ((size_t) m->geo.g_inode_start * m->geo.g_bsize));
+
+    return 0;
+}
+
+void
+zx_map_close(zx_map_t *m)
+{
+    if (m->base != NULL && m->base != MAP_FAILED) {
+        munmap(m->base, m->len);
+    }
+    m->base = NULL;
+    zx_dev_close(&m->dev);
+}
+
+/*
+ * Inodes in the part of a group's inode table mkzx left unwritten
+ * read as free (all zero) whatever is on disk there
+ */
+zx_inode_t *
+zx_map_inode(zx_map_t *m, __u32 ino)
+{
+    static zx_inode_t unused;           /* stays zero, map is read only */
+    __u32 ipb = ZX_INODE_PER_BLOCK(m->geo.g_bsize);
+    __u32 ag, first, n, left;
+
+    if (ino >= m->geo.g_inodes) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ag = ino / m->geo.g_ag_inodes;
+    n = zx_geom_ag_inodes(&m->geo, ag, &first);
+    left = (m->gdt != NULL) ? le32toh(m->gdt[ag].gd_itable_unused) : m->geo.g_itable_unused;
+    if (left > (n + ipb - 1) / ipb) {
+        left = 0;                       /* bad descriptor, fsckzx tells */
+    }
+    if ((ino - first) / ipb + left >= (n + ipb - 1) / ipb) {
+        return &unused;
+    }
+    return &m->itab[ino];
+}
+
+/*
+ * Return device block bno, block numbers are absolute (block 0 is
+ * first block of device).
+ */
+void *
+zx_map_block(zx_map_t *m, __u32 bno)
+{
+    if (((size_t) bno + 1) * m->geo.g_bsize > m->len) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return m->base + ((size_t) bno * m->geo.g_bsize);
+}
+
+/*
+ * Return extent i of inode, from the inode itself or its overflow
+ * extent block. NULL when inode has no such extent.
+ */
+zx_extent_t *
+zx_map_extent(zx_map_t *m, zx_inode_t *in, __u32 i)
+{
+    zx_extent_t *xb;
+
+    if (i >= le16toh(in->i_nextents) || i >= ZX_MAX_EXTENTS(m->geo.g_bsize)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (i < ZX_INODE_EXTENTS) {
+        return &in->i_extent[i];
+    }
+    if ((xb = (zx_extent_t *) zx_map_block(m, le32toh(in->i_xblock))) == NULL) {
+        return NULL;
+    }
+    return &xb[i - ZX_INODE_EXTENTS];
+}
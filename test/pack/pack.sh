@@ -0,0 +1,76 @@
+#!/bin/sh
+#############################
+# zxfs (zero x file system) #
+#############################
+
+#
+#	test/pack/pack.sh
+#
+#	Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+#
+#	Builds images from a small host tree with mkzx -d at every block
+#	size and checks them with fsckzx. Tree starts with inline files
+#	(empty, 2 and 60 bytes) ahead of any file with data blocks, and
+#	has a directory holding inline files only. unpack copies each
+#	image back out through libzx, listing, sizes and contents must
+#	match the host tree.
+#
+
+ROOT=$(cd "$(dirname "$0")/../.." && pwd)
+MKZX=${ROOT}/util/mkzx/mkzx
+FSCKZX=${ROOT}/util/fsckzx/fsckzx
+UNPACK=${ROOT}/test/pack/unpack
+TMP=${TMPDIR:-/tmp}/zxpack.$$
+
+make -C ${ROOT}/util/mkzx > /dev/null 2>&1 && make -C ${ROOT}/util/fsckzx > /dev/null 2>&1 &&
+    make -C ${ROOT}/test/pack > /dev/null 2>&1 || exit 1
+
+mkdir -p ${TMP}/tree/a/b ${TMP}/tree/inline ${TMP}/tree/empty
+trap 'rm -rf ${TMP}' EXIT
+
+: > ${TMP}/tree/0empty
+printf 'hi' > ${TMP}/tree/1two
+head -c 60 /dev/urandom > ${TMP}/tree/2sixty
+head -c 61 /dev/urandom > ${TMP}/tree/3sixtyone
+head -c 4097 /dev/urandom > ${TMP}/tree/a/page
+head -c 3000000 /dev/urandom > ${TMP}/tree/a/b/big
+for i in 1 2 3 4 5 6 7 8; do
+    head -c $((i * 7)) /dev/urandom > ${TMP}/tree/inline/f$i
+done
+
+fail=0
+for bs in 512 1024 2048 4096; do
+    rm -f ${TMP}/img
+    if ! ${MKZX} -s 16m -b ${bs} -d ${TMP}/tree ${TMP}/img > ${TMP}/log 2>&1; then
+        echo "[NOT OK] mkzx -b ${bs}"
+        cat ${TMP}/log
+        fail=1
+        continue
+    fi
+    if ! ${FSCKZX} ${TMP}/img > ${TMP}/log 2>&1; then
+        echo "[NOT OK] fsckzx -b ${bs}"
+        cat ${TMP}/log
+        fail=1
+        continue
+    fi
+    rm -rf ${TMP}/out
+    if ! ${UNPACK} ${TMP}/img ${TMP}/out > ${TMP}/log 2>&1; then
+        echo "[NOT OK] unpack -b ${bs}"
+        cat ${TMP}/log
+        fail=1
+        continue
+    fi
+    (cd ${TMP}/tree && find . -printf '%y %s %p\n' | grep -v '^d' | sort) > ${TMP}/want
+    (cd ${TMP}/out && find . -printf '%y %s %p\n' | grep -v '^d' | sort) > ${TMP}/got
+    (cd ${TMP}/tree && find . -type d | sort) >> ${TMP}/want
+    (cd ${TMP}/out && find . -type d | sort) >> ${TMP}/got
+    if ! diff ${TMP}/want ${TMP}/got > ${TMP}/log || ! diff -r ${TMP}/tree ${TMP}/out >> ${TMP}/log; then
+        echo "[NOT OK] contents -b ${bs}"
+        cat ${TMP}/log
+        fail=1
+        continue
+    fi
+    printf "[OK]\tmkzx -d -b %s\n" ${bs}
+done
+
+exit ${fail}
@@ -0,0 +1,122 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  test/pack/unpack.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  unpack - copy the tree of a zxfs image out to a host directory,
+ *  through libzx, so it can be compared with what mkzx -d packed
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../../lib/libzx.h"
+
+#define PATH_LEN    4096
+
+static int
+unpack_file(zx_fs_t *fs, const char *zpath, const char *hpath)
+{
+    char buf[65536];
+    ssize_t n;
+    int zfd, hfd, ret = 0;
+
+    if ((zfd = zx_open(fs, zpath, O_RDONLY, 0)) == -1) {
+        perror(zpath);
+        return -1;
+    }
+    if ((hfd = open(hpath, O_CREAT | O_WRONLY | O_TRUNC, 0644)) == -1) {
+        perror(hpath);
+        zx_close(fs, zfd);
+        return -1;
+    }
+    while ((n = zx_read(fs, zfd, buf, sizeof(buf))) > 0) {
+        if (write(hfd, buf, n) != n) {
+            perror(hpath);
+            ret = -1;
+            break;
+        }
+    }
+    if (n == -1) {
+        perror(zpath);
+        ret = -1;
+    }
+    close(hfd);
+    zx_close(fs, zfd);
+
+    return ret;
+}
+
+/*
+ * Directory zpath of the image becomes hpath, which must not exist
+ */
+static int
+unpack_dir(zx_fs_t *fs, const char *zpath, const char *hpath)
+{
+    char zsub[PATH_LEN], hsub[PATH_LEN], name[ZX_MAX_NAME + 1];
+    zx_dirent_t de;
+    zx_stat_t st;
+    int fd, n, ret = 0;
+
+    if (mkdir(hpath, 0755) == -1) {
+        perror(hpath);
+        return -1;
+    }
+    if ((fd = zx_open(fs, zpath, O_RDONLY | O_DIRECTORY, 0)) == -1) {
+        perror(zpath);
+        return -1;
+    }
+    while (ret == 0 && (n = zx_readdir(fs, fd, &de)) == 1) {
+        memcpy(name, de.d_name, ZX_MAX_NAME);
+        name[ZX_MAX_NAME] = '\0';
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        snprintf(zsub, sizeof(zsub), "%s/%s", strcmp(zpath, "/") ? zpath : "", name);
+        snprintf(hsub, sizeof(hsub), "%s/%s", hpath, name);
+        if (zx_stat(fs, zsub, &st) == -1) {
+            perror(zsub);
+            ret = -1;
+        } else if (S_ISDIR(st.zs_mode)) {
+            ret = unpack_dir(fs, zsub, hsub);
+        } else {
+            ret = unpack_file(fs, zsub, hsub);
+        }
+    }
+    if (n == -1) {
+        perror(zpath);
+        ret = -1;
+    }
+    zx_close(fs, fd);
+
+    return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+    zx_fs_t *fs;
+    int ret;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage:\n\t%s <image> <directory>\n", argv[0]);
+        return 2;
+    }
+    if ((fs = zx_mount(argv[1], O_RDONLY)) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    ret = unpack_dir(fs, "/", argv[2]);
+    zx_umount(fs);
+
+    return ret == 0 ? 0 : 1;
+}
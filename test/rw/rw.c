@@ -0,0 +1,212 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  test/rw/rw.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  rw - read and write edge cases of libzx on an image
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "../../lib/libzx.h"
+
+static int fail;
+
+static void
+check(int ok, const char *what)
+{
+    if (ok) {
+        printf("[OK]\t%s\n", what);
+    } else {
+        printf("[NOT OK]\t%s\n", what);
+        fail = 1;
+    }
+}
+
+/*
+ * Create path holding len bytes of c
+ */
+static int
+mkfile(zx_fs_t *fs, const char *path, int c, size_t len)
+{
+    char buf[8192];
+    int fd;
+
+    memset(buf, c, sizeof(buf));
+    if ((fd = zx_open(fs, path, O_CREAT | O_RDWR | O_TRUNC, 0644)) == -1) {
+        perror(path);
+        exit(1);
+    }
+    if (zx_write(fs, fd, buf, len) != (ssize_t) len) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+/*
+ * Whether path holds len bytes of c
+ */
+static int
+holds(zx_fs_t *fs, const char *path, int c, size_t len)
+{
+    char buf[8192];
+    zx_stat_t st;
+    ssize_t n;
+    int fd, i;
+
+    if (zx_stat(fs, path, &st) == -1 || st.zs_size != len ||
+        (fd = zx_open(fs, path, O_RDONLY, 0)) == -1) {
+        return 0;
+    }
+    n = zx_read(fs, fd, buf, sizeof(buf));
+    zx_close(fs, fd);
+    if (n != (ssize_t) len) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        if (buf[i] != c) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Negative offsets are EINVAL, for files with blocks and inline ones
+ */
+static void
+negative(zx_fs_t *fs)
+{
+    char buf[8];
+    zx_stat_t st;
+    int a, b, c;
+
+    a = mkfile(fs, "/a", 'a', 4096);
+    b = mkfile(fs, "/b", 'b', 4096);
+    c = mkfile(fs, "/c", 'c', 10);
+    memset(buf, 'x', sizeof(buf));
+
+    errno = 0;
+    check(zx_pwrite(fs, b, buf, sizeof(buf), -8) == -1 && errno == EINVAL,
+          "pwrite at -8 is EINVAL");
+    check(holds(fs, "/a", 'a', 4096) && holds(fs, "/b", 'b', 4096),
+          "pwrite at -8 leaves data alone");
+
+    errno = 0;
+    check(zx_pread(fs, b, buf, sizeof(buf), -8) == -1 && errno == EINVAL,
+          "pread at -8 is EINVAL");
+
+    errno = 0;
+    check(zx_pwrite(fs, c, buf, sizeof(buf), -8) == -1 && errno == EINVAL,
+          "pwrite at -8 on inline file is EINVAL");
+    check(zx_fstat(fs, c, &st) == 0 && st.zs_blocks == 0 && holds(fs, "/c", 'c', 10),
+          "pwrite at -8 on inline file maps nothing");
+
+    zx_close(fs, a);
+    zx_close(fs, b);
+    zx_close(fs, c);
+}
+
+/*
+ * A grow that runs out of space keeps none of the blocks it got, and
+ * blocks a file gets later read back as zeros, not as what a deleted
+ * file left in them
+ */
+static void
+nospace(zx_fs_t *fs)
+{
+    char buf[8192];
+    zx_stat_t st;
+    off_t off;
+    ssize_t n;
+    int fd, i, stale = 0;
+
+    fd = mkfile(fs, "/old", 'o', 0);
+    memset(buf, 'o', sizeof(buf));
+    for (i = 0; i < 256; i++) {
+        zx_write(fs, fd, buf, sizeof(buf));
+    }
+    zx_close(fs, fd);
+    zx_unlink(fs, "/old");
+    zx_sync(fs);
+
+    fd = mkfile(fs, "/g", 'g', 70);
+    errno = 0;
+    check(zx_pwrite(fs, fd, buf, 1, 100 << 20) == -1 && errno == ENOSPC,
+          "pwrite past free space is ENOSPC");
+    check(zx_fstat(fs, fd, &st) == 0 && st.zs_size == 70 && st.zs_blocks <= 1,
+          "failed grow keeps no blocks");
+
+    check(zx_ftruncate(fs, fd, 2 << 20) == 0, "grow after failed grow");
+    for (off = 70; (n = zx_pread(fs, fd, buf, sizeof(buf), off)) > 0; off += n) {
+        for (i = 0; i < n; i++) {
+            stale |= buf[i] != 0;
+        }
+    }
+    check(off == 2 << 20 && !stale, "grown blocks read back as zeros");
+
+    zx_close(fs, fd);
+    zx_unlink(fs, "/g");
+}
+
+/*
+ * Space a file frees is there for the next one, even before the
+ * transaction that freed it is committed
+ */
+static void
+refill(zx_fs_t *fs)
+{
+    char buf[8192];
+    int fd, i, ok = 1;
+
+    memset(buf, 'r', sizeof(buf));
+    fd = mkfile(fs, "/r1", 'r', 0);
+    for (i = 0; i < 640; i++) {
+        ok &= zx_write(fs, fd, buf, sizeof(buf)) == sizeof(buf);
+    }
+    zx_close(fs, fd);
+    check(ok, "fill most of the device");
+
+    zx_unlink(fs, "/r1");
+    fd = mkfile(fs, "/r2", 'r', 0);
+    for (i = 0; i < 640; i++) {
+        ok &= zx_write(fs, fd, buf, sizeof(buf)) == sizeof(buf);
+    }
+    zx_close(fs, fd);
+    check(ok, "fill it again right after unlink");
+    zx_unlink(fs, "/r2");
+}
+
+int
+main(int argc, char *argv[])
+{
+    zx_fs_t *fs;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage:\n\t%s <image>\n", argv[0]);
+        return 2;
+    }
+    if ((fs = zx_mount(argv[1], O_RDWR)) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    negative(fs);
+    nospace(fs);
+    refill(fs);
+
+    if (zx_umount(fs) == -1) {
+        perror(argv[1]);
+        return 1;
+    }
+    return fail;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+#############################
+# zxfs (zero x file system) #
+#############################
+
+#
+#	test/rw/rw.sh
+#
+#	Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+#
+#	Runs rw, read and write edge cases of libzx, on a fresh image and
+#	checks the image with fsckzx afterwards.
+#
+
+ROOT=$(cd "$(dirname "$0")/../.." && pwd)
+MKZX=${ROOT}/util/mkzx/mkzx
+FSCKZX=${ROOT}/util/fsckzx/fsckzx
+RW=${ROOT}/test/rw/rw
+TMP=${TMPDIR:-/tmp}/zxrw.$$
+
+make -C ${ROOT}/util/mkzx > /dev/null 2>&1 && make -C ${ROOT}/util/fsckzx > /dev/null 2>&1 &&
+    make -C ${ROOT}/test/rw > /dev/null 2>&1 || exit 1
+
+mkdir -p ${TMP}
+trap 'rm -rf ${TMP}' EXIT
+
+if ! ${MKZX} -s 8m ${TMP}/img > ${TMP}/log 2>&1; then
+    echo "[NOT OK] mkzx"
+    cat ${TMP}/log
+    exit 1
+fi
+fail=0
+${RW} ${TMP}/img || fail=1
+if ! ${FSCKZX} ${TMP}/img > ${TMP}/log 2>&1; then
+    echo "[NOT OK] fsckzx"
+    cat ${TMP}/log
+    fail=1
+fi
+
+exit ${fail}
@@ -17,15 +17,18 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
-#include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include "../../lib/libzx.h"
+#include "zxgen.h"
 
 #define TRUE    1
-#define FULL    1
-#define EMPTY   2
-#define LEN     31
+#define LEN     ZX_MAX_NAME
+#define IDLE_MAX    (1 << 10)   /* longest idle wait, microseconds */
 
 /* Load policies */
 #define LP_FIL_H    0
@@ -36,107 +39,188 @@
 #define LP_MIX_V    5
 #define LP_MIX_F    6
 
-#define IOP_NO_VERIFY   0
-#define IOP_DO_VERIFY   1  
-
-struct iqe {
-    char *path;
-    struct iqe *next;
-};
-
-struct iq {
-    int count;
-    int policy;
-    struct iqe *head;
-    struct iqe *rear;
-    pthread_cond_t wakeup_creator;
-    pthread_cond_t wakeup_destroyer;
-    pthread_mutex_t mlock;
-} q = {0, 0, NULL, NULL, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
+/*
+ * Files created and not yet destroyed, nextid numbers them for the
+ * trace (-R). A file is owned by whichever
+ * thread popped it off q, fileio pushes it back when done with it, so
+ * destroyer never removes a file under fileio.
+ */
+struct zxq q;
+int count = 0;
+unsigned nextid = 0;
+int policy = LP_FIL_H;
 
 struct carg {
     int max_inode;
     int csleep;
 };
 
-struct fioarg {
-    int maxblks;
-    int blksize;
-    int iopolicy;
-};
+/*
+ * Image opened through libzx (-I), NULL when running on a mount point
+ */
+zx_fs_t *zxfs = NULL;
+
+/*
+ * Set from signal handler, main prints final report and exits
+ */
+volatile sig_atomic_t stop = 0;
 
 void
-zxlog(char *format, ...)
+onsignal(int sig)
 {
-    time_t curtime;
-    va_list args;
-                 
-    curtime = time (NULL);
-    printf("%s\t", ctime(&curtime));
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
+    stop = 1;
 }
 
-void
-enq(char *path)
+/*
+ * File operations used by load threads. They go to the mount point
+ * through system calls, or to the image through libzx with -I.
+ * Creates, removes, reads, writes and truncates are timed.
+ */
+int
+zxg_creat(const char *path, mode_t mode)
 {
-    struct iqe *e = NULL;
-
-    e = (struct iqe *) malloc(sizeof(struct iqe));
-    if (e) {
-        e->path = (char *) malloc(LEN);
-        strncpy(e->path, path, LEN - 1);
-        e->path[LEN] = '\0';
-        e->next = NULL;
-        
-        if (q.head == NULL) {
-            q.head = q.rear = e;
-        } else {
-            q.rear->next = e;
-            q.rear = e;
-        }
-        q.count = q.count + 1;
+    unsigned long long t = zxh_now();
+    int ret;
+
+    if (zxfs) {
+        ret = zx_open(zxfs, path, O_WRONLY | O_CREAT | O_EXCL, mode);
+    } else {
+        ret = open(path, O_WRONLY | O_CREAT | O_EXCL, mode);
     }
+    zxh_record(ZXH_CREATE, zxh_now() - t);
+    return ret;
+}
 
-    return;
+int
+zxg_open(const char *path, int flags)
+{
+    if (zxfs) {
+        return zx_open(zxfs, path, flags, 0);
+    }
+    return open(path, flags);
 }
 
-void
-deq(void)
+int
+zxg_close(int fd)
 {
-    struct iqe *t;
+    if (zxfs) {
+        return zx_close(zxfs, fd);
+    }
+    return close(fd);
+}
 
-    if (q.head != NULL) {
-        t = q.head;
-        if (t->next == NULL) {
-            q.head = q.rear = NULL;
-        } else {
-            q.head = t->next;
-        }
+ssize_t
+zxg_pwrite(int fd, const void *buf, size_t count, off_t off)
+{
+    unsigned long long t = zxh_now();
+    ssize_t ret;
+
+    if (zxfs) {
+        ret = zx_pwrite(zxfs, fd, buf, count, off);
+    } else {
+        ret = pwrite(fd, buf, count, off);
     }
-    q.count = q.count - 1;
-    free(t);
+    zxh_record(ZXH_PWRITE, zxh_now() - t);
+    return ret;
+}
+
+ssize_t
+zxg_pread(int fd, void *buf, size_t count, off_t off)
+{
+    unsigned long long t = zxh_now();
+    ssize_t ret;
 
-    return;
+    if (zxfs) {
+        ret = zx_pread(zxfs, fd, buf, count, off);
+    } else {
+        ret = pread(fd, buf, count, off);
+    }
+    zxh_record(ZXH_PREAD, zxh_now() - t);
+    return ret;
+}
+
+int
+zxg_fsync(int fd)
+{
+    unsigned long long t = zxh_now();
+    int ret;
+
+    if (zxfs && fd < 0) {
+        errno = EBADF;
+        ret = -1;
+    } else if (zxfs) {
+        ret = zx_fsync(zxfs, fd);
+    } else {
+        ret = fsync(fd);
+    }
+    zxh_record(ZXH_FSYNC, zxh_now() - t);
+    return ret;
+}
+
+int
+zxg_truncate(const char *path, off_t len)
+{
+    unsigned long long t = zxh_now();
+    int ret;
+
+    if (zxfs) {
+        ret = zx_truncate(zxfs, path, len);
+    } else {
+        ret = truncate(path, len);
+    }
+    zxh_record(ZXH_TRUNCATE, zxh_now() - t);
+    return ret;
+}
+
+int
+zxg_remove(const char *path)
+{
+    unsigned long long t = zxh_now();
+    int ret;
+
+    if (zxfs) {
+        ret = zx_unlink(zxfs, path);
+    } else {
+        ret = remove(path);
+    }
+    zxh_record(ZXH_REMOVE, zxh_now() - t);
+    return ret;
+}
+
+/*
+ * Back off when there is nothing to do, spin briefly first and then
+ * sleep for up to IDLE_MAX
+ */
+void
+idle(int *wait)
+{
+    if (*wait < 8) {
+        sched_yield();
+        (*wait)++;
+    } else {
+        usleep(*wait);
+        if (*wait < IDLE_MAX) {
+            *wait <<= 1;
+        }
+    }
 }
 
 char *
 getname(void)
 {
     char *name = NULL;
-    int len = (rand() % 30) + 1;
+    int len = zxr_below(LEN - 1) + 1;
     int i;
 
     name = (char *) malloc(len + 1);
     if (name) {
         for (i = 0; i < len; i++) {
-            if ((rand() % 10) == 0) {
-                name[i] = (char) (65 + ((rand() + 1) % 10) + (i % 10));
-            } else if ((rand() % 10) == 1) {
-                name[i] = (char) (48 + ((rand() + 1) % 10));
+            if (zxr_below(10) == 0) {
+                name[i] = (char) (65 + zxr_below(10) + (i % 10));
+            } else if (zxr_below(10) == 1) {
+                name[i] = (char) (48 + zxr_below(10));
             } else {
-                name[i] = (char) (97 + ((rand() + 1) % 10) + (i % 10));
+                name[i] = (char) (97 + zxr_below(10) + (i % 10));
             }
         }
         name[len] = '\0';
@@ -148,28 +232,49 @@ getname(void)
 void *
 creator(void *arg)
 {
+    struct zxf *zf;
     char *name;
-    int i, fd;
+    unsigned long long t;
+    int fd, n, wait = 0;
     struct carg *c = (struct carg *) arg;
-    
+
     while (TRUE) {
-        name = getname();
-        pthread_mutex_lock(&q.mlock);
-        if (q.count < c->max_inode) {
-            if (q.policy == LP_FIL_H) {
-                if ((fd = creat(name, 0775)) == -1) {
-                    fprintf(stderr, "Error: zxgen: %s, %s", name, strerror(errno));
-                    continue;
+        /*
+         * Reserve a slot first so creators together never go past
+         * max_inode
+         */
+        if ((n = __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED)) > c->max_inode) {
+            __atomic_sub_fetch(&count, 1, __ATOMIC_RELAXED);
+            idle(&wait);
+            continue;
+        }
+        wait = 0;
+        if ((zf = (struct zxf *) malloc(sizeof(struct zxf))) == NULL ||
+            (name = getname()) == NULL) {
+            __atomic_sub_fetch(&count, 1, __ATOMIC_RELAXED);
+            free(zf);
+            continue;
+        }
+        strcpy(zf->path, name);
+        free(name);
+        if (policy == LP_FIL_H) {
+            t = zxh_now();
+            if ((fd = zxg_creat(zf->path, 0775)) == -1) {
+                if (errno != EEXIST) {
+                    fprintf(stderr, "Error: zxgen: %s, %s\n", zf->path, strerror(errno));
                 }
-                zxlog("Created file %s[%d]\n", name, q.count);
-                close(fd);
+                __atomic_sub_fetch(&count, 1, __ATOMIC_RELAXED);
+                free(zf);
+                continue;
             }
-            enq(name);
+            zf->id = __atomic_fetch_add(&nextid, 1, __ATOMIC_RELAXED);
+            zxt_record(ZXT_CREATE, zf->id, 0, 0, t);
+            zxlog(ZXLOG_INFO, "Created file %s[%d]\n", zf->path, n);
+            zxg_close(fd);
         } else {
-            pthread_cond_wait(&q.wakeup_creator, &q.mlock);
+            zf->id = __atomic_fetch_add(&nextid, 1, __ATOMIC_RELAXED);
         }
-        pthread_mutex_unlock(&q.mlock);
-        free(name);
+        zxq_push(&q, zf);
         sleep(c->csleep);
     }
 
@@ -179,20 +284,26 @@ creator(void *arg)
 void *
 destroyer(void *arg)
 {
+    struct zxf *zf;
+    unsigned long long t;
+    int wait = 0;
+
     while (TRUE) {
         sleep(*(int *) arg);
-        pthread_mutex_lock(&q.mlock);
-        if (q.count > 0) {
-            if (remove(q.head->path) == -1) {
-                fprintf(stderr, "Error: zxgen: %s, %s", q.head->path, strerror(errno));
-                continue;
-            }
-            zxlog("Destroyed file %s[%d]\n", q.head->path, q.count);
-            deq();
+        while ((zf = zxq_pop(&q)) == NULL) {
+            idle(&wait);
+        }
+        wait = 0;
+        t = zxh_now();
+        if (zxg_remove(zf->path) == -1) {
+            fprintf(stderr, "Error: zxgen: %s, %s\n", zf->path, strerror(errno));
         } else {
-            pthread_cond_wait(&q.wakeup_destroyer, &q.mlock);
+            zxt_record(ZXT_REMOVE, zf->id, 0, 0, t);
+            zxlog(ZXLOG_INFO, "Destroyed file %s[%d]\n", zf->path,
+                  __atomic_load_n(&count, __ATOMIC_RELAXED));
         }
-        pthread_mutex_unlock(&q.mlock);
+        __atomic_sub_fetch(&count, 1, __ATOMIC_RELAXED);
+        free(zf);
     }
 
     pthread_exit(NULL);
@@ -201,79 +312,165 @@ destroyer(void *arg)
 void *
 fileio(void *arg)
 {
-    struct iqe *t = NULL;
+    struct zxf *zf;
     struct fioarg *f = (struct fioarg *) arg;
-    int i, j, fd;
-    char *block = (char *) malloc(f->blksize);
-    char *block2 = (char *) malloc(f->blksize);
+    unsigned long long t, seed;
+    int i, fd, len, wait = 0;
+    ssize_t n;
+    char *block;
+
+    if (f->engine == ENG_URING) {
+        return fileio_uring(arg);
+    }
+    block = (char *) malloc(f->blksize);
 
     while (TRUE) {
-        pthread_mutex_lock(&q.mlock);
-        for (t = q.head; t != NULL; t = t->next) {
-            if ((fd = open(t->path, O_RDWR)) == -1) {
-                fprintf(stderr, "Error: zxgen: %s, %s", t->path, strerror(errno));
+        if ((zf = zxq_pop(&q)) == NULL) {
+            idle(&wait);
+            continue;
+        }
+        wait = 0;
+        t = zxh_now();
+        if ((fd = zxg_open(zf->path, O_RDWR)) == -1) {
+            fprintf(stderr, "Error: zxgen: %s, %s\n", zf->path, strerror(errno));
+            __atomic_sub_fetch(&count, 1, __ATOMIC_RELAXED);
+            free(zf);
+            continue;
+        }
+        zxt_record(ZXT_OPEN, zf->id, 0, 0, t);
+        for (i = 0; i < f->maxblks; i++) {
+            if ((zxr_below(10) + 1) % (zxr_below(10) + 1) == 0) {
+                continue;
+            }
+            seed = zxr_next();
+            zxr_pattern(block, f->blksize, seed);
+            t = zxh_now();
+            if (zxg_pwrite(fd, block, f->blksize, (i * f->blksize)) == -1) {
+                fprintf(stderr, "Error: zxgen: %s, %s\n", zf->path, strerror(errno));
                 continue;
             }
-            for (i = 0; i < f->maxblks; i++) {
-                if (((rand() % 10) + 1) % ((rand() % 10) + 1) == 0) {
+            zxt_record(ZXT_WRITE, zf->id, (off_t) i * f->blksize, f->blksize, t);
+            zxlog(ZXLOG_BLOCK, "Wrote block %d of %s\n", i, zf->path);
+            if (f->iopolicy == IOP_DO_VERIFY) {
+                t = zxh_now();
+                if ((n = zxg_pread(fd, block, f->blksize, (i * f->blksize))) == -1) {
+                    fprintf(stderr, "Error: zxgen: %s, %s\n", zf->path, strerror(errno));
                     continue;
                 }
-                for (j = 0; j < f->blksize; j++) {
-                    block[i] = (char) (rand() % 10);
-                }
-                if (pwrite(fd, block, f->blksize, (i * f->blksize)) == -1) {
-                    fprintf(stderr, "Error: zxgen: %s, %s", t->path, strerror(errno));
+                zxt_record(ZXT_READ, zf->id, (off_t) i * f->blksize, f->blksize, t);
+                zxlog(ZXLOG_BLOCK, "Read block %d of %s\n", i, zf->path);
+                if (n != f->blksize || zxr_verify(block, f->blksize, seed) != 0) {
+                    fprintf(stderr, "Error: zxgen: %s, block %d does not verify\n", zf->path, i);
                     continue;
                 }
-                zxlog("Wrote block %d of %s\n", i, t->path);
-                if (f->iopolicy == IOP_DO_VERIFY) {
-                    if (pread(fd, block2, f->blksize, (i * f->blksize)) == -1) {
-                        fprintf(stderr, "Error: zxgen: %s, %s", t->path, strerror(errno));
-                        continue;
-                    }
-                    zxlog("Read block %d of %s\n", i, t->path);
-                    if (strcmp(block, block2) != 0) {
-                        fprintf(stderr, "Error: zxgen: %s, %s", t->path, strerror(errno));
-                        continue;
-                    }
-                    zxlog("Verified block %d of %s\n", i, t->path);
-                }
+                zxlog(ZXLOG_BLOCK, "Verified block %d of %s\n", i, zf->path);
             }
-            if ((rand() % 10) < 2) {
-                if (truncate(t->path, (rand() % 10)) == -1) {
-                    fprintf(stderr, "Error: zxgen: %s, %s", t->path, strerror(errno));
-                    continue;
-                }
-                zxlog("Truncated %s\n", t->path);
+        }
+        if (zxr_below(10) < 2) {
+            len = zxr_below(10);
+            t = zxh_now();
+            if (zxg_truncate(zf->path, len) == -1) {
+                fprintf(stderr, "Error: zxgen: %s, %s\n", zf->path, strerror(errno));
+            } else {
+                zxt_record(ZXT_TRUNCATE, zf->id, len, 0, t);
+                zxlog(ZXLOG_INFO, "Truncated %s\n", zf->path);
             }
-            close(fd);
         }
-        pthread_mutex_unlock(&q.mlock);
+        zxt_record(ZXT_CLOSE, zf->id, 0, 0, zxh_now());
+        zxg_close(fd);
+        zxq_push(&q, zf);
     }
     free(block);
-    free(block2);
 
     pthread_exit(NULL);
 }
 
+/*
+ * Block cache, inode cache and journal counters of libzx, image
+ * mode only
+ */
+static void
+cachereport(FILE *out, int json)
+{
+    zx_cache_stat_t cs;
+    zx_icache_stat_t is;
+    zx_jnl_stat_t js;
+    unsigned long long look;
+
+    zx_cachestat(zxfs, &cs);
+    look = cs.cs_hits + cs.cs_misses;
+    fprintf(out, json ? "{\"cache\":{\"hits\":%llu,\"misses\":%llu,\"hit_pct\":%.1f,"
+                        "\"evictions\":%llu,\"writeback\":%llu,\"writes\":%llu}}\n"
+                      : "zxgen: cache hits %llu misses %llu (%.1f%% hit) evictions %llu,"
+                        " wrote %llu blocks in %llu I/Os\n",
+            (unsigned long long) cs.cs_hits, (unsigned long long) cs.cs_misses,
+            look ? 100.0 * cs.cs_hits / look : 0.0,
+            (unsigned long long) cs.cs_evictions, (unsigned long long) cs.cs_writeback,
+            (unsigned long long) cs.cs_writes);
+    zx_icachestat(zxfs, &is);
+    look = is.is_hits + is.is_misses;
+    fprintf(out, json ? "{\"icache\":{\"hits\":%llu,\"misses\":%llu,\"hit_pct\":%.1f,"
+                        "\"reclaims\":%llu,\"writeback\":%llu,\"writes\":%llu,\"lazy\":%llu}}\n"
+                      : "zxgen: inode cache hits %llu misses %llu (%.1f%% hit) reclaims %llu,"
+                        " wrote %llu inodes in %llu blocks, %llu lazy timestamps\n",
+            (unsigned long long) is.is_hits, (unsigned long long) is.is_misses,
+            look ? 100.0 * is.is_hits / look : 0.0,
+            (unsigned long long) is.is_reclaims, (unsigned long long) is.is_writeback,
+            (unsigned long long) is.is_writes, (unsigned long long) is.is_lazy);
+    if (zx_jnlstat(zxfs, &js) == 0) {
+        fprintf(out, json ? "{\"journal\":{\"commits\":%llu,\"blocks\":%llu,\"revokes\":%llu,"
+                            "\"waits\":%llu,\"checkpoints\":%llu}}\n"
+                          : "zxgen: journal %llu commits of %llu blocks, %llu revokes,"
+                            " %llu waits, %llu checkpoints\n",
+                (unsigned long long) js.js_commits, (unsigned long long) js.js_blocks,
+                (unsigned long long) js.js_revokes, (unsigned long long) js.js_waits,
+                (unsigned long long) js.js_checkpoints);
+    }
+    fflush(out);
+}
+
+void
+usage(void)
+{
+    fprintf(stderr, "Usage:\n\tzxgen {-m <mount point> | -I <image>} [-i <max inodes>]"
+                    " [-c <creator sleep>] [-d <destroyer sleep>]"
+                    " [-b <block size>] [-k <max blocks>]"
+                    " [-p <io policy>] [-l <log file>]"
+                    " [-C <creators>] [-D <destroyers>] [-F <fileio threads>]"
+                    " [-t <report interval>] [-T <run time>] [-j]"
+                    " [-v <verbosity>] [-E sync|uring] [-Q <queue depth>]"
+                    " [-B <batch>] [-R <trace> | -P <trace> [-n <threads>] [-O]]"
+                    " [-s <seed>]\n");
+    exit(EXIT_FAILURE);
+}
+
 int
 main(int argc, char *argv[])
 {
     int opt, fd;
     char *mount_point = NULL;
+    char *image = NULL;
     struct carg carg = {63, 2};
-    struct fioarg f = {9, 512, IOP_NO_VERIFY};
+    struct fioarg f = {9, 512, IOP_NO_VERIFY, ENG_SYNC, 32, 8};
     int dsleep = 3;
     char *log_file = NULL;
-    pthread_t ptc1, ptc2, ptc3;
-    pthread_t ptd1, ptd2;
-    pthread_t ptf;
+    int ncreators = 3, ndestroyers = 2, nfileio = 1;
+    int interval = 10, runtime = 0, json = 0;
+    char *record = NULL, *replay = NULL;
+    int nreplay = 4, paced = 0, seeded = 0;
+    unsigned long long next, end;
+    struct timespec ts = {0, 100000000};
+    pthread_t pt;
+    int i;
 
-    while ((opt = getopt(argc, argv, "m:i:c:d:b:k:p:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "m:I:i:c:d:b:k:p:l:C:D:F:t:T:jv:E:Q:B:R:P:n:Os:")) != -1) {
         switch (opt) {
             case 'm':
                 mount_point = (char *) optarg;
                 break;
+            case 'I':
+                image = (char *) optarg;
+                break;
             case 'i':
                 carg.max_inode = atoi(optarg);
                 break;
@@ -292,6 +489,58 @@ main(int argc, char *argv[])
             case 'p':
                 f.iopolicy = atoi(optarg);
                 break;
+            case 'C':
+                ncreators = atoi(optarg);
+                break;
+            case 'D':
+                ndestroyers = atoi(optarg);
+                break;
+            case 'F':
+                nfileio = atoi(optarg);
+                break;
+            case 't':
+                interval = atoi(optarg);
+                break;
+            case 'T':
+                runtime = atoi(optarg);
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'v':
+                zxlog_level = atoi(optarg);
+                break;
+            case 'E':
+                if (strcmp(optarg, "sync") == 0) {
+                    f.engine = ENG_SYNC;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    f.engine = ENG_URING;
+                } else {
+                    usage();
+                }
+                break;
+            case 'Q':
+                f.depth = strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                f.batch = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                record = (char *) optarg;
+                break;
+            case 'P':
+                replay = (char *) optarg;
+                break;
+            case 'n':
+                nreplay = atoi(optarg);
+                break;
+            case 'O':
+                paced = 1;
+                break;
+            case 's':
+                zxr_seed = strtoull(optarg, NULL, 0);
+                seeded = 1;
+                break;
             case 'l':
                 log_file = (char *) optarg;
                 if ((fd = open(log_file, (O_WRONLY | O_CREAT))) == -1) {
@@ -305,19 +554,36 @@ main(int argc, char *argv[])
                 break;
             case '?':
             default:
-                fprintf(stderr, "Usage:\n\tzxgen -m <mount point> [-i <max inodes>]"
-                                " [-c <creator sleep>] [-d <destroyer sleep>]"
-                                " [-b <block size>] [-k <max blocks>]"
-                                " [-p <io policy>] [-l <log file>]");
-                exit(EXIT_FAILURE);
+                usage();
         }
     }
 
-    if ((optind == 1 || optind < argc) || mount_point == NULL) {
-        fprintf(stderr, "Usage:\n\tzxgen -m <mount point> [-i <max inodes>]"
-                        " [-c <creator sleep>] [-d <destroyer sleep>]"
-                        " [-b <block size>] [-k <max blocks>]"
-                        " [-p <io policy>] [-l <log file>]");
+    if ((optind == 1 || optind < argc) || (mount_point == NULL) == (image == NULL) ||
+        ncreators < 0 || ndestroyers < 0 || nfileio < 0 || carg.max_inode <= 0 ||
+        interval < 0 || runtime < 0 || f.depth < 2 || f.batch == 0 ||
+        (record != NULL && replay != NULL) || nreplay <= 0) {
+        usage();
+    }
+
+    if (!seeded) {
+        zxr_seed = zxh_now();
+    }
+
+    if (zxlog_init() == -1) {
+        fprintf(stderr, "Error: zxgen: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Open traces before moving to mount point, their paths are
+     * relative to where we started
+     */
+    if (record != NULL && zxt_open(record) == -1) {
+        fprintf(stderr, "Error: zxgen: %s: %s\n", record, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (replay != NULL && zxt_load(replay, nreplay, paced) == -1) {
+        fprintf(stderr, "Error: zxgen: %s: %s\n", replay, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
@@ -325,14 +591,84 @@ main(int argc, char *argv[])
         fprintf(stderr, "Error: zxgen: %s: %s\n", mount_point, strerror(errno));
         exit(EXIT_FAILURE);
     }
-    zxlog("Working directory changed to %s\n", mount_point);
+    if (mount_point != NULL) {
+        zxlog(ZXLOG_INFO, "Working directory changed to %s\n", mount_point);
+    }
 
-    pthread_create(&ptc1, NULL, creator, (void *) &carg);
-    pthread_create(&ptc2, NULL, creator, (void *) &carg);
-    pthread_create(&ptc3, NULL, creator, (void *) &carg);
-    pthread_create(&ptf, NULL, fileio, (void *) &f);
-    pthread_create(&ptd1, NULL, destroyer, (void *) &dsleep);
-    pthread_create(&ptd2, NULL, destroyer, (void *) &dsleep);
+    if (image != NULL && f.engine == ENG_URING) {
+        fprintf(stderr, "Error: zxgen: uring engine needs a mount point (-m)\n");
+        exit(EXIT_FAILURE);
+    }
 
-    pthread_exit(NULL);
+    if ((image != NULL) && ((zxfs = zx_mount(image, O_RDWR)) == NULL)) {
+        fprintf(stderr, "Error: zxgen: %s: %s\n", image, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (image != NULL) {
+        zxlog(ZXLOG_INFO, "Using zxfs image %s through libzx\n", image);
+    }
+    fprintf(stderr, "zxgen: random seed %llu\n", zxr_seed);
+
+    if (zxq_init(&q, carg.max_inode) == -1) {
+        fprintf(stderr, "Error: zxgen: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    zxh_init();
+    signal(SIGINT, onsignal);
+    signal(SIGTERM, onsignal);
+
+    /*
+     * Replay drives the load itself, there are no load threads
+     */
+    if (replay != NULL) {
+        if (zxt_start() == -1) {
+            fprintf(stderr, "Error: zxgen: %s: %s\n", replay, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        zxlog(ZXLOG_INFO, "Replaying %s with %d threads\n", replay, nreplay);
+    } else {
+        for (i = 0; i < ncreators; i++) {
+            pthread_create(&pt, NULL, creator, (void *) &carg);
+        }
+        for (i = 0; i < nfileio; i++) {
+            pthread_create(&pt, NULL, fileio, (void *) &f);
+        }
+        for (i = 0; i < ndestroyers; i++) {
+            pthread_create(&pt, NULL, destroyer, (void *) &dsleep);
+        }
+        zxlog(ZXLOG_INFO, "Started %d creators, %d destroyers, %d fileio threads\n",
+              ncreators, ndestroyers, nfileio);
+    }
+
+    /*
+     * Report every interval seconds until run time is over, replay
+     * is done or we get a signal, then once more for the whole run.
+     * Reports go to stderr, stdout may be the log.
+     */
+    next = zxh_now() + interval * 1000000000ULL;
+    end = zxh_now() + runtime * 1000000000ULL;
+    while (!stop && (runtime == 0 || zxh_now() < end) && (replay == NULL || !zxt_done())) {
+        nanosleep(&ts, NULL);
+        if (interval > 0 && zxh_now() >= next) {
+            zxh_report(stderr, 0, json);
+            next += interval * 1000000000ULL;
+        }
+    }
+    zxh_report(stderr, 1, json);
+
+    /*
+     * Load threads are still running, freeze stops them between two
+     * operations with everything written back
+     */
+    if (zxfs) {
+        if (zx_freeze(zxfs) == -1) {
+            fprintf(stderr, "Error: zxgen: %s: %s\n", image, strerror(errno));
+        }
+        cachereport(stderr, json);
+    }
+    zxt_close();
+    zxlog_stop();
+
+    exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,151 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  test/zxgen/zxgen.h
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  zxgen - metadata and io load generator for zxfs
+ *
+ */
+
+#ifndef ZXGEN_H
+#define ZXGEN_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <signal.h>
+#include <sys/types.h>
+#include "../../lib/libzx.h"
+
+#define ZXG_CACHELINE   64
+
+#define IOP_NO_VERIFY   0
+#define IOP_DO_VERIFY   1
+
+/* fileio engines */
+#define ENG_SYNC        0       /* pwrite/pread, one block at a time */
+#define ENG_URING       1       /* batched io_uring, mount point only */
+
+struct fioarg {
+    int maxblks;
+    int blksize;
+    int iopolicy;
+    int engine;
+    unsigned depth;             /* uring I/Os in flight per thread */
+    unsigned batch;             /* uring sqes per submit */
+};
+
+/*
+ * File worked on by load threads
+ */
+struct zxf {
+    unsigned id;                /* numbers file in a trace */
+    char path[ZX_MAX_NAME];
+};
+
+/*
+ * Bounded multi producer multi consumer queue of files. Every cell
+ * carries a sequence number telling whether it is ready for the next
+ * push or the next pop, so producers and consumers only ever race on
+ * their own position counter with a compare and swap, no lock.
+ */
+struct zxq_cell {
+    size_t seq;
+    void *item;
+};
+
+struct zxq {
+    struct zxq_cell *cells;
+    size_t mask;
+    size_t head __attribute__((aligned(ZXG_CACHELINE)));    /* next push */
+    size_t tail __attribute__((aligned(ZXG_CACHELINE)));    /* next pop */
+};
+
+extern int   zxq_init(struct zxq *q, size_t size);
+extern int   zxq_push(struct zxq *q, void *item);
+extern void *zxq_pop(struct zxq *q);
+
+extern struct zxq q;
+extern int count;
+extern volatile sig_atomic_t stop;
+
+extern void idle(int *wait);
+extern int  zxg_creat(const char *path, mode_t mode);
+extern int  zxg_open(const char *path, int flags);
+extern int  zxg_close(int fd);
+extern ssize_t zxg_pwrite(int fd, const void *buf, size_t count, off_t off);
+extern ssize_t zxg_pread(int fd, void *buf, size_t count, off_t off);
+extern int  zxg_truncate(const char *path, off_t len);
+extern int  zxg_remove(const char *path);
+extern int  zxg_fsync(int fd);
+extern void *fileio_uring(void *arg);
+
+/*
+ * Operations timed by zxgen
+ */
+#define ZXH_CREATE      0
+#define ZXH_REMOVE      1
+#define ZXH_PWRITE      2
+#define ZXH_PREAD       3
+#define ZXH_TRUNCATE    4
+#define ZXH_FSYNC       5
+#define ZXH_OPS         6
+
+extern unsigned long long zxh_now(void);
+extern void zxh_init(void);
+extern void zxh_record(int op, unsigned long long ns);
+extern void zxh_report(FILE *out, int final, int json);
+
+/*
+ * Log levels. Records above ZXLOG_LEVEL are compiled out, records
+ * above zxlog_level (-v) are skipped at run time. Build with
+ * LOGLEVEL=1 to take per block records off the fileio path entirely.
+ */
+#define ZXLOG_INFO      1       /* creates, removes, truncates */
+#define ZXLOG_BLOCK     2       /* every block written, read, verified */
+
+#ifndef ZXLOG_LEVEL
+#define ZXLOG_LEVEL     ZXLOG_BLOCK
+#endif
+
+#define zxlog(level, ...)                                               \
+    do {                                                                \
+        if ((level) <= ZXLOG_LEVEL && (level) <= zxlog_level) {         \
+            zxlog_write(__VA_ARGS__);                                   \
+        }                                                               \
+    } while (0)
+
+extern int  zxlog_level;
+extern int  zxlog_init(void);
+extern void zxlog_write(const char *fmt, ...);
+extern void zxlog_stop(void);
+
+/*
+ * Operations in a trace
+ */
+#define ZXT_CREATE      1
+#define ZXT_REMOVE      2
+#define ZXT_OPEN        3
+#define ZXT_CLOSE       4
+#define ZXT_WRITE       5
+#define ZXT_READ        6
+#define ZXT_TRUNCATE    7
+#define ZXT_FSYNC       8
+
+extern int  zxt_open(const char *path);
+extern void zxt_record(int op, unsigned id, off_t off, unsigned len, unsigned long long t);
+extern void zxt_close(void);
+extern int  zxt_load(const char *path, int nthreads, int paced);
+extern int  zxt_start(void);
+extern int  zxt_done(void);
+
+extern unsigned long long zxr_seed;
+extern unsigned long long zxr_next(void);
+extern unsigned zxr_below(unsigned n);
+extern void zxr_pattern(void *buf, size_t len, unsigned long long seed);
+extern int  zxr_verify(const void *buf, size_t len, unsigned long long seed);
+
+#endif /* ZXGEN_H */
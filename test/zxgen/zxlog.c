@@ -0,0 +1,246 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  test/zxgen/zxlog.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Asynchronous log for zxgen.
+ *
+ *  Load threads never touch stdio: a log call copies its format
+ *  pointer, integer arguments and at most one string into a fixed
+ *  size record in the calling thread's own ring. A background thread
+ *  merges all rings in timestamp order, formats and writes them out.
+ *  Each ring has one producer and one consumer, so head and tail are
+ *  plain atomic loads and stores; rings are only ever added at the
+ *  front of the ring list, so the writer walks it without a lock. A full ring drops the record rather
+ *  than stall the load, drops are counted and reported at the end.
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include "zxgen.h"
+
+#define ZXLOG_RING      1024            /* records per thread, power of 2 */
+#define ZXLOG_ARGS      4               /* integer arguments per record */
+#define ZXLOG_STR       256             /* string argument, with NUL */
+
+struct zxlog_rec {
+    unsigned long long ts;
+    const char *fmt;
+    int argv[ZXLOG_ARGS];
+    char str[ZXLOG_STR];
+};
+
+struct zxlog_ring {
+    unsigned long head __attribute__((aligned(ZXG_CACHELINE)));    /* producer */
+    unsigned long tail __attribute__((aligned(ZXG_CACHELINE)));    /* consumer */
+    unsigned long drops;
+    struct zxlog_ring *next;
+    struct zxlog_rec rec[ZXLOG_RING];
+};
+
+int zxlog_level = ZXLOG_LEVEL;
+
+static struct zxlog_ring *zxlog_rings = NULL;
+static pthread_mutex_t zxlog_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct zxlog_ring *zxlog_self = NULL;
+static pthread_t zxlog_thread;
+static volatile int zxlog_stopping = 0;
+static int zxlog_running = 0;
+static long long zxlog_epoch;           /* realtime - monotonic, ns */
+
+static struct zxlog_ring *
+zxlog_ring(void)
+{
+    struct zxlog_ring *r;
+
+    if ((r = (struct zxlog_ring *) calloc(1, sizeof(struct zxlog_ring))) == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&zxlog_lock);
+    r->next = zxlog_rings;
+    __atomic_store_n(&zxlog_rings, r, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&zxlog_lock);
+
+    return r;
+}
+
+/*
+ * Queue one record. Only %d and %s conversions are understood, with
+ * at most ZXLOG_ARGS of the former and one of the latter.
+ */
+void
+zxlog_write(const char *fmt, ...)
+{
+    struct zxlog_ring *r = zxlog_self;
+    struct zxlog_rec *rec;
+    unsigned long head;
+    const char *p, *s;
+    size_t len;
+    va_list args;
+    int n = 0;
+
+    if (r == NULL && (r = zxlog_self = zxlog_ring()) == NULL) {
+        return;
+    }
+    head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == ZXLOG_RING) {
+        __atomic_store_n(&r->drops, r->drops + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec = &r->rec[head & (ZXLOG_RING - 1)];
+    rec->ts = zxh_now();
+    rec->fmt = fmt;
+    rec->str[0] = '\0';
+    va_start(args, fmt);
+    for (p = fmt; *p != '\0'; p++) {
+        if (*p != '%') {
+            continue;
+        }
+        if (*++p == 'd' && n < ZXLOG_ARGS) {
+            rec->argv[n++] = va_arg(args, int);
+        } else if (*p == 's') {
+            s = va_arg(args, const char *);
+            len = strlen(s);
+            len = (len < ZXLOG_STR - 1) ? len : ZXLOG_STR - 1;
+            memcpy(rec->str, s, len);
+            rec->str[len] = '\0';
+        } else if (*p == '\0') {
+            break;
+        }
+    }
+    va_end(args);
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void
+zxlog_print(FILE *out, const struct zxlog_rec *rec)
+{
+    long long ns = (long long) rec->ts + zxlog_epoch;
+    time_t secs = ns / 1000000000LL;
+    const char *p;
+    struct tm tm;
+    char stamp[32];
+    int n = 0;
+
+    localtime_r(&secs, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(out, "%s.%06lld\t", stamp, (ns % 1000000000LL) / 1000);
+
+    for (p = rec->fmt; *p != '\0'; p++) {
+        if (*p != '%') {
+            putc(*p, out);
+        } else if (*++p == 'd') {
+            fprintf(out, "%d", (n < ZXLOG_ARGS) ? rec->argv[n++] : 0);
+        } else if (*p == 's') {
+            fputs(rec->str, out);
+        } else if (*p == '\0') {
+            break;
+        } else {
+            putc(*p, out);
+        }
+    }
+}
+
+/*
+ * Write out everything queued so far, oldest record first across all
+ * threads. Returns number of records written.
+ */
+static int
+zxlog_drain(FILE *out)
+{
+    struct zxlog_ring *r, *min;
+    struct zxlog_rec *rec, *mrec = NULL;
+    int n = 0;
+
+    for (;;) {
+        min = NULL;
+        for (r = __atomic_load_n(&zxlog_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+            if (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            rec = &r->rec[r->tail & (ZXLOG_RING - 1)];
+            if (min == NULL || rec->ts < mrec->ts) {
+                min = r;
+                mrec = rec;
+            }
+        }
+        if (min == NULL) {
+            break;
+        }
+        zxlog_print(out, mrec);
+        __atomic_store_n(&min->tail, min->tail + 1, __ATOMIC_RELEASE);
+        n++;
+    }
+    if (n > 0) {
+        fflush(out);
+    }
+
+    return n;
+}
+
+static void *
+zxlog_main(void *arg)
+{
+    struct timespec ts = {0, 10000000};
+
+    while (!zxlog_stopping) {
+        zxlog_drain(stdout);
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+/*
+ * Start background writer, records go to stdout
+ */
+int
+zxlog_init(void)
+{
+    struct timespec rt;
+
+    clock_gettime(CLOCK_REALTIME, &rt);
+    zxlog_epoch = (long long) rt.tv_sec * 1000000000LL + rt.tv_nsec - (long long) zxh_now();
+    if (pthread_create(&zxlog_thread, NULL, zxlog_main, NULL) != 0) {
+        return -1;
+    }
+    zxlog_running = 1;
+
+    return 0;
+}
+
+/*
+ * Stop background writer and write out whatever is left
+ */
+void
+zxlog_stop(void)
+{
+    struct zxlog_ring *r;
+    unsigned long drops = 0;
+
+    if (zxlog_running) {
+        zxlog_stopping = 1;
+        pthread_join(zxlog_thread, NULL);
+        zxlog_running = 0;
+    }
+    zxlog_drain(stdout);
+    for (r = __atomic_load_n(&zxlog_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        drops += __atomic_load_n(&r->drops, __ATOMIC_RELAXED);
+    }
+    if (drops > 0) {
+        fprintf(stderr, "zxgen: %lu log records dropped\n", drops);
+    }
+    fflush(stdout);
+}
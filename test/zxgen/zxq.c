@@ -0,0 +1,111 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  test/zxgen/zxq.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Lock free file queue shared by zxgen load threads.
+ *
+ *  Cell i starts with seq i. A push at position pos owns the cell
+ *  once seq == pos and publishes it with seq = pos + 1; a pop at pos
+ *  owns it once seq == pos + 1 and hands it back to the push one lap
+ *  later with seq = pos + size.
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include "zxgen.h"
+
+/*
+ * Set up queue for at least size items, size is rounded up to a
+ * power of two
+ */
+int
+zxq_init(struct zxq *q, size_t size)
+{
+    size_t n, i;
+
+    for (n = 2; n < size; n <<= 1)
+        ;
+    if ((q->cells = (struct zxq_cell *) calloc(n, sizeof(struct zxq_cell))) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        q->cells[i].seq = i;
+    }
+    q->mask = n - 1;
+    q->head = 0;
+    q->tail = 0;
+
+    return 0;
+}
+
+/*
+ * Returns -1 with EAGAIN when queue is full
+ */
+int
+zxq_push(struct zxq *q, void *item)
+{
+    struct zxq_cell *c;
+    size_t pos, seq;
+    long diff;
+
+    pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;) {
+        c = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        diff = (long) (seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            errno = EAGAIN;
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+    c->item = item;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * Returns NULL when queue is empty
+ */
+void *
+zxq_pop(struct zxq *q)
+{
+    struct zxq_cell *c;
+    size_t pos, seq;
+    void *item;
+    long diff;
+
+    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        c = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        diff = (long) (seq - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    item = c->item;
+    __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+    return item;
+}
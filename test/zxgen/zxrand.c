@@ -0,0 +1,130 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  test/zxgen/zxrand.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Random numbers and block data for zxgen.
+ *
+ *  Every thread has its own xoshiro256** generator, seeded from the
+ *  run seed (-s) and the order threads first asked for a number, so
+ *  there is no shared state and no lock as with rand().
+ *
+ *  Block data is a pattern computed from a 64 bit seed a word at a
+ *  time, word i being a splitmix64 mix of seed + i. A block read back
+ *  is verified by recomputing the pattern from its seed, so nothing
+ *  but the seed has to be kept from the write.
+ *
+ */
+
+#include <string.h>
+#include "zxgen.h"
+
+#define ZXR_GOLDEN  0x9e3779b97f4a7c15ULL
+
+unsigned long long zxr_seed = 0;
+
+static unsigned zxr_threads = 0;
+static __thread unsigned long long zxr_s[4];
+static __thread int zxr_ready = 0;
+
+static unsigned long long
+zxr_mix(unsigned long long z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static unsigned long long
+zxr_rotl(unsigned long long x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static void
+zxr_init(void)
+{
+    unsigned long long z;
+    int i;
+
+    z = zxr_seed + ZXR_GOLDEN * (__atomic_fetch_add(&zxr_threads, 1, __ATOMIC_RELAXED) + 1);
+    for (i = 0; i < 4; i++) {
+        z += ZXR_GOLDEN;
+        zxr_s[i] = zxr_mix(z);
+    }
+    zxr_ready = 1;
+}
+
+unsigned long long
+zxr_next(void)
+{
+    unsigned long long *s = zxr_s;
+    unsigned long long r, t;
+
+    if (!zxr_ready) {
+        zxr_init();
+    }
+    r = zxr_rotl(s[1] * 5, 7) * 9;
+    t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = zxr_rotl(s[3], 45);
+
+    return r;
+}
+
+/*
+ * Uniform in [0, n)
+ */
+unsigned
+zxr_below(unsigned n)
+{
+    return (unsigned) (((zxr_next() >> 32) * n) >> 32);
+}
+
+void
+zxr_pattern(void *buf, size_t len, unsigned long long seed)
+{
+    unsigned long long w, *p = (unsigned long long *) buf;
+    size_t i, n = len >> 3;
+
+    for (i = 0; i < n; i++) {
+        p[i] = zxr_mix(seed + ZXR_GOLDEN * i);
+    }
+    if (len & 7) {
+        w = zxr_mix(seed + ZXR_GOLDEN * n);
+        memcpy(p + n, &w, len & 7);
+    }
+}
+
+/*
+ * Returns 0 when buf holds pattern of seed, -1 otherwise
+ */
+int
+zxr_verify(const void *buf, size_t len, unsigned long long seed)
+{
+    const unsigned long long *p = (const unsigned long long *) buf;
+    unsigned long long w;
+    size_t i, n = len >> 3;
+
+    for (i = 0; i < n; i++) {
+        if (p[i] != zxr_mix(seed + ZXR_GOLDEN * i)) {
+            return -1;
+        }
+    }
+    if (len & 7) {
+        w = zxr_mix(seed + ZXR_GOLDEN * n);
+        if (memcmp(p + n, &w, len & 7) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
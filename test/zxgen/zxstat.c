@@ -0,0 +1,246 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  test/zxgen/zxstat.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Per operation latency histograms for zxgen.
+ *
+ *  Latencies are kept in nanoseconds in log linear buckets: values
+ *  below ZXH_SUB get a bucket each, above that every power of two is
+ *  split in ZXH_SUB / 2 buckets, so any value is off by at most 1 / 16
+ *  from its bucket bound whatever its magnitude.
+ *
+ *  Each thread records into its own histograms with no sharing, the
+ *  reporter merges all of them when it prints. Counters are single
+ *  writer, relaxed atomic loads and stores are enough for the reader.
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "zxgen.h"
+
+#define ZXH_SUB_BITS    5
+#define ZXH_SUB         (1 << ZXH_SUB_BITS)
+#define ZXH_HALF        (ZXH_SUB >> 1)
+#define ZXH_BUCKETS     (ZXH_SUB + (64 - ZXH_SUB_BITS) * ZXH_HALF)
+
+struct zxh {
+    unsigned long long count[ZXH_OPS];
+    unsigned long long sum[ZXH_OPS];
+    unsigned long long max[ZXH_OPS];
+    unsigned long long b[ZXH_OPS][ZXH_BUCKETS];
+};
+
+struct zxh_thread {
+    struct zxh h;
+    struct zxh_thread *next;
+};
+
+static const char *zxh_names[ZXH_OPS] = {
+    "create", "remove", "pwrite", "pread", "truncate", "fsync"
+};
+
+static struct zxh_thread *zxh_threads = NULL;
+static pthread_mutex_t zxh_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct zxh_thread *zxh_self = NULL;
+
+static struct zxh zxh_last;             /* totals at previous report */
+static unsigned long long zxh_start, zxh_prev;
+
+unsigned long long
+zxh_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+zxh_bucket(unsigned long long v)
+{
+    int msb;
+
+    if (v < ZXH_SUB) {
+        return (int) v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    return ZXH_SUB + (msb - ZXH_SUB_BITS) * ZXH_HALF +
+           (int) ((v >> (msb - ZXH_SUB_BITS + 1)) - ZXH_HALF);
+}
+
+/*
+ * Highest value that falls in bucket i
+ */
+static unsigned long long
+zxh_value(int i)
+{
+    int shift;
+
+    if (i < ZXH_SUB) {
+        return i;
+    }
+    shift = (i - ZXH_SUB) / ZXH_HALF + 1;
+    return ((((unsigned long long) ((i - ZXH_SUB) % ZXH_HALF + ZXH_HALF)) + 1) << shift) - 1;
+}
+
+void
+zxh_init(void)
+{
+    zxh_start = zxh_prev = zxh_now();
+    memset(&zxh_last, 0, sizeof(zxh_last));
+}
+
+/*
+ * Record latency ns of one op in calling thread's histogram, threads
+ * register themselves on their first record
+ */
+void
+zxh_record(int op, unsigned long long ns)
+{
+    struct zxh *h;
+    int i = zxh_bucket(ns);
+
+    if (zxh_self == NULL) {
+        if ((zxh_self = (struct zxh_thread *) calloc(1, sizeof(struct zxh_thread))) == NULL) {
+            return;
+        }
+        pthread_mutex_lock(&zxh_lock);
+        zxh_self->next = zxh_threads;
+        zxh_threads = zxh_self;
+        pthread_mutex_unlock(&zxh_lock);
+    }
+    h = &zxh_self->h;
+
+    __atomic_store_n(&h->b[op][i], h->b[op][i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum[op], h->sum[op] + ns, __ATOMIC_RELAXED);
+    if (ns > h->max[op]) {
+        __atomic_store_n(&h->max[op], ns, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&h->count[op], h->count[op] + 1, __ATOMIC_RELAXED);
+}
+
+static void
+zxh_merge(struct zxh *all)
+{
+    struct zxh_thread *t;
+    int op, i;
+
+    memset(all, 0, sizeof(struct zxh));
+    pthread_mutex_lock(&zxh_lock);
+    for (t = zxh_threads; t != NULL; t = t->next) {
+        for (op = 0; op < ZXH_OPS; op++) {
+            all->count[op] += __atomic_load_n(&t->h.count[op], __ATOMIC_RELAXED);
+            all->sum[op] += __atomic_load_n(&t->h.sum[op], __ATOMIC_RELAXED);
+            if (t->h.max[op] > all->max[op]) {
+                all->max[op] = __atomic_load_n(&t->h.max[op], __ATOMIC_RELAXED);
+            }
+            for (i = 0; i < ZXH_BUCKETS; i++) {
+                all->b[op][i] += __atomic_load_n(&t->h.b[op][i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&zxh_lock);
+}
+
+/*
+ * Value at quantile q of histogram b holding n values, in microseconds.
+ * Bucket bound is capped at max value seen.
+ */
+static double
+zxh_quantile(const unsigned long long *b, unsigned long long n,
+             unsigned long long max, double q)
+{
+    unsigned long long v, want, seen = 0;
+    int i;
+
+    if (n == 0) {
+        return 0;
+    }
+    want = (unsigned long long) (q * n);
+    if (want >= n) {
+        want = n - 1;
+    }
+    for (i = 0; i < ZXH_BUCKETS; i++) {
+        if ((seen += b[i]) > want) {
+            break;
+        }
+    }
+    v = zxh_value(i < ZXH_BUCKETS ? i : ZXH_BUCKETS - 1);
+    return ((v < max) ? v : max) / 1000.0;
+}
+
+static void
+zxh_print(FILE *out, const struct zxh *h, double secs, int final, int json)
+{
+    unsigned long long n;
+    double rate, avg, p50, p99, p999;
+    int op;
+
+    if (json) {
+        fprintf(out, "{\"final\":%s,\"elapsed\":%.3f,\"interval\":%.3f,\"ops\":{",
+                final ? "true" : "false", (zxh_now() - zxh_start) / 1e9, secs);
+    } else {
+        fprintf(out, "zxgen: %s %.1fs, elapsed %.1fs\n", final ? "total" : "interval",
+                secs, (zxh_now() - zxh_start) / 1e9);
+        fprintf(out, "%-9s %10s %10s %10s %10s %10s %10s %10s\n", "op", "count",
+                "ops/s", "avg(us)", "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+    }
+    for (op = 0; op < ZXH_OPS; op++) {
+        n = h->count[op];
+        rate = (secs > 0) ? n / secs : 0;
+        avg = n ? h->sum[op] / 1e3 / n : 0;
+        p50 = zxh_quantile(h->b[op], n, h->max[op], 0.50);
+        p99 = zxh_quantile(h->b[op], n, h->max[op], 0.99);
+        p999 = zxh_quantile(h->b[op], n, h->max[op], 0.999);
+        if (json) {
+            fprintf(out, "%s\"%s\":{\"count\":%llu,\"ops_per_sec\":%.1f,\"avg_us\":%.1f,"
+                    "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}",
+                    op ? "," : "", zxh_names[op], n, rate, avg, p50, p99, p999,
+                    h->max[op] / 1e3);
+        } else {
+            fprintf(out, "%-9s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                    zxh_names[op], n, rate, avg, p50, p99, p999, h->max[op] / 1e3);
+        }
+    }
+    fprintf(out, json ? "}}\n" : "\n");
+    fflush(out);
+}
+
+/*
+ * Print what happened since last report, or the whole run when final.
+ * Max of an interval is not tracked, interval reports show run max.
+ */
+void
+zxh_report(FILE *out, int final, int json)
+{
+    static struct zxh all, delta;
+    unsigned long long now = zxh_now();
+    int op, i;
+
+    zxh_merge(&all);
+    if (final) {
+        zxh_print(out, &all, (now - zxh_start) / 1e9, 1, json);
+        return;
+    }
+
+    for (op = 0; op < ZXH_OPS; op++) {
+        delta.count[op] = all.count[op] - zxh_last.count[op];
+        delta.sum[op] = all.sum[op] - zxh_last.sum[op];
+        delta.max[op] = all.max[op];
+        for (i = 0; i < ZXH_BUCKETS; i++) {
+            delta.b[op][i] = all.b[op][i] - zxh_last.b[op][i];
+        }
+    }
+    zxh_print(out, &delta, (now - zxh_prev) / 1e9, 0, json);
+    memcpy(&zxh_last, &all, sizeof(struct zxh));
+    zxh_prev = now;
+}
@@ -0,0 +1,401 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  test/zxgen/zxtrace.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  Trace record (-R) and replay (-P) for zxgen.
+ *
+ *  A trace is a header followed by fixed size little endian records:
+ *  start time relative to the start of recording, file id, offset and
+ *  length. Threads buffer their records privately and append them to
+ *  the trace a buffer at a time, so records of different threads are
+ *  not in time order in the file; replay sorts them.
+ *
+ *  Replay gives every file to one thread (id % threads) and runs each
+ *  thread's records in time order, so operations on a file happen in
+ *  the order they were recorded while different files go in parallel.
+ *  Files are named after their id, data written is random.
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "zxgen.h"
+
+#define ZXT_MAGIC       0x5254585a      /* "ZXTR" */
+#define ZXT_VERSION     1
+#define ZXT_BUF         4096            /* records buffered per thread */
+
+struct zxt_header {
+    __le32 h_magic;
+    __le32 h_version;
+};
+
+struct zxt_rec {
+    __le64 r_time;                      /* ns since start of recording */
+    __le64 r_off;                       /* offset, or length for truncate */
+    __le32 r_id;
+    __le32 r_oplen;                     /* op << 24 | length */
+};
+
+struct zxt_buf {
+    pthread_mutex_t lock;
+    int n;
+    struct zxt_buf *next;
+    struct zxt_rec rec[ZXT_BUF];
+};
+
+/*
+ * Recording
+ */
+static int zxt_fd = -1;
+static unsigned long long zxt_begin;     /* start of recording */
+static struct zxt_buf *zxt_bufs = NULL;
+static pthread_mutex_t zxt_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct zxt_buf *zxt_self = NULL;
+
+/*
+ * Replay
+ */
+struct zxt_replay {
+    struct zxt_rec **rec;               /* this thread's records, in order */
+    size_t n;
+    pthread_t tid;
+};
+
+static struct zxt_replay *zxt_threads = NULL;
+static unsigned long long zxt_t0;      /* start of replay */
+static int zxt_paced = 0;
+static int zxt_nthreads = 0;
+static int zxt_running = 0;
+static int *zxt_fds = NULL;             /* open descriptor per file id */
+static struct zxt_rec *zxt_recs = NULL;
+
+int
+zxt_open(const char *path)
+{
+    struct zxt_header h;
+
+    if ((zxt_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        return -1;
+    }
+    h.h_magic = htole32(ZXT_MAGIC);
+    h.h_version = htole32(ZXT_VERSION);
+    if (write(zxt_fd, &h, sizeof(h)) != sizeof(h)) {
+        close(zxt_fd);
+        zxt_fd = -1;
+        return -1;
+    }
+    zxt_begin = zxh_now();
+
+    return 0;
+}
+
+static void
+zxt_flush(struct zxt_buf *b)
+{
+    size_t len = b->n * sizeof(struct zxt_rec);
+
+    if (b->n == 0) {
+        return;
+    }
+    pthread_mutex_lock(&zxt_lock);
+    if (zxt_fd != -1 && write(zxt_fd, b->rec, len) != (ssize_t) len) {
+        fprintf(stderr, "Error: zxgen: trace, %s\n", strerror(errno));
+    }
+    pthread_mutex_unlock(&zxt_lock);
+    b->n = 0;
+}
+
+/*
+ * Record op on file id started at t (zxh_now() time). Does nothing
+ * unless recording.
+ */
+void
+zxt_record(int op, unsigned id, off_t off, unsigned len, unsigned long long t)
+{
+    struct zxt_buf *b = zxt_self;
+    struct zxt_rec *r;
+
+    if (zxt_fd == -1) {
+        return;
+    }
+    if (b == NULL) {
+        if ((b = (struct zxt_buf *) calloc(1, sizeof(struct zxt_buf))) == NULL) {
+            return;
+        }
+        pthread_mutex_init(&b->lock, NULL);
+        pthread_mutex_lock(&zxt_lock);
+        b->next = zxt_bufs;
+        zxt_bufs = b;
+        pthread_mutex_unlock(&zxt_lock);
+        zxt_self = b;
+    }
+
+    pthread_mutex_lock(&b->lock);
+    r = &b->rec[b->n++];
+    r->r_time = htole64(t - zxt_begin);
+    r->r_off = htole64(off);
+    r->r_id = htole32(id);
+    r->r_oplen = htole32(((unsigned) op << 24) | (len & 0xffffff));
+    if (b->n == ZXT_BUF) {
+        zxt_flush(b);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * Write out what is buffered and stop recording
+ */
+void
+zxt_close(void)
+{
+    struct zxt_buf *b;
+
+    if (zxt_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&zxt_lock);
+    b = zxt_bufs;
+    pthread_mutex_unlock(&zxt_lock);
+    for (; b != NULL; b = b->next) {
+        pthread_mutex_lock(&b->lock);
+        zxt_flush(b);
+        pthread_mutex_unlock(&b->lock);
+    }
+    pthread_mutex_lock(&zxt_lock);
+    close(zxt_fd);
+    zxt_fd = -1;
+    pthread_mutex_unlock(&zxt_lock);
+}
+
+/*
+ * Order by time, then by position in trace
+ */
+static int
+zxt_cmp(const void *a, const void *b)
+{
+    const struct zxt_rec *x = *(const struct zxt_rec **) a;
+    const struct zxt_rec *y = *(const struct zxt_rec **) b;
+    unsigned long long tx = le64toh(x->r_time), ty = le64toh(y->r_time);
+
+    if (tx != ty) {
+        return (tx < ty) ? -1 : 1;
+    }
+    return (x < y) ? -1 : (x > y);
+}
+
+static void
+zxt_name(char *name, unsigned id)
+{
+    snprintf(name, ZX_MAX_NAME, "zxt%u", id);
+}
+
+static void
+zxt_play(const struct zxt_rec *r, char *buf, size_t buflen)
+{
+    unsigned id = le32toh(r->r_id);
+    unsigned op = le32toh(r->r_oplen) >> 24;
+    unsigned len = le32toh(r->r_oplen) & 0xffffff;
+    off_t off = le64toh(r->r_off);
+    char name[ZX_MAX_NAME];
+    int fd;
+
+    zxt_name(name, id);
+    if (len > buflen) {
+        len = buflen;
+    }
+    switch (op) {
+        case ZXT_CREATE:
+            if ((fd = zxg_creat(name, 0775)) != -1) {
+                zxg_close(fd);
+                return;
+            }
+            break;
+        case ZXT_REMOVE:
+            if (zxt_fds[id] != -1) {
+                zxg_close(zxt_fds[id]);
+                zxt_fds[id] = -1;
+            }
+            if (zxg_remove(name) == 0) {
+                return;
+            }
+            break;
+        case ZXT_OPEN:
+            if (zxt_fds[id] != -1 || (zxt_fds[id] = zxg_open(name, O_RDWR)) != -1) {
+                return;
+            }
+            break;
+        case ZXT_CLOSE:
+            if (zxt_fds[id] != -1) {
+                zxg_close(zxt_fds[id]);
+                zxt_fds[id] = -1;
+            }
+            return;
+        case ZXT_WRITE:
+            zxr_pattern(buf, len, zxr_next());
+            if (zxg_pwrite(zxt_fds[id], buf, len, off) != -1) {
+                return;
+            }
+            break;
+        case ZXT_READ:
+            if (zxg_pread(zxt_fds[id], buf, len, off) != -1) {
+                return;
+            }
+            break;
+        case ZXT_TRUNCATE:
+            if (zxg_truncate(name, off) == 0) {
+                return;
+            }
+            break;
+        case ZXT_FSYNC:
+            if (zxg_fsync(zxt_fds[id]) == 0) {
+                return;
+            }
+            break;
+        default:
+            errno = EINVAL;
+    }
+    fprintf(stderr, "Error: zxgen: replay %s op %u, %s\n", name, op, strerror(errno));
+}
+
+static void *
+zxt_main(void *arg)
+{
+    struct zxt_replay *t = (struct zxt_replay *) arg;
+    unsigned long long when;
+    struct timespec ts;
+    size_t i, buflen = 1 << 16;
+    char *buf;
+
+    if ((buf = (char *) malloc(buflen)) == NULL) {
+        fprintf(stderr, "Error: zxgen: %s\n", strerror(errno));
+        __atomic_sub_fetch(&zxt_running, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    for (i = 0; i < t->n && !stop; i++) {
+        if (zxt_paced) {
+            when = zxt_t0 + le64toh(t->rec[i]->r_time);
+            while (zxh_now() < when && !stop) {
+                ts.tv_sec = 0;
+                ts.tv_nsec = (when - zxh_now() > 1000000) ? 1000000 : when - zxh_now();
+                nanosleep(&ts, NULL);
+            }
+        }
+        zxt_play(t->rec[i], buf, buflen);
+    }
+    free(buf);
+    __atomic_sub_fetch(&zxt_running, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/*
+ * Load trace at path and split it between nthreads replay threads,
+ * which will go as fast as possible or at recorded pace
+ */
+int
+zxt_load(const char *path, int nthreads, int paced)
+{
+    struct zxt_header h;
+    struct stat st;
+    size_t n, i, *fill;
+    unsigned maxid = 0;
+    int fd, k;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        return -1;
+    }
+    if (read(fd, &h, sizeof(h)) != sizeof(h) || le32toh(h.h_magic) != ZXT_MAGIC ||
+        le32toh(h.h_version) != ZXT_VERSION) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    n = (st.st_size - sizeof(h)) / sizeof(struct zxt_rec);
+    if ((zxt_recs = (struct zxt_rec *) malloc(n * sizeof(struct zxt_rec) + 1)) == NULL ||
+        read(fd, zxt_recs, n * sizeof(struct zxt_rec)) != (ssize_t) (n * sizeof(struct zxt_rec))) {
+        close(fd);
+        errno = EIO;
+        return -1;
+    }
+    close(fd);
+
+    /*
+     * Split records by file between threads and order each share
+     */
+    zxt_threads = (struct zxt_replay *) calloc(nthreads, sizeof(struct zxt_replay));
+    fill = (size_t *) calloc(nthreads, sizeof(size_t));
+    if (zxt_threads == NULL || fill == NULL) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (le32toh(zxt_recs[i].r_id) > maxid) {
+            maxid = le32toh(zxt_recs[i].r_id);
+        }
+        zxt_threads[le32toh(zxt_recs[i].r_id) % nthreads].n++;
+    }
+    for (k = 0; k < nthreads; k++) {
+        zxt_threads[k].rec = (struct zxt_rec **) malloc(zxt_threads[k].n * sizeof(struct zxt_rec *) + 1);
+        if (zxt_threads[k].rec == NULL) {
+            return -1;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        k = le32toh(zxt_recs[i].r_id) % nthreads;
+        zxt_threads[k].rec[fill[k]++] = &zxt_recs[i];
+    }
+    free(fill);
+    for (k = 0; k < nthreads; k++) {
+        qsort(zxt_threads[k].rec, zxt_threads[k].n, sizeof(struct zxt_rec *), zxt_cmp);
+    }
+    if ((zxt_fds = (int *) malloc(((size_t) maxid + 1) * sizeof(int))) == NULL) {
+        return -1;
+    }
+    memset(zxt_fds, 0xff, ((size_t) maxid + 1) * sizeof(int));
+    zxt_paced = paced;
+    zxt_nthreads = nthreads;
+
+    return 0;
+}
+
+/*
+ * Start replay of loaded trace
+ */
+int
+zxt_start(void)
+{
+    int k;
+
+    zxt_running = zxt_nthreads;
+    zxt_t0 = zxh_now();
+    for (k = 0; k < zxt_nthreads; k++) {
+        if (pthread_create(&zxt_threads[k].tid, NULL, zxt_main, &zxt_threads[k]) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * True once every replay thread is done
+ */
+int
+zxt_done(void)
+{
+    return __atomic_load_n(&zxt_running, __ATOMIC_ACQUIRE) == 0;
+}
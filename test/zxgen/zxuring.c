@@ -0,0 +1,356 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  test/zxgen/zxuring.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  io_uring engine for zxgen fileio (-E uring).
+ *
+ *  Each fileio thread owns one ring and keeps up to depth I/Os in
+ *  flight over as many files as it takes to fill it. Block writes of
+ *  a file go out together, a verify read is linked behind its write,
+ *  and once all writes of a file are done it is fsynced, closed and
+ *  handed back to the queue. Submissions are made batch SQEs at a
+ *  time. The ring is driven through the raw system calls, no library.
+ *
+ *  Works on real descriptors only, that is on a mount point (-m).
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "zxgen.h"
+
+struct zxu {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned tail;                      /* local sq tail, not yet published */
+    unsigned pending;                   /* sqes queued since last submit */
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqe_len;
+};
+
+/*
+ * One file being worked on
+ */
+struct zxu_file {
+    struct zxf *zf;
+    int fd;
+    int next;                           /* next block to consider */
+    int inflight;                       /* I/Os not yet completed */
+    int synced;                         /* fsync issued */
+};
+
+/*
+ * One I/O in flight, user_data of its sqe is slot index
+ */
+struct zxu_slot {
+    struct zxu_file *file;
+    int op;                             /* ZXH_* */
+    int blk;
+    unsigned long long t;
+    char *buf;
+    unsigned long long seed;            /* pattern written, or to verify */
+};
+
+static int
+zxu_init(struct zxu *u, unsigned depth)
+{
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(struct zxu));
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = (int) syscall(__NR_io_uring_setup, depth, &p)) == -1) {
+        return -1;
+    }
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->sq_len = u->cq_len = (u->sq_len > u->cq_len) ? u->sq_len : u->cq_len;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         u->fd, IORING_OFF_CQ_RING);
+    }
+    u->sqes = (struct io_uring_sqe *) mmap(NULL, u->sqe_len, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->cq_ptr == MAP_FAILED || u->sqes == MAP_FAILED) {
+        munmap(u->sq_ptr, u->sq_len);
+        close(u->fd);
+        return -1;
+    }
+
+    u->sq_head = (unsigned *) ((char *) u->sq_ptr + p.sq_off.head);
+    u->sq_tail = (unsigned *) ((char *) u->sq_ptr + p.sq_off.tail);
+    u->sq_mask = (unsigned *) ((char *) u->sq_ptr + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) ((char *) u->sq_ptr + p.sq_off.array);
+    u->cq_head = (unsigned *) ((char *) u->cq_ptr + p.cq_off.head);
+    u->cq_tail = (unsigned *) ((char *) u->cq_ptr + p.cq_off.tail);
+    u->cq_mask = (unsigned *) ((char *) u->cq_ptr + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ptr + p.cq_off.cqes);
+    u->tail = *u->sq_tail;
+
+    return 0;
+}
+
+/*
+ * Next free sqe, caller keeps in flight count within ring size so
+ * there always is one
+ */
+static struct io_uring_sqe *
+zxu_sqe(struct zxu *u, int op, int fd, void *buf, unsigned len, off_t off, unsigned idx)
+{
+    unsigned i = u->tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[i];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = idx;
+    u->sq_array[i] = i;
+    u->tail++;
+    u->pending++;
+
+    return sqe;
+}
+
+/*
+ * Publish queued sqes and wait for at least wait completions
+ */
+static int
+zxu_submit(struct zxu *u, unsigned wait)
+{
+    int ret;
+
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    do {
+        ret = (int) syscall(__NR_io_uring_enter, u->fd, u->pending, wait,
+                            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    if (ret >= 0) {
+        u->pending -= ((unsigned) ret < u->pending) ? (unsigned) ret : u->pending;
+    }
+
+    return ret;
+}
+
+/*
+ * Finish with file: close, maybe truncate and give it back
+ */
+static void
+zxu_done(struct zxu_file *uf)
+{
+    struct zxf *zf = uf->zf;
+    unsigned long long t;
+    int len;
+
+    zxt_record(ZXT_CLOSE, zf->id, 0, 0, zxh_now());
+    close(uf->fd);
+    if (zxr_below(10) < 2) {
+        len = zxr_below(10);
+        t = zxh_now();
+        if (zxg_truncate(zf->path, len) == -1) {
+            fprintf(stderr, "Error: zxgen: %s, %s\n", zf->path, strerror(errno));
+        } else {
+            zxt_record(ZXT_TRUNCATE, zf->id, len, 0, t);
+            zxlog(ZXLOG_INFO, "Truncated %s\n", zf->path);
+        }
+    }
+    zxq_push(&q, zf);
+    uf->zf = NULL;
+}
+
+/*
+ * Take a free slot for op on block blk of uf, caller checks there is one
+ */
+static struct zxu_slot *
+zxu_slot(struct zxu_slot *slots, unsigned *used, struct zxu_file *uf, int op, int blk)
+{
+    struct zxu_slot *s;
+
+    for (s = slots; s->file != NULL; s++)
+        ;
+    s->file = uf;
+    s->op = op;
+    s->blk = blk;
+    s->t = zxh_now();
+    uf->inflight++;
+    (*used)++;
+
+    return s;
+}
+
+/*
+ * Account for one completion, a read is checked against the pattern
+ * its write used
+ */
+static void
+zxu_complete(struct zxu_slot *s, struct io_uring_cqe *cqe, struct fioarg *f, unsigned *used)
+{
+    struct zxu_file *uf = s->file;
+    char *path = uf->zf->path;
+    int op;
+
+    zxh_record(s->op, zxh_now() - s->t);
+    uf->inflight--;
+    if (cqe->res >= 0) {
+        op = (s->op == ZXH_PWRITE) ? ZXT_WRITE : (s->op == ZXH_PREAD) ? ZXT_READ : ZXT_FSYNC;
+        zxt_record(op, uf->zf->id, (off_t) s->blk * f->blksize,
+                   (s->op == ZXH_FSYNC) ? 0 : f->blksize, s->t);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED) {
+            fprintf(stderr, "Error: zxgen: %s, %s\n", path, strerror(-cqe->res));
+        }
+    } else if (s->op == ZXH_PWRITE) {
+        zxlog(ZXLOG_BLOCK, "Wrote block %d of %s\n", s->blk, path);
+    } else if (s->op == ZXH_PREAD) {
+        zxlog(ZXLOG_BLOCK, "Read block %d of %s\n", s->blk, path);
+        if (cqe->res != f->blksize || zxr_verify(s->buf, f->blksize, s->seed) != 0) {
+            fprintf(stderr, "Error: zxgen: %s, block %d does not verify\n", path, s->blk);
+        } else {
+            zxlog(ZXLOG_BLOCK, "Verified block %d of %s\n", s->blk, path);
+        }
+    }
+
+    s->file = NULL;
+    (*used)--;
+}
+
+void *
+fileio_uring(void *arg)
+{
+    struct fioarg *f = (struct fioarg *) arg;
+    struct zxu u;
+    struct zxu_file *files, *uf;
+    struct zxu_slot *slots, *w, *r;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned head, used = 0, need, i;
+    int verify = (f->iopolicy == IOP_DO_VERIFY);
+    unsigned long long t;
+    int wait = 0;
+    struct zxf *zf;
+
+    need = verify ? 2 : 1;
+    files = (struct zxu_file *) calloc(f->depth, sizeof(struct zxu_file));
+    slots = (struct zxu_slot *) calloc(f->depth, sizeof(struct zxu_slot));
+    if (files == NULL || slots == NULL || zxu_init(&u, f->depth) == -1) {
+        fprintf(stderr, "Error: zxgen: io_uring, %s\n", strerror(errno));
+        pthread_exit(NULL);
+    }
+    for (i = 0; i < f->depth; i++) {
+        if ((slots[i].buf = (char *) malloc(f->blksize)) == NULL) {
+            fprintf(stderr, "Error: zxgen: %s\n", strerror(errno));
+            pthread_exit(NULL);
+        }
+    }
+
+    for (;;) {
+        /*
+         * Queue I/O while there are free slots, opening more files
+         * when the open ones have nothing left to write
+         */
+        for (i = 0; i < f->depth && used + need <= f->depth; i++) {
+            uf = &files[i];
+            if (uf->zf == NULL) {
+                if ((zf = zxq_pop(&q)) == NULL) {
+                    break;
+                }
+                t = zxh_now();
+                if ((uf->fd = open(zf->path, O_RDWR)) == -1) {
+                    fprintf(stderr, "Error: zxgen: %s, %s\n", zf->path, strerror(errno));
+                    __atomic_sub_fetch(&count, 1, __ATOMIC_RELAXED);
+                    free(zf);
+                    continue;
+                }
+                zxt_record(ZXT_OPEN, zf->id, 0, 0, t);
+                uf->zf = zf;
+                uf->next = 0;
+                uf->inflight = 0;
+                uf->synced = 0;
+            }
+
+            for (; uf->next < f->maxblks && used + need <= f->depth; uf->next++) {
+                if ((zxr_below(10) + 1) % (zxr_below(10) + 1) == 0) {
+                    continue;
+                }
+                w = zxu_slot(slots, &used, uf, ZXH_PWRITE, uf->next);
+                w->seed = zxr_next();
+                zxr_pattern(w->buf, f->blksize, w->seed);
+                sqe = zxu_sqe(&u, IORING_OP_WRITE, uf->fd, w->buf, f->blksize,
+                              (off_t) uf->next * f->blksize, w - slots);
+                if (verify) {
+                    sqe->flags |= IOSQE_IO_LINK;
+                    r = zxu_slot(slots, &used, uf, ZXH_PREAD, uf->next);
+                    r->seed = w->seed;
+                    zxu_sqe(&u, IORING_OP_READ, uf->fd, r->buf, f->blksize,
+                            (off_t) uf->next * f->blksize, r - slots);
+                }
+                if (u.pending >= f->batch) {
+                    zxu_submit(&u, 0);
+                }
+            }
+
+            if (uf->next >= f->maxblks && uf->inflight == 0 && !uf->synced &&
+                used < f->depth) {
+                w = zxu_slot(slots, &used, uf, ZXH_FSYNC, 0);
+                zxu_sqe(&u, IORING_OP_FSYNC, uf->fd, NULL, 0, 0, w - slots);
+                uf->synced = 1;
+            }
+        }
+
+        if (used == 0) {
+            idle(&wait);
+            continue;
+        }
+        wait = 0;
+
+        /*
+         * Submit the rest and reap whatever completed, at least one
+         */
+        zxu_submit(&u, 1);
+        head = *u.cq_head;
+        while (head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &u.cqes[head & *u.cq_mask];
+            w = &slots[cqe->user_data];
+            uf = w->file;
+            zxu_complete(w, cqe, f, &used);
+            if (uf->synced && uf->inflight == 0) {
+                zxu_done(uf);
+            }
+            head++;
+        }
+        __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    pthread_exit(NULL);
+}
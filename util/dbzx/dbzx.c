@@ -21,141 +21,611 @@
 #include <fcntl.h>
 #include <time.h>
 #include <endian.h>
-#include "../../fs/zxfs.h"
+#include <getopt.h>
+#include <sys/mman.h>
+#include "../../lib/libzx.h"
 
 #define TRUE    1
 
+/*
+ * Batch dump (--dump [--json])
+ *
+ * Whole image is walked once in ascending device order: super block,
+ * inode table, then every block of every directory inode sorted by
+ * block number. Nothing is ever read twice or out of order, so the
+ * dump is one sequential read of the image.
+ */
+struct dblk {
+    __u32 bno;
+    __u32 ino;
+};
+
+struct edge {
+    __u32 parent;
+    __u32 child;
+};
+
+static int json;
+
+static int
+dblk_cmp(const void *a, const void *b)
+{
+    const struct dblk *x = (const struct dblk *) a;
+    const struct dblk *y = (const struct dblk *) b;
+
+    if (x->bno != y->bno) {
+        return (x->bno < y->bno) ? -1 : 1;
+    }
+    return (x->ino < y->ino) ? -1 : (x->ino > y->ino);
+}
+
+static void
+put_name(const char *name)
+{
+    int i;
+    unsigned char c;
+
+    if (!json) {
+        printf("%.*s", ZX_MAX_NAME, name);
+        return;
+    }
+    putchar('"');
+    for (i = 0; i < ZX_MAX_NAME && name[i] != '\0'; i++) {
+        c = (unsigned char) name[i];
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20 || c > 0x7e) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+/*
+ * Checksums, a free inode is all zero and has none
+ */
+static int
+super_ok(zx_super_t *sb)
+{
+    return le32toh(sb->s_checksum) == zx_super_csum(sb);
+}
+
+static int
+inode_ok(zx_inode_t *in, __u32 ino)
+{
+    if (in->i_mode == 0 && in->i_checksum == 0) {
+        return -1;
+    }
+    return le32toh(in->i_checksum) == zx_inode_csum(in, ino);
+}
+
+/*
+ * Journal super block, NULL if there is no journal
+ */
+static zx_jsuper_t *
+jsuper(zx_map_t *map)
+{
+    if (map->geo.g_jnl_blocks == 0) {
+        return NULL;
+    }
+    return (zx_jsuper_t *) zx_map_block(map, map->geo.g_jnl_start);
+}
+
+static int
+jsuper_ok(zx_jsuper_t *js)
+{
+    return le32toh(js->j_magic) == ZX_JNL_MAGIC &&
+           le32toh(js->j_checksum) == zx_jsuper_csum(js);
+}
+
+static int
+group_ok(zx_map_t *map, __u32 ag)
+{
+    return le32toh(map->gdt[ag].gd_checksum) == zx_group_csum(&map->gdt[ag], ag);
+}
+
+static const char *
+csum_str(int ok)
+{
+    if (ok < 0) {
+        return json ? "null" : "none";
+    }
+    if (json) {
+        return ok ? "true" : "false";
+    }
+    return ok ? "ok" : "bad";
+}
+
+static void
+dump_super(zx_map_t *map)
+{
+    zx_super_t *sb = map->sb;
+    zx_geom_t *g = &map->geo;
+    zx_jsuper_t *js = jsuper(map);
+    __u32 i;
+
+    if (json) {
+        printf("\"super\":{\"magic\":%u,\"state\":%u,\"free_inodes\":%u,"
+               "\"free_blocks\":%u,\"block_size\":%u,\"inodes\":%u,\"blocks\":%u,"
+               "\"imap_start\":%u,\"imap_blocks\":%u,\"bmap_start\":%u,"
+               "\"bmap_blocks\":%u,\"inode_start\":%u,\"inode_blocks\":%u,\"itable_unused\":%u,"
+               "\"jnl_start\":%u,\"jnl_blocks\":%u,\"data_start\":%u,\"csum\":%s,",
+               le32toh(sb->s_magic), le32toh(sb->s_state),
+               le32toh(sb->s_free_inodes), le32toh(sb->s_free_blocks),
+               g->g_bsize, g->g_inodes, g->g_blocks, g->g_imap_start, g->g_imap_blocks,
+               g->g_bmap_start, g->g_bmap_blocks, g->g_inode_start,
+               g->g_inode_blocks, g->g_itable_unused, g->g_jnl_start, g->g_jnl_blocks,
+               g->g_data_start, csum_str(super_ok(sb)));
+        if (js != NULL) {
+            printf("\"journal\":{\"head\":%u,\"seq\":%u,\"csum\":%s},",
+                   le32toh(js->j_head), le32toh(js->j_seq), csum_str(jsuper_ok(js)));
+        }
+        if (map->gdt != NULL) {
+            printf("\"ag_inodes\":%u,\"ag_blocks\":%u,\"groups\":[",
+                   g->g_ag_inodes, g->g_ag_blocks);
+            for (i = 0; i < g->g_groups; i++) {
+                printf("%s{\"free_inodes\":%u,\"free_blocks\":%u,\"itable_unused\":%u,"
+                       "\"csum\":%s}", (i == 0) ? "" : ",",
+                       le32toh(map->gdt[i].gd_free_inodes), le32toh(map->gdt[i].gd_free_blocks),
+                       le32toh(map->gdt[i].gd_itable_unused), csum_str(group_ok(map, i)));
+            }
+            printf("],");
+        }
+        printf("\"inode_bitmap\":\"");
+    } else {
+        printf("super magic=%#x state=%#x free_inodes=%u free_blocks=%u csum=%s\n",
+               le32toh(sb->s_magic), le32toh(sb->s_state),
+               le32toh(sb->s_free_inodes), le32toh(sb->s_free_blocks),
+               csum_str(super_ok(sb)));
+        printf("super bsize=%u inodes=%u blocks=%u imap=%u+%u bmap=%u+%u itable=%u+%u "
+               "itable_unused=%u journal=%u+%u data=%u\n",
+               g->g_bsize, g->g_inodes, g->g_blocks, g->g_imap_start, g->g_imap_blocks,
+               g->g_bmap_start, g->g_bmap_blocks, g->g_inode_start,
+               g->g_inode_blocks, g->g_itable_unused, g->g_jnl_start, g->g_jnl_blocks,
+               g->g_data_start);
+        if (js != NULL) {
+            printf("super journal head=%u seq=%u csum=%s\n",
+                   le32toh(js->j_head), le32toh(js->j_seq), csum_str(jsuper_ok(js)));
+        }
+        for (i = 0; map->gdt != NULL && i < g->g_groups; i++) {
+            printf("super group %u free_inodes=%u free_blocks=%u itable_unused=%u csum=%s\n", i,
+                   le32toh(map->gdt[i].gd_free_inodes), le32toh(map->gdt[i].gd_free_blocks),
+                   le32toh(map->gdt[i].gd_itable_unused), csum_str(group_ok(map, i)));
+        }
+        printf("super inode_bitmap=");
+    }
+    for (i = 0; i < g->g_inodes; i++) {
+        putchar(zx_test_bit(map->imap, i) ? '1' : '0');
+    }
+    printf(json ? "\",\"block_bitmap\":\"" : "\nsuper block_bitmap=");
+    for (i = 0; i < g->g_blocks; i++) {
+        putchar(zx_test_bit(map->bmap, i) ? '1' : '0');
+    }
+    printf(json ? "\"}" : "\n");
+}
+
+/*
+ * Inline data of in, bytes that do not print are escaped
+ */
+static void
+dump_inline(zx_inode_t *in)
+{
+    __u32 i, n = le32toh(in->i_size);
+    int c;
+
+    for (i = 0; i < n && i < ZX_INLINE_MAX; i++) {
+        c = in->i_pad[i];
+        if (c < 0x20 || c > 0x7e || c == '"' || c == '\\') {
+            printf(json ? "\\u%04x" : "\\x%02x", c);
+        } else {
+            putchar(c);
+        }
+    }
+}
+
+static void
+dump_inode(zx_map_t *map, __u32 ino, zx_inode_t *in, int used)
+{
+    zx_extent_t *ex;
+    __u32 i, n = le16toh(in->i_nextents);
+
+    if (json) {
+        printf("%s{\"ino\":%u,\"used\":%s,\"mode\":%u,\"links\":%u,"
+               "\"atime\":%u,\"mtime\":%u,\"ctime\":%u,\"uid\":%u,"
+               "\"gid\":%u,\"size\":%u,\"blocks\":%u,\"flags\":%u,\"dxroot\":%u,"
+               "\"xblock\":%u,\"csum\":%s,",
+               ino ? "," : "", ino, used ? "true" : "false",
+               le16toh(in->i_mode), le16toh(in->i_links),
+               le32toh(in->i_atime), le32toh(in->i_mtime),
+               le32toh(in->i_ctime), le16toh(in->i_uid), le16toh(in->i_gid),
+               le32toh(in->i_size), le32toh(in->i_blocks), le16toh(in->i_flags),
+               le32toh(in->i_dxroot), le32toh(in->i_xblock), csum_str(inode_ok(in, ino)));
+    } else {
+        printf("inode %u used=%d mode=%#o links=%u atime=%u mtime=%u ctime=%u "
+               "uid=%u gid=%u size=%u blocks=%u flags=%#x dxroot=%u xblock=%u csum=%s ",
+               ino, used, le16toh(in->i_mode), le16toh(in->i_links),
+               le32toh(in->i_atime), le32toh(in->i_mtime),
+               le32toh(in->i_ctime), le16toh(in->i_uid), le16toh(in->i_gid),
+               le32toh(in->i_size), le32toh(in->i_blocks), le16toh(in->i_flags),
+               le32toh(in->i_dxroot), le32toh(in->i_xblock), csum_str(inode_ok(in, ino)));
+    }
+    if (le16toh(in->i_flags) & ZX_INODE_INLINE) {
+        printf(json ? "\"inline\":\"" : "inline=\"");
+        dump_inline(in);
+        printf(json ? "\"," : "\" ");
+    }
+    printf(json ? "\"extents\":[" : "extents=");
+    for (i = 0; i < n && (ex = zx_map_extent(map, in, i)) != NULL; i++) {
+        printf(json ? "%s[%u,%u]" : "%s%u+%u", i ? "," : "",
+               le32toh(ex->e_start), le32toh(ex->e_len));
+    }
+    printf(json ? "]}" : "\n");
+}
+
+/*
+ * Store blocks of directory ino in dblk (when not NULL) and return
+ * their count. Extents are trusted only as far as the data region
+ * goes, so a corrupt inode cannot blow up the dump.
+ */
+static int
+dir_blocks(zx_map_t *map, __u32 ino, zx_inode_t *in, struct dblk *dblk)
+{
+    zx_extent_t *ex;
+    __u32 i, b, start, len;
+    int n = 0;
+
+    for (i = 0; (ex = zx_map_extent(map, in, i)) != NULL; i++) {
+        start = le32toh(ex->e_start);
+        len = le32toh(ex->e_len);
+        for (b = 0; b < len && n < (int) map->geo.g_blocks; b++, n++) {
+            if (dblk != NULL) {
+                dblk[n].bno = start + b;
+                dblk[n].ino = ino;
+            }
+        }
+    }
+    return n;
+}
+
+static int
+edge_cmp(const void *a, const void *b)
+{
+    const struct edge *x = (const struct edge *) a;
+    const struct edge *y = (const struct edge *) b;
+
+    return (x->parent < y->parent) ? -1 : (x->parent > y->parent);
+}
+
+static int
+dump(zx_map_t *map, const char *dev)
+{
+    zx_super_t *sb = map->sb;
+    zx_inode_t *in;
+    zx_dirent_t *de;
+    struct dblk *dblk;
+    struct edge *edge;
+    __u32 *queue;
+    char *seen;
+    __u32 ninodes = map->geo.g_inodes, bs = map->geo.g_bsize;
+    int ndblk = 0, nedge = 0, first = 1, ok;
+    int i, j, n, head, tail, lo, hi, mid;
+    __u32 ino;
+
+    if (le32toh(sb->s_magic) != ZX_MAGIC_NUMBER || ninodes == 0) {
+        fprintf(stderr, "dbzx: %s: bad super block (magic %#x)\n", dev, le32toh(sb->s_magic));
+        return -1;
+    }
+
+    /*
+     * Count directory blocks first so everything can be sized up
+     * front, this only looks at inode table.
+     */
+    for (ino = 0; ino < ninodes; ino++) {
+        in = zx_map_inode(map, ino);
+        if (zx_test_bit(map->imap, ino) && S_ISDIR(le16toh(in->i_mode))) {
+            ndblk += dir_blocks(map, ino, in, NULL);
+        }
+    }
+    dblk = (struct dblk *) malloc((ndblk + 1) * sizeof(struct dblk));
+    edge = (struct edge *) malloc((ndblk * ZX_DIR_PER_BLOCK(bs) + 1) * sizeof(struct edge));
+    queue = (__u32 *) malloc(ninodes * sizeof(__u32));
+    seen = (char *) calloc(ninodes, 1);
+    if (dblk == NULL || edge == NULL || queue == NULL || seen == NULL) {
+        fprintf(stderr, "dbzx: %s\n", strerror(ENOMEM));
+        return -1;
+    }
+    madvise(map->base, map->len, MADV_SEQUENTIAL);
+
+    if (json) {
+        printf("{\"device\":");
+        put_name(dev);
+        printf(",");
+    } else {
+        printf("device %s\n", dev);
+    }
+    dump_super(map);
+
+    /*
+     * Inode table, remember blocks of directories on the way
+     */
+    ndblk = 0;
+    printf(json ? ",\"inodes\":[" : "");
+    for (ino = 0; ino < ninodes; ino++) {
+        in = zx_map_inode(map, ino);
+        dump_inode(map, ino, in, zx_test_bit(map->imap, ino));
+        if (zx_test_bit(map->imap, ino) && S_ISDIR(le16toh(in->i_mode))) {
+            ndblk += dir_blocks(map, ino, in, dblk + ndblk);
+        }
+    }
+    printf(json ? "]" : "");
+
+    /*
+     * Directory blocks in device order
+     */
+    qsort(dblk, ndblk, sizeof(struct dblk), dblk_cmp);
+    printf(json ? ",\"dirblocks\":[" : "");
+    for (i = 0; i < ndblk; i++) {
+        if ((de = (zx_dirent_t *) zx_map_block(map, dblk[i].bno)) == NULL) {
+            fprintf(stderr, "dbzx: dir %u block %u: %s\n",
+                    dblk[i].ino, dblk[i].bno, strerror(errno));
+            continue;
+        }
+        ok = le32toh(de[ZX_DIR_TAIL(bs)].d_inode) == zx_dir_csum(de, dblk[i].ino, bs);
+        if (json) {
+            printf("%s{\"dir\":%u,\"bno\":%u,\"csum\":%s,\"entries\":[",
+                   first ? "" : ",", dblk[i].ino, dblk[i].bno, csum_str(ok));
+        } else {
+            printf("dirblock dir=%u bno=%u csum=%s\n", dblk[i].ino, dblk[i].bno, csum_str(ok));
+        }
+        first = 0;
+        n = 0;
+        for (j = 0; j < ZX_DIR_TAIL(bs); j++) {
+            if (de[j].d_name[0] == '\0') {
+                continue;
+            }
+            if (json) {
+                printf("%s{\"slot\":%d,\"ino\":%u,\"name\":", n++ ? "," : "",
+                       j, le32toh(de[j].d_inode));
+                put_name(de[j].d_name);
+                printf("}");
+            } else {
+                printf("dirent dir=%u bno=%u slot=%d ino=%u name=",
+                       dblk[i].ino, dblk[i].bno, j, le32toh(de[j].d_inode));
+                put_name(de[j].d_name);
+                printf("\n");
+            }
+            if (strcmp(de[j].d_name, ".") != 0 && strcmp(de[j].d_name, "..") != 0) {
+                edge[nedge].parent = dblk[i].ino;
+                edge[nedge].child = le32toh(de[j].d_inode);
+                nedge++;
+            }
+        }
+        printf(json ? "]}" : "");
+    }
+    printf(json ? "]" : "");
+
+    /*
+     * Reachability from root, breadth first over the edges gathered
+     * above sorted by parent
+     */
+    qsort(edge, nedge, sizeof(struct edge), edge_cmp);
+    head = tail = 0;
+    queue[tail++] = ZX_ROOT_INODE;
+    seen[ZX_ROOT_INODE] = 1;
+    while (head < tail) {
+        ino = queue[head++];
+        for (lo = 0, hi = nedge; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (edge[mid].parent < ino) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (i = lo; i < nedge && edge[i].parent == ino; i++) {
+            if (edge[i].child < ninodes && !seen[edge[i].child]) {
+                seen[edge[i].child] = 1;
+                queue[tail++] = edge[i].child;
+            }
+        }
+    }
+
+    printf(json ? ",\"reachable\":[" : "reachable");
+    for (ino = 0, n = 0; ino < ninodes; ino++) {
+        if (seen[ino]) {
+            printf("%s%u", json ? (n++ ? "," : "") : " ", ino);
+        }
+    }
+    printf(json ? "],\"unreachable\":[" : "\nunreachable");
+    for (ino = 0, n = 0; ino < ninodes; ino++) {
+        if (zx_test_bit(map->imap, ino) && !seen[ino]) {
+            printf("%s%u", json ? (n++ ? "," : "") : " ", ino);
+        }
+    }
+    printf(json ? "]}\n" : "\n");
+
+    free(dblk);
+    free(edge);
+    free(queue);
+    free(seen);
+
+    return 0;
+}
+
+static void
+usage(void)
+{
+    printf("Usage: dbzx [--dump [--json]] <block device | image>\n");
+    exit(EXIT_FAILURE);
+}
+
 int
 main(int argc, char *argv[])
 {
     char cmd;
     struct stat buf;
-    int devfd;
-    zx_super_t sb;
-    zx_inode_t in;
-    zx_dirent_t dir;
-    char ibitmap[65];
-    char bbitmap[577];
-    int i, j, p;
+    zx_map_t map;
+    zx_super_t *sb;
+    zx_jsuper_t *js;
+    zx_inode_t *in;
+    zx_extent_t *ex;
+    zx_dirent_t *dir;
+    __u32 n;
+    int i, j;
     time_t t;
     struct tm *tm;
-    char blk[ZX_BLOCK_SIZE];
-    char tbuf[1];
+    char *blk;
+    char *devname;
+    int opt, batch = 0;
+    static struct option lopts[] = {
+        {"dump", no_argument, NULL, 'D'},
+        {"json", no_argument, NULL, 'j'},
+        {NULL, 0, NULL, 0}
+    };
 
     /*
      * Check if correct arguments are passed
      */
-    if (argc != 2) {
-        printf("Usage: dbzx <block device>\n");
-        exit(EXIT_FAILURE);
+    while ((opt = getopt_long(argc, argv, "", lopts, NULL)) != -1) {
+        switch (opt) {
+            case 'D':
+                batch = 1;
+                break;
+            case 'j':
+                json = 1;
+                break;
+            default:
+                usage();
+        }
     }
+    if (optind != argc - 1 || (json && !batch)) {
+        usage();
+    }
+    devname = argv[optind];
 
     /*
      * Confirm that we can access given device file
-     * and is a block device.
+     * and is a block device or an image file.
      */
-    if (stat(argv[1], &buf) < 0) {
+    if (stat(devname, &buf) < 0) {
         fprintf(stderr, "mkzx: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    if (!S_ISBLK(buf.st_mode)) {
-        fprintf(stderr, "mkzx: %s is not a block device\n", argv[1]);
+    if (!S_ISBLK(buf.st_mode) && !S_ISREG(buf.st_mode)) {
+        fprintf(stderr, "mkzx: %s is not a block device\n", devname);
         exit(EXIT_FAILURE);
     }
-    printf("[OK]\tgiven device is block device\n");
 
-    if ((devfd = open(argv[1], O_RDONLY)) < 0) {
+    /*
+     * Map super block, inode table and data region once, every
+     * command below decodes structures in place.
+     */
+    if (zx_map_open(&map, devname) < 0) {
         fprintf(stderr, "mkzx: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
-    printf("[OK]\topened devie\n");
+    sb = map.sb;
 
-    if (lseek(devfd, ZX_SEEK_BLOCKS * ZX_BLOCK_SIZE, SEEK_SET) < 0) {
-        fprintf(stderr, "mkzx: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+    if (batch) {
+        i = dump(&map, devname);
+        zx_map_close(&map);
+        exit(i == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
     }
-    printf("[OK]\tfound desirable space\n");
+    printf("[OK]\tgiven device is block device or image\n");
+    printf("[OK]\tmapped device\n");
 
     printf("[OK]\tall set to launch dbzx (press h for help)\n");
 
-    while (printf("dbzx:>") && scanf("%s", &cmd)) {
+    while (printf("dbzx:>") && scanf(" %c", &cmd) == 1) {
         switch (cmd) {
             case 'q' :
+                zx_map_close(&map);
                 exit(EXIT_SUCCESS);
                 break;
 
             case 's' :
-                if (lseek(devfd, ZX_SUPER_START * ZX_BLOCK_SIZE, SEEK_SET) < 0) {
-                    fprintf(stderr, ": %s\n", strerror(errno));
-                    break;
+                printf("\tmagic: %#x\n", le32toh(sb->s_magic));
+                printf("\tstate: %#x\n", le32toh(sb->s_state));
+                printf("\tfree inodes: %d\n", le32toh(sb->s_free_inodes));
+                printf("\tfree blocks: %d\n", le32toh(sb->s_free_blocks));
+                printf("\tchecksum: %#x (%s)\n", le32toh(sb->s_checksum), csum_str(super_ok(sb)));
+                printf("\tfree in bitmaps: %u inodes, %u blocks\n",
+                       map.geo.g_inodes - zx_bm_count(map.imap, map.geo.g_inodes),
+                       map.geo.g_blocks - zx_bm_count(map.bmap, map.geo.g_blocks));
+                printf("\tblock size: %u\n", map.geo.g_bsize);
+                printf("\tinodes: %u\n", map.geo.g_inodes);
+                printf("\tdata blocks: %u\n", map.geo.g_blocks);
+                printf("\tinode bitmap at: %u+%u\n", map.geo.g_imap_start, map.geo.g_imap_blocks);
+                printf("\tblock bitmap at: %u+%u\n", map.geo.g_bmap_start, map.geo.g_bmap_blocks);
+                printf("\tinode table at: %u+%u\n", map.geo.g_inode_start, map.geo.g_inode_blocks);
+                if (map.gdt == NULL) {
+                    printf("\tinode table unused: %u\n", map.geo.g_itable_unused);
+                } else {
+                    printf("\tgroup table at: %u+%u\n", map.geo.g_gdt_start, map.geo.g_gdt_blocks);
+                    printf("\tgroups: %u of %u inodes, %u data blocks\n", map.geo.g_groups,
+                           map.geo.g_ag_inodes, map.geo.g_ag_blocks);
+                    for (n = 0; n < map.geo.g_groups; n++) {
+                        printf("\tgroup %u: %u free inodes, %u free blocks, %u unused itable (%s)\n",
+                               n, le32toh(map.gdt[n].gd_free_inodes),
+                               le32toh(map.gdt[n].gd_free_blocks),
+                               le32toh(map.gdt[n].gd_itable_unused), csum_str(group_ok(&map, n)));
+                    }
                 }
-                memset(&sb, 0, ZX_SUPER_SIZE);
-                if (read(devfd, &sb, ZX_SUPER_SIZE) != ZX_SUPER_SIZE) {
-                    fprintf(stderr, ": %s\n", strerror(errno));
-                    break;
+                printf("\tjournal at: %u+%u\n", map.geo.g_jnl_start, map.geo.g_jnl_blocks);
+                if ((js = jsuper(&map)) != NULL) {
+                    printf("\tjournal head: %u seq: %u (%s)\n", le32toh(js->j_head),
+                           le32toh(js->j_seq), csum_str(jsuper_ok(js)));
                 }
-                printf("\tmagic: %#x\n", le32toh(sb.s_magic));
-                printf("\tstate: %#x\n", le32toh(sb.s_state));
-                printf("\tfree inodes: %d\n", le32toh(sb.s_free_inodes));
-                printf("\tfree blocks: %d\n", le32toh(sb.s_free_blocks));
-                memset(ibitmap, 0, sizeof(ibitmap));
-                for (i = 0; i < 64; i++) {
-                    if (le64toh(sb.s_inode_list) & ((long)1 << (long)i)) {
-                        ibitmap[i] = '1';
-                    } else {
-                        ibitmap[i] = '0';
-                    }
+                printf("\tdata start: %u\n", map.geo.g_data_start);
+                printf("\tinode bitmap: ");
+                for (n = 0; n < map.geo.g_inodes; n++) {
+                    putchar(zx_test_bit(map.imap, n) ? '1' : '0');
                 }
-                ibitmap[64] ='\0';
-                printf("\tinode bitmap: %s\n", ibitmap);
-
-                memset(bbitmap, 0, sizeof(bbitmap));
-                p = 0;
-                for (i = 0; i < 18; i++) {
-                    for (j = 0; j < 32; j++) {
-                        if (sb.s_block_list[i] & (1 << j)) {
-                            bbitmap[p++] = '1';
-                        } else {
-                            bbitmap[p++] = '0';
-                        }
-                    }
+                printf("\n\tblock bitmap: ");
+                for (n = 0; n < map.geo.g_blocks; n++) {
+                    putchar(zx_test_bit(map.bmap, n) ? '1' : '0');
                 }
-                bbitmap[576] ='\0';
-                printf("\tblock bitmap: %s\n", bbitmap);
+                printf("\n");
                 break;
 
             case 'i':
                 printf("\tino:");
                 scanf("%d", &i);
 
-                if (lseek(devfd, ((ZX_INODE_START * ZX_BLOCK_SIZE) + (i * ZX_INODE_SIZE)), SEEK_SET) < 0) {
+                if ((in = zx_map_inode(&map, i)) == NULL) {
                     fprintf(stderr, ": %s\n", strerror(errno));
                     break;
                 }
-                memset(&in, 0, ZX_INODE_SIZE);
-                if (read(devfd, &in, ZX_INODE_SIZE) != ZX_INODE_SIZE) {
-                    fprintf(stderr, ": %s\n", strerror(errno));
-                    break;
-                }
-                printf("\tmode: %#x\n", in.i_mode);
-                printf("\tlinks: %hu\n", in.i_links);
-                t = in.i_atime;
+                printf("\tmode: %#x\n", in->i_mode);
+                printf("\tlinks: %hu\n", in->i_links);
+                t = in->i_atime;
                 tm = localtime (&t);
                 printf("\tatime: %s", (char *) asctime(tm));
-                t = in.i_mtime;
+                t = in->i_mtime;
                 tm = localtime (&t);
                 printf("\tmtime: %s", (char *) asctime(tm));
-                t = in.i_ctime;
+                t = in->i_ctime;
                 tm = localtime (&t);
                 printf("\tctime: %s", (char *) asctime(tm));
-                printf("\tuid: %hu\n", in.i_uid);
-                printf("\tgid: %hu\n", in.i_gid);
-                printf("\tsize: %hu\n", in.i_size);
-                printf("\tblocks: %hu\n", in.i_blocks);
-                printf("\tblock addr:\n");
-                for (i = 0; i < le16toh(in.i_blocks); i++) {
-                    printf("\t\t%d:%d\n", i + 1, le32toh(in.i_block[i]));
+                printf("\tuid: %hu\n", in->i_uid);
+                printf("\tgid: %hu\n", in->i_gid);
+                printf("\tsize: %u\n", le32toh(in->i_size));
+                printf("\tblocks: %u\n", le32toh(in->i_blocks));
+                printf("\tflags: %#x\n", le16toh(in->i_flags));
+                if (le16toh(in->i_flags) & ZX_INODE_INLINE) {
+                    printf("\tinline: \"");
+                    dump_inline(in);
+                    printf("\"\n");
+                }
+                printf("\tdxroot: %u\n", le32toh(in->i_dxroot));
+                printf("\txblock: %u\n", le32toh(in->i_xblock));
+                printf("\tchecksum: %#x (%s)\n", le32toh(in->i_checksum), csum_str(inode_ok(in, i)));
+                printf("\textents (start+len):\n");
+                for (i = 0; (ex = zx_map_extent(&map, in, i)) != NULL; i++) {
+                    printf("\t\t%d:%u+%u\n", i + 1, le32toh(ex->e_start), le32toh(ex->e_len));
                 }
                 break;
 
@@ -163,19 +633,14 @@ main(int argc, char *argv[])
                 printf("\tbno:");
                 scanf("%d", &i);
 
-                if (lseek(devfd, (i * ZX_BLOCK_SIZE), SEEK_SET) < 0) {
+                if ((dir = (zx_dirent_t *) zx_map_block(&map, i)) == NULL) {
                     fprintf(stderr, ": %s\n", strerror(errno));
                     break;
                 }
-
-                for (j = 0; j < 16; j++) {
-                    memset(&dir, 0, ZX_DIR_SIZE);
-                    if (read(devfd, &dir, ZX_DIR_SIZE) != ZX_DIR_SIZE) {
-                        fprintf(stderr, ": %s\n", strerror(errno));
-                        break;
-                    }
-                    printf("\t%d:\t%u\t%s\n", j, dir.d_inode, dir.d_name);
+                for (j = 0; j < ZX_DIR_TAIL(map.geo.g_bsize); j++) {
+                    printf("\t%d:\t%u\t%.*s\n", j, le32toh(dir[j].d_inode), ZX_MAX_NAME, dir[j].d_name);
                 }
+                printf("\tchecksum: %#x\n", le32toh(dir[ZX_DIR_TAIL(map.geo.g_bsize)].d_inode));
                 break;
 
             case 'h':
@@ -192,17 +657,12 @@ main(int argc, char *argv[])
                 printf("\tbno:");
                 scanf("%d", &i);
 
-                if (lseek(devfd, (i * ZX_BLOCK_SIZE), SEEK_SET) < 0) {
-                    fprintf(stderr, ": %s\n", strerror(errno));
-                    break;
-                }
-                memset(&blk, 0, ZX_BLOCK_SIZE);
-                if (read(devfd, &blk, ZX_BLOCK_SIZE) != ZX_BLOCK_SIZE) {
+                if ((blk = (char *) zx_map_block(&map, i)) == NULL) {
                     fprintf(stderr, ": %s\n", strerror(errno));
                     break;
                 }
 
-                for (j = 1; j <= ZX_BLOCK_SIZE; j++) { 
+                for (j = 1; j <= (int) map.geo.g_bsize; j++) { 
                     printf("\t%#x", blk[j - 1]);
                     if (j % 9 == 0)
                         printf("\n");
@@ -212,5 +672,7 @@ main(int argc, char *argv[])
         }
     }
 
+    zx_map_close(&map);
+
     return 0;
 }
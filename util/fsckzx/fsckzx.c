@@ -0,0 +1,931 @@
+/*
+ *  #############################
+ *  # zxfs (zero x file system) #
+ *  #############################
+ *
+ *  util/fsckzx/fsckzx.c
+ *
+ *  Copyright (c) 2013 cg011235 <cg011235@gmail.com>
+ *
+ *  fsckzx - consistency checker for zxfs file system
+ *
+ *  Image is mapped once and looked at in device order, nothing is
+ *  read block by block:
+ *
+ *    pass 1  inode table, split in chunks between threads. Extents,
+ *            overflow extent block and directory index of every inode
+ *            in use are checked and their blocks set in a rebuilt
+ *            block bitmap, a block set twice is owned twice.
+ *    pass 2  directory blocks, again one directory per thread at a
+ *            time. Entries must name an inode in use, every entry is
+ *            kept as a parent -> child edge.
+ *    pass 3  reachability from root over the edges, link counts.
+ *    pass 4  rebuilt bitmaps and free counts against the ones on disk,
+ *            in super block and in each group descriptor.
+ *
+ *  Super block, group descriptor, inode and directory block checksums are checked on
+ *  the way. Committed transactions in the journal are replayed
+ *  first, with -n they are only counted and the check is of what is
+ *  at home.
+ *
+ *  With -y problems are repaired: bad and unreachable inodes are
+ *  cleared, dangling entries removed, link counts, bitmaps, free
+ *  counts and checksums rewritten. Blocks owned twice are only
+ *  reported.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "../../lib/libzx.h"
+
+#define FSCK_OK         0       /* exit codes as fsck(8) */
+#define FSCK_FIXED      1
+#define FSCK_UNFIXED    4
+#define FSCK_ERROR      8
+
+#define FSCK_CHUNK      1024    /* inodes a thread takes at a time */
+#define FSCK_THREADS    64
+
+/*
+ * Per inode state, bad inodes keep their reason in the upper bits
+ */
+#define IS_USED         0x01
+#define IS_DIR          0x02
+#define IS_SEEN         0x04    /* reachable from root */
+#define IS_CLEAR        0x08    /* cleared by repair */
+#define IS_CSUM         0x10    /* checksum does not match */
+#define IS_BAD_SHIFT    8
+
+enum {
+    BAD_NONE,
+    BAD_NEXTENTS,
+    BAD_XBLOCK,
+    BAD_EXTENT,
+    BAD_BLOCKS,
+    BAD_SIZE,
+    BAD_DXROOT,
+    BAD_INLINE
+};
+
+static const char *bad_str[] = {
+    "",
+    "too many extents",
+    "overflow extent block out of range",
+    "extent out of data region",
+    "i_blocks does not match extents",
+    "i_size beyond mapped blocks",
+    "bad directory index",
+    "bad inline data"
+};
+
+struct edge {
+    __u32 parent;
+    __u32 child;
+};
+
+/*
+ * Private state of a checker thread
+ */
+struct list {
+    struct edge *edge;
+    size_t nedge;
+    size_t maxedge;
+};
+
+struct worker {
+    pthread_t tid;
+    struct list edges;
+    struct list csum;           /* dir, bno of blocks failing checksum */
+    int err;
+};
+
+static zx_map_t map;
+static zx_dev_t wdev;           /* writable device, with -y only */
+static __u16 *state;            /* per inode IS_ flags */
+static __u8 *imap;              /* rebuilt inode bitmap */
+static __u8 *bmap;              /* rebuilt block bitmap */
+static __u8 *dupmap;            /* blocks owned more than once */
+static __u16 *links;            /* links found per inode */
+static __u32 next;              /* next inode chunk to hand out */
+static int nthreads;
+static int repair;
+static int verbose;
+static int errors;
+static int fixed;
+
+static void problem(int fixable, const char *fmt, ...);
+
+/*
+ * Journal goes before anything else is looked at
+ */
+static void
+journal(const char *dev)
+{
+    zx_dev_t d;
+    zx_super_t sb;
+    zx_geom_t geo;
+    int n;
+
+    if (zx_dev_open(&d, dev, repair ? O_RDWR : O_RDONLY) == -1) {
+        return;
+    }
+    if (zx_dev_pread(&d, &sb, ZX_SUPER_SIZE, ZX_SUPER_OFFSET) == 0) {
+        zx_geom_load(&geo, &sb);
+        if (le32toh(sb.s_magic) == ZX_MAGIC_NUMBER && zx_geom_check(&geo, d.size) == 0 &&
+            geo.g_jnl_blocks != 0) {
+            if ((n = zx_jrecover(&d, &geo, !repair)) == -1) {
+                problem(0, "journal: %s", strerror(errno));
+            } else if (n > 0) {
+                problem(1, "journal: %d committed transactions to replay", n);
+            }
+        }
+    }
+    zx_dev_close(&d);
+}
+
+static void
+set_bit(__u8 *bm, __u32 n)
+{
+    __atomic_fetch_or(&bm[n >> 3], (__u8) (1 << (n & 7)), __ATOMIC_RELAXED);
+}
+
+static int
+test_and_set_bit(__u8 *bm, __u32 n)
+{
+    __u8 m = (__u8) (1 << (n & 7));
+
+    return (__atomic_fetch_or(&bm[n >> 3], m, __ATOMIC_RELAXED) & m) != 0;
+}
+
+static void
+clear_bit(__u8 *bm, __u32 n)
+{
+    bm[n >> 3] &= (__u8) ~(1 << (n & 7));
+}
+
+/*
+ * Device block bno holds data block bno - g_data_start
+ */
+static int
+data_block(__u32 bno)
+{
+    return bno >= map.geo.g_data_start && bno - map.geo.g_data_start < map.geo.g_blocks;
+}
+
+static void
+own_block(__u32 bno)
+{
+    if (test_and_set_bit(bmap, bno - map.geo.g_data_start)) {
+        set_bit(dupmap, bno - map.geo.g_data_start);
+    }
+}
+
+static int
+next_chunk(__u32 *first, __u32 *last)
+{
+    *first = __atomic_fetch_add(&next, FSCK_CHUNK, __ATOMIC_RELAXED);
+    if (*first >= map.geo.g_inodes) {
+        return 0;
+    }
+    *last = (*first + FSCK_CHUNK < map.geo.g_inodes) ? *first + FSCK_CHUNK : map.geo.g_inodes;
+    return 1;
+}
+
+/*
+ * Returns BAD_NONE when block map of in is sane. Blocks are only
+ * owned once the whole inode checked out, a bad inode claims none.
+ */
+static int
+check_inode(zx_inode_t *in)
+{
+    zx_extent_t *ex;
+    zx_dx_root_t *root;
+    __u32 i, b, start, len, n = le16toh(in->i_nextents), nblk = 0;
+
+    if (le16toh(in->i_flags) & ZX_INODE_INLINE) {
+        if (!S_ISREG(le16toh(in->i_mode)) || n != 0 || in->i_xblock != 0 ||
+            in->i_blocks != 0 || in->i_dxroot != 0 || le32toh(in->i_size) > ZX_INLINE_MAX) {
+            return BAD_INLINE;
+        }
+        return BAD_NONE;
+    }
+    if (n > ZX_MAX_EXTENTS(map.geo.g_bsize)) {
+        return BAD_NEXTENTS;
+    }
+    if (n > ZX_INODE_EXTENTS && !data_block(le32toh(in->i_xblock))) {
+        return BAD_XBLOCK;
+    }
+    for (i = 0; i < n; i++) {
+        ex = zx_map_extent(&map, in, i);
+        start = le32toh(ex->e_start);
+        len = le32toh(ex->e_len);
+        if (len == 0 || !data_block(start) || !data_block(start + len - 1) ||
+            start + len < start) {
+            return BAD_EXTENT;
+        }
+        nblk += len;
+    }
+    if (nblk != le32toh(in->i_blocks)) {
+        return BAD_BLOCKS;
+    }
+    if (le32toh(in->i_size) > (__u64) nblk * map.geo.g_bsize) {
+        return BAD_SIZE;
+    }
+
+    root = NULL;
+    if (in->i_dxroot != 0) {
+        if (!S_ISDIR(le16toh(in->i_mode)) || !data_block(le32toh(in->i_dxroot))) {
+            return BAD_DXROOT;
+        }
+        root = (zx_dx_root_t *) zx_map_block(&map, le32toh(in->i_dxroot));
+        if (le32toh(root->dx_magic) != ZX_DX_MAGIC ||
+            le32toh(root->dx_order) > ZX_DX_MAX_ORDER) {
+            return BAD_DXROOT;
+        }
+        for (i = 0; i < (1U << le32toh(root->dx_order)); i++) {
+            if (!data_block(le32toh(root->dx_block[i]))) {
+                return BAD_DXROOT;
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        ex = zx_map_extent(&map, in, i);
+        start = le32toh(ex->e_start);
+        for (b = 0; b < le32toh(ex->e_len); b++) {
+            own_block(start + b);
+        }
+    }
+    if (n > ZX_INODE_EXTENTS) {
+        own_block(le32toh(in->i_xblock));
+    }
+    if (root != NULL) {
+        own_block(le32toh(in->i_dxroot));
+        for (i = 0; i < (1U << le32toh(root->dx_order)); i++) {
+            own_block(le32toh(root->dx_block[i]));
+        }
+    }
+
+    return BAD_NONE;
+}
+
+/*
+ * Pass 1: inode table. An inode is in use when it has a mode, a
+ * freed inode is zeroed whatever its bitmap says.
+ */
+static void *
+pass1(void *arg)
+{
+    struct worker *w = (struct worker *) arg;
+    zx_inode_t *in;
+    __u32 ino, first, last;
+    int bad;
+
+    while (next_chunk(&first, &last)) {
+        for (ino = first; ino < last; ino++) {
+            in = zx_map_inode(&map, ino);
+            if (in->i_mode == 0) {
+                continue;
+            }
+            state[ino] = IS_USED | (S_ISDIR(le16toh(in->i_mode)) ? IS_DIR : 0);
+            if (le32toh(in->i_checksum) != zx_inode_csum(in, ino)) {
+                state[ino] |= IS_CSUM;
+            }
+            if ((bad = check_inode(in)) != BAD_NONE) {
+                state[ino] |= bad << IS_BAD_SHIFT;
+                w->err++;
+                continue;
+            }
+            set_bit(imap, ino);
+        }
+    }
+
+    return NULL;
+}
+
+static int
+good_inode(__u32 ino)
+{
+    return ino < map.geo.g_inodes && (state[ino] & IS_USED) &&
+           (state[ino] >> IS_BAD_SHIFT) == BAD_NONE && !(state[ino] & IS_CLEAR);
+}
+
+static int
+add_edge(struct list *l, __u32 parent, __u32 child)
+{
+    struct edge *e;
+
+    if (l->nedge == l->maxedge) {
+        l->maxedge = l->maxedge ? l->maxedge * 2 : 1024;
+        if ((e = (struct edge *) realloc(l->edge, l->maxedge * sizeof(struct edge))) == NULL) {
+            return -1;
+        }
+        l->edge = e;
+    }
+    l->edge[l->nedge].parent = parent;
+    l->edge[l->nedge].child = child;
+    l->nedge++;
+
+    return 0;
+}
+
+/*
+ * Pass 2: directory blocks. Dangling entries are counted here and
+ * reported (and removed) by main thread afterwards.
+ */
+static void *
+pass2(void *arg)
+{
+    struct worker *w = (struct worker *) arg;
+    zx_inode_t *in;
+    zx_extent_t *ex;
+    zx_dirent_t *de;
+    __u32 ino, first, last, i, b, j, child, bs = map.geo.g_bsize;
+
+    while (next_chunk(&first, &last)) {
+        for (ino = first; ino < last; ino++) {
+            if (!(state[ino] & IS_DIR) || !good_inode(ino)) {
+                continue;
+            }
+            in = zx_map_inode(&map, ino);
+            for (i = 0; (ex = zx_map_extent(&map, in, i)) != NULL; i++) {
+                for (b = 0; b < le32toh(ex->e_len); b++) {
+                    de = (zx_dirent_t *) zx_map_block(&map, le32toh(ex->e_start) + b);
+                    if (le32toh(de[ZX_DIR_TAIL(bs)].d_inode) != zx_dir_csum(de, ino, bs) &&
+                        add_edge(&w->csum, ino, le32toh(ex->e_start) + b) == -1) {
+                        return (void *) -1;
+                    }
+                    for (j = 0; j < ZX_DIR_TAIL(bs); j++) {
+                        if (de[j].d_name[0] == '\0' ||
+                            strcmp(de[j].d_name, ".") == 0 ||
+                            strcmp(de[j].d_name, "..") == 0) {
+                            continue;
+                        }
+                        child = le32toh(de[j].d_inode);
+                        if (!good_inode(child)) {
+                            w->err++;
+                        }
+                        if (add_edge(&w->edges, ino, child) == -1) {
+                            return (void *) -1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int
+run(void *(*pass)(void *), struct worker *w)
+{
+    int i, err = 0;
+    void *ret;
+
+    next = 0;
+    for (i = 0; i < nthreads; i++) {
+        w[i].err = 0;
+        if (pthread_create(&w[i].tid, NULL, pass, &w[i]) != 0) {
+            fprintf(stderr, "fsckzx: cannot start thread\n");
+            exit(FSCK_ERROR);
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(w[i].tid, &ret);
+        if (ret != NULL) {
+            fprintf(stderr, "fsckzx: %s\n", strerror(ENOMEM));
+            exit(FSCK_ERROR);
+        }
+        err += w[i].err;
+    }
+
+    return err;
+}
+
+static int
+edge_cmp(const void *a, const void *b)
+{
+    const struct edge *x = (const struct edge *) a;
+    const struct edge *y = (const struct edge *) b;
+
+    if (x->parent != y->parent) {
+        return (x->parent < y->parent) ? -1 : 1;
+    }
+    return (x->child < y->child) ? -1 : (x->child > y->child);
+}
+
+/*
+ * Merge edges (or bad checksum blocks) of every worker into a single
+ * sorted list
+ */
+static struct edge *
+gather(struct worker *w, int csum, __u32 *n)
+{
+    struct list *l;
+    struct edge *edge;
+    size_t total = 0;
+    int t;
+
+    for (t = 0; t < nthreads; t++) {
+        total += csum ? w[t].csum.nedge : w[t].edges.nedge;
+    }
+    if ((edge = (struct edge *) malloc((total + 1) * sizeof(struct edge))) == NULL) {
+        fprintf(stderr, "fsckzx: %s\n", strerror(ENOMEM));
+        exit(FSCK_ERROR);
+    }
+    for (t = 0, total = 0; t < nthreads; t++) {
+        l = csum ? &w[t].csum : &w[t].edges;
+        memcpy(edge + total, l->edge, l->nedge * sizeof(struct edge));
+        total += l->nedge;
+        free(l->edge);
+    }
+    qsort(edge, total, sizeof(struct edge), edge_cmp);
+    *n = total;
+
+    return edge;
+}
+
+/*
+ * Repair writes, all go through wdev and so show up in the mapping
+ */
+static void
+put_inode(__u32 ino, zx_inode_t *in)
+{
+    in->i_checksum = htole32(zx_inode_csum(in, ino));
+    if (zx_dev_pwrite(&wdev, in, ZX_INODE_SIZE,
+                      (off_t) map.geo.g_inode_start * map.geo.g_bsize +
+                      (off_t) ino * ZX_INODE_SIZE) == -1) {
+        fprintf(stderr, "fsckzx: inode %u: %s\n", ino, strerror(errno));
+        exit(FSCK_ERROR);
+    }
+}
+
+static void
+clear_inode(__u32 ino)
+{
+    static const zx_inode_t zero;
+
+    if (zx_dev_pwrite(&wdev, &zero, ZX_INODE_SIZE,
+                      (off_t) map.geo.g_inode_start * map.geo.g_bsize +
+                      (off_t) ino * ZX_INODE_SIZE) == -1) {
+        fprintf(stderr, "fsckzx: inode %u: %s\n", ino, strerror(errno));
+        exit(FSCK_ERROR);
+    }
+    state[ino] |= IS_CLEAR;
+}
+
+/*
+ * Rewrite directory block with entries naming child (all of them
+ * when child is ZX_NO_INODE) removed and checksum recomputed
+ */
+#define ZX_NO_INODE ((__u32) -1)
+
+static void
+put_dirblock(__u32 dir, __u32 bno, __u32 child)
+{
+    zx_dirent_t de[ZX_DIR_PER_BLOCK(ZX_MAX_BLOCK_SIZE)];
+    __u32 j, bs = map.geo.g_bsize;
+
+    memcpy(de, zx_map_block(&map, bno), bs);
+    for (j = 0; child != ZX_NO_INODE && j < ZX_DIR_TAIL(bs); j++) {
+        if (de[j].d_name[0] == '\0' || le32toh(de[j].d_inode) != child ||
+            strcmp(de[j].d_name, ".") == 0 || strcmp(de[j].d_name, "..") == 0) {
+            continue;
+        }
+        memset(&de[j], 0, ZX_DIR_SIZE);
+    }
+    memset(&de[ZX_DIR_TAIL(bs)], 0, ZX_DIR_SIZE);
+    de[ZX_DIR_TAIL(bs)].d_inode = htole32(zx_dir_csum(de, dir, bs));
+    if (zx_dev_pwrite(&wdev, de, bs, (off_t) bno * bs) == -1) {
+        fprintf(stderr, "fsckzx: dir %u block %u: %s\n", dir, bno, strerror(errno));
+        exit(FSCK_ERROR);
+    }
+}
+
+/*
+ * Remove every entry of dir naming child
+ */
+static void
+clear_entry(__u32 dir, __u32 child)
+{
+    zx_inode_t *in = zx_map_inode(&map, dir);
+    zx_extent_t *ex;
+    __u32 i, b;
+
+    for (i = 0; (ex = zx_map_extent(&map, in, i)) != NULL; i++) {
+        for (b = 0; b < le32toh(ex->e_len); b++) {
+            put_dirblock(dir, le32toh(ex->e_start) + b, child);
+        }
+    }
+}
+
+static void
+problem(int fixable, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    if (repair && fixable) {
+        printf(" [fixed]\n");
+        fixed++;
+    } else {
+        printf("\n");
+        errors++;
+    }
+}
+
+/*
+ * Compare rebuilt bitmap against on disk one, returns differing bits
+ */
+static __u32
+bitmap_diff(const char *what, const __u8 *disk, const __u8 *ours, __u32 nbits, __u32 base)
+{
+    __u32 n, ndiff = 0;
+
+    for (n = 0; n < nbits; n++) {
+        if (zx_test_bit(disk, n) == zx_test_bit(ours, n)) {
+            continue;
+        }
+        if (ndiff++ < 8 || verbose) {
+            printf("%s %u marked %s in bitmap but is %s\n", what, base + n,
+                   zx_test_bit(disk, n) ? "used" : "free",
+                   zx_test_bit(ours, n) ? "used" : "free");
+        }
+    }
+    if (ndiff > 8 && !verbose) {
+        printf("... %u %s bitmap differences in all\n", ndiff, what);
+    }
+    return ndiff;
+}
+
+/*
+ * Write rebuilt bitmap over on disk one, bits past nbits are kept
+ */
+static void
+put_bitmap(const __u8 *disk, const __u8 *ours, __u32 nbits, __u32 start, __u32 nblocks)
+{
+    size_t len = (size_t) nblocks * map.geo.g_bsize;
+    __u8 *buf;
+    __u32 n;
+
+    if ((buf = (__u8 *) malloc(len)) == NULL) {
+        fprintf(stderr, "fsckzx: %s\n", strerror(ENOMEM));
+        exit(FSCK_ERROR);
+    }
+    memcpy(buf, disk, len);
+    for (n = 0; n < nbits; n++) {
+        if (zx_test_bit(ours, n)) {
+            buf[n >> 3] |= (__u8) (1 << (n & 7));
+        } else {
+            buf[n >> 3] &= (__u8) ~(1 << (n & 7));
+        }
+    }
+    if (zx_dev_pwrite(&wdev, buf, len, (off_t) start * map.geo.g_bsize) == -1) {
+        fprintf(stderr, "fsckzx: bitmap: %s\n", strerror(errno));
+        exit(FSCK_ERROR);
+    }
+    free(buf);
+}
+
+static void
+usage(void)
+{
+    printf("Usage: fsckzx [-n | -y] [-t threads] [-v] <block device | image>\n");
+    exit(FSCK_ERROR);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct worker *w;
+    struct edge *edge, *csum;
+    zx_inode_t *in, inode;
+    zx_extent_t *ex;
+    zx_super_t sb;
+    zx_group_t *gdt = NULL;
+    zx_bitmap_t ibm, bbm;
+    __u32 *queue, *sub;
+    __u32 ino, i, b, nedge, ncsum, head, tail, lo, hi, mid, nfix = 0;
+    __u32 ninodes, nblocks, ifree, bfree, want, ag, first, n, unused, ipb;
+    size_t ilen, blen;
+    char *dev;
+    int opt, bad;
+
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "nyt:v")) != -1) {
+        switch (opt) {
+            case 'n':
+                repair = 0;
+                break;
+            case 'y':
+                repair = 1;
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+    }
+    dev = argv[optind];
+    if (nthreads < 1) {
+        nthreads = 1;
+    } else if (nthreads > FSCK_THREADS) {
+        nthreads = FSCK_THREADS;
+    }
+
+    journal(dev);
+    if (zx_map_open(&map, dev) == -1) {
+        fprintf(stderr, "fsckzx: %s: %s\n", dev, strerror(errno));
+        return FSCK_ERROR;
+    }
+    if (le32toh(map.sb->s_magic) != ZX_MAGIC_NUMBER || map.geo.g_inodes == 0) {
+        fprintf(stderr, "fsckzx: %s: bad super block (magic %#x)\n", dev, le32toh(map.sb->s_magic));
+        return FSCK_ERROR;
+    }
+    if (repair && zx_dev_open(&wdev, dev, O_RDWR) == -1) {
+        fprintf(stderr, "fsckzx: %s: %s\n", dev, strerror(errno));
+        return FSCK_ERROR;
+    }
+    madvise(map.base, map.len, MADV_SEQUENTIAL);
+
+    ninodes = map.geo.g_inodes;
+    nblocks = map.geo.g_blocks;
+    ilen = (size_t) map.geo.g_imap_blocks * map.geo.g_bsize;
+    blen = (size_t) map.geo.g_bmap_blocks * map.geo.g_bsize;
+    state = (__u16 *) calloc(ninodes, sizeof(__u16));
+    links = (__u16 *) calloc(ninodes, sizeof(__u16));
+    sub = (__u32 *) calloc(ninodes, sizeof(__u32));
+    queue = (__u32 *) malloc(ninodes * sizeof(__u32));
+    imap = (__u8 *) calloc(ilen, 1);
+    bmap = (__u8 *) calloc(blen, 1);
+    dupmap = (__u8 *) calloc(blen, 1);
+    w = (struct worker *) calloc(nthreads, sizeof(struct worker));
+    if (state == NULL || links == NULL || sub == NULL || queue == NULL ||
+        imap == NULL || bmap == NULL || dupmap == NULL || w == NULL) {
+        fprintf(stderr, "fsckzx: %s\n", strerror(ENOMEM));
+        return FSCK_ERROR;
+    }
+    printf("fsckzx: %s: %u inodes, %u blocks, %d threads\n", dev, ninodes, nblocks, nthreads);
+    if (le32toh(map.sb->s_checksum) != zx_super_csum(map.sb)) {
+        problem(1, "super block checksum mismatch");
+        nfix++;
+    }
+
+    /*
+     * Pass 1: inodes
+     */
+    printf("pass 1: inodes and blocks\n");
+    run(pass1, w);
+    for (ino = 0; ino < ninodes; ino++) {
+        if ((bad = state[ino] >> IS_BAD_SHIFT) != BAD_NONE) {
+            problem(ino != ZX_ROOT_INODE, "inode %u: %s, clear", ino, bad_str[bad]);
+            if (repair && ino != ZX_ROOT_INODE) {
+                clear_inode(ino);
+            }
+        } else if (state[ino] & IS_CSUM) {
+            problem(1, "inode %u: checksum mismatch", ino);
+            if (repair) {
+                memcpy(&inode, zx_map_inode(&map, ino), ZX_INODE_SIZE);
+                put_inode(ino, &inode);
+            }
+        }
+    }
+    if (!good_inode(ZX_ROOT_INODE) || !(state[ZX_ROOT_INODE] & IS_DIR)) {
+        printf("root inode %u is not a sane directory, giving up\n", ZX_ROOT_INODE);
+        return FSCK_UNFIXED;
+    }
+    if (zx_bm_count(dupmap, nblocks) > 0) {
+        for (ino = 0; ino < ninodes; ino++) {
+            if (!good_inode(ino)) {
+                continue;
+            }
+            in = zx_map_inode(&map, ino);
+            for (i = 0; (ex = zx_map_extent(&map, in, i)) != NULL; i++) {
+                for (b = le32toh(ex->e_start); b < le32toh(ex->e_start) + le32toh(ex->e_len); b++) {
+                    if (zx_test_bit(dupmap, b - map.geo.g_data_start)) {
+                        problem(0, "inode %u: block %u owned more than once", ino, b);
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * Pass 2: directory entries, gathered into one edge list
+     */
+    printf("pass 2: directories\n");
+    run(pass2, w);
+    csum = gather(w, 1, &ncsum);
+    for (i = 0; i < ncsum; i++) {
+        problem(1, "dir %u: block %u checksum mismatch", csum[i].parent, csum[i].child);
+        if (repair) {
+            put_dirblock(csum[i].parent, csum[i].child, ZX_NO_INODE);
+        }
+    }
+    free(csum);
+    edge = gather(w, 0, &nedge);
+    for (i = 0; i < nedge; i++) {
+        if (!good_inode(edge[i].child)) {
+            problem(1, "dir %u: entry for %s inode %u, remove", edge[i].parent,
+                    (edge[i].child < ninodes && (state[edge[i].child] & IS_USED)) ? "bad" : "free",
+                    edge[i].child);
+            if (repair && (i == 0 || edge[i - 1].parent != edge[i].parent ||
+                           edge[i - 1].child != edge[i].child)) {
+                clear_entry(edge[i].parent, edge[i].child);
+            }
+        }
+    }
+
+    /*
+     * Pass 3: reachability from root, breadth first over the edges
+     * sorted by parent. Only links from reachable directories count.
+     */
+    printf("pass 3: connectivity and links\n");
+    head = tail = 0;
+    queue[tail++] = ZX_ROOT_INODE;
+    state[ZX_ROOT_INODE] |= IS_SEEN;
+    while (head < tail) {
+        ino = queue[head++];
+        for (lo = 0, hi = nedge; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (edge[mid].parent < ino) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (i = lo; i < nedge && edge[i].parent == ino; i++) {
+            if (!good_inode(edge[i].child)) {
+                continue;
+            }
+            if (links[edge[i].child] < 0xffff) {
+                links[edge[i].child]++;
+            }
+            if (state[edge[i].child] & IS_DIR) {
+                sub[ino]++;
+            }
+            if (!(state[edge[i].child] & IS_SEEN)) {
+                state[edge[i].child] |= IS_SEEN;
+                queue[tail++] = edge[i].child;
+            }
+        }
+    }
+    for (ino = 0; ino < ninodes; ino++) {
+        if (!good_inode(ino)) {
+            continue;
+        }
+        in = zx_map_inode(&map, ino);
+        if (!(state[ino] & IS_SEEN)) {
+            problem(1, "inode %u: unreachable, %u links, clear", ino, le16toh(in->i_links));
+            if (repair) {
+                clear_inode(ino);
+            }
+            continue;
+        }
+        want = (state[ino] & IS_DIR) ? 2 + sub[ino] : links[ino];
+        if ((state[ino] & IS_DIR) && links[ino] > 1) {
+            problem(0, "dir %u: has %u parents", ino, links[ino]);
+        }
+        if (le16toh(in->i_links) != want) {
+            problem(1, "inode %u: i_links is %u, should be %u", ino, le16toh(in->i_links), want);
+            if (repair) {
+                memcpy(&inode, in, ZX_INODE_SIZE);
+                inode.i_links = htole16(want);
+                put_inode(ino, &inode);
+            }
+        }
+    }
+
+    /*
+     * Pass 4: bitmaps and free counts. Inodes and blocks of cleared
+     * inodes are taken out of the rebuilt bitmaps first.
+     */
+    printf("pass 4: bitmaps and free counts\n");
+    if (repair) {
+        for (ino = 0; ino < ninodes; ino++) {
+            if (state[ino] & IS_CLEAR) {
+                clear_bit(imap, ino);
+            }
+        }
+        memset(bmap, 0, blen);
+        memset(dupmap, 0, blen);
+        for (ino = 0; ino < ninodes; ino++) {
+            if (good_inode(ino)) {
+                check_inode(zx_map_inode(&map, ino));
+            }
+        }
+    }
+    if (bitmap_diff("inode", map.imap, imap, ninodes, 0) > 0) {
+        problem(1, "inode bitmap differs");
+        nfix++;
+    }
+    if (bitmap_diff("block", map.bmap, bmap, nblocks, map.geo.g_data_start) > 0) {
+        problem(1, "block bitmap differs");
+        nfix++;
+    }
+    ifree = ninodes - zx_bm_count(imap, ninodes);
+    bfree = nblocks - zx_bm_count(bmap, nblocks);
+    if (le32toh(map.sb->s_free_inodes) != ifree) {
+        problem(1, "free inodes count is %u, should be %u", le32toh(map.sb->s_free_inodes), ifree);
+        nfix++;
+    }
+    if (le32toh(map.sb->s_free_blocks) != bfree) {
+        problem(1, "free blocks count is %u, should be %u", le32toh(map.sb->s_free_blocks), bfree);
+        nfix++;
+    }
+
+    /*
+     * Group descriptors are rebuilt from our bitmaps, what part of
+     * inode table is unused is taken as is unless it is impossible,
+     * the same way zx_map_inode() took it in pass 1
+     */
+    if (map.gdt != NULL) {
+        ipb = ZX_INODE_PER_BLOCK(map.geo.g_bsize);
+        if ((gdt = (zx_group_t *) calloc(map.geo.g_gdt_blocks, map.geo.g_bsize)) == NULL) {
+            fprintf(stderr, "fsckzx: %s\n", strerror(ENOMEM));
+            return FSCK_ERROR;
+        }
+        zx_bm_init(&ibm, imap, ninodes);
+        zx_bm_init(&bbm, bmap, nblocks);
+        for (ag = 0; ag < map.geo.g_groups; ag++) {
+            n = zx_geom_ag_inodes(&map.geo, ag, &first);
+            unused = le32toh(map.gdt[ag].gd_itable_unused);
+            if (unused > (n + ipb - 1) / ipb) {
+                unused = 0;
+            }
+            gdt[ag].gd_free_inodes = htole32(n - zx_bm_used(&ibm, first, first + n));
+            gdt[ag].gd_itable_unused = htole32(unused);
+            n = zx_geom_ag_blocks(&map.geo, ag, &first);
+            gdt[ag].gd_free_blocks = htole32(n - zx_bm_used(&bbm, first, first + n));
+            gdt[ag].gd_checksum = htole32(zx_group_csum(&gdt[ag], ag));
+            if (le32toh(map.gdt[ag].gd_checksum) != zx_group_csum(&map.gdt[ag], ag)) {
+                problem(1, "group %u: descriptor checksum mismatch", ag);
+                nfix++;
+            } else if (memcmp(&map.gdt[ag], &gdt[ag], ZX_GROUP_SIZE) != 0) {
+                problem(1, "group %u: free counts are %u/%u, should be %u/%u", ag,
+                        le32toh(map.gdt[ag].gd_free_inodes), le32toh(map.gdt[ag].gd_free_blocks),
+                        le32toh(gdt[ag].gd_free_inodes), le32toh(gdt[ag].gd_free_blocks));
+                nfix++;
+            }
+        }
+    }
+
+    if (repair && nfix > 0) {
+        put_bitmap(map.imap, imap, ninodes, map.geo.g_imap_start, map.geo.g_imap_blocks);
+        put_bitmap(map.bmap, bmap, nblocks, map.geo.g_bmap_start, map.geo.g_bmap_blocks);
+        memcpy(&sb, map.sb, ZX_SUPER_SIZE);
+        sb.s_free_inodes = htole32(ifree);
+        sb.s_free_blocks = htole32(bfree);
+        sb.s_checksum = htole32(zx_super_csum(&sb));
+        if (zx_dev_pwrite(&wdev, &sb, ZX_SUPER_SIZE, ZX_SUPER_OFFSET) == -1) {
+            fprintf(stderr, "fsckzx: super block: %s\n", strerror(errno));
+            return FSCK_ERROR;
+        }
+        if (gdt != NULL &&
+            zx_dev_pwrite(&wdev, gdt, (size_t) map.geo.g_groups * ZX_GROUP_SIZE,
+                          (off_t) map.geo.g_gdt_start * map.geo.g_bsize) == -1) {
+            fprintf(stderr, "fsckzx: group table: %s\n", strerror(errno));
+            return FSCK_ERROR;
+        }
+    }
+    free(gdt);
+
+    printf("fsckzx: %s: %u/%u inodes, %u/%u blocks used\n", dev,
+           ninodes - ifree, ninodes, nblocks - bfree, nblocks);
+    if (repair) {
+        fsync(wdev.fd);
+        zx_dev_close(&wdev);
+    }
+    zx_map_close(&map);
+
+    if (errors > 0) {
+        printf("fsckzx: %d problems left\n", errors);
+        return FSCK_UNFIXED;
+    }
+    if (fixed > 0) {
+        printf("fsckzx: %d problems fixed\n", fixed);
+        return FSCK_FIXED;
+    }
+    return FSCK_OK;
+}
@@ -9,150 +9,814 @@
  *
  *  mkzx - creat zxfs on disk layout on to given block device
  *
+ *  Everything from the start of device up to the last directory block
+ *  is built in memory and goes out in one gathered write, runs of
+ *  zeros (inode table, journal) all point at one zero buffer. Data
+ *  blocks are discarded instead of being written.
+ *
+ *  With -d the file system comes out holding a copy of a host
+ *  directory tree. Tree is walked breadth first and laid out before
+ *  anything is written: inodes in walk order from root on, then all
+ *  directory blocks, then file data, every file in one extent. Copier
+ *  threads (-t) read files in batches of neighbours and write each
+ *  batch with one I/O, metadata goes out last.
+ *
  */
 
+#define _GNU_SOURCE                 /* O_DIRECT */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <string.h>
 #include <errno.h>
 #include <endian.h>
 #include <time.h>
-#include "../../fs/zxfs.h"
+#include <pthread.h>
+#include "../../lib/libzx.h"
+
+#define MKZX_IOV    256                 /* buffers per write */
+#define MKZX_ZERO   (1024 * 1024)       /* bytes of zero buffer */
+#define MKZX_BATCH  (1024 * 1024)       /* bytes of file data a copier writes at a time */
+#define MKZX_BATCH_FILES    256         /* files a copier takes at a time */
+#define MKZX_THREADS        64
+
+#define DIV_ROUND_UP(n, d)  (((n) + (d) - 1) / (d))
+
+/*
+ * File or directory going into the file system, its inode number is
+ * its index in tree[]. Children of a directory sit next to each
+ * other, from first on.
+ */
+struct node {
+    char *path;                         /* on host, NULL for empty root */
+    struct stat st;
+    __u32 parent;
+    __u32 first;                        /* directory: first child */
+    __u32 count;                        /* children */
+    __u32 subdirs;
+    __u32 start;                        /* first data block */
+    __u32 nblk;                         /* 0 for inline file */
+};
+
+/*
+ * Private state of a copier thread
+ */
+struct copier {
+    pthread_t tid;
+    char *buf;                          /* MKZX_BATCH bytes */
+    const char *path;                   /* host file that failed, NULL for device */
+    int err;
+};
+
+static struct iovec iov[MKZX_IOV];
+static int niov;
+static off_t iov_off;                   /* device offset of iov[0] */
+static off_t iov_end;
+static char *zero;
+
+static zx_geom_t geo;
+static zx_dev_t zdev;
+static struct node *tree;
+static __u32 ntree;
+static __u32 maxtree;
+static char *itable;                    /* in memory inode table, inode 0 on */
+static __u32 *files;                    /* files with data to copy, in device order */
+static __u32 nfiles;
+static __u32 *batch;                    /* first file of each batch, one past last at end */
+static __u32 nbatch;
+static __u32 next_batch;                /* next batch to hand out */
+static __u32 dblocks;                   /* directory blocks, first ones of data area */
+
+static void
+usage(void)
+{
+    printf("\tUsage: mkzx [-DKl] [-b <block size>] [-d <directory>] [-g <blocks per group>]"
+           " [-i <inodes>] [-j <journal blocks>] [-s <size>[k|m|g]] [-t <threads>]"
+           " <block_device | image>\n");
+    exit(EXIT_FAILURE);
+}
+
+static void
+fail(const char *dev)
+{
+    fprintf(stderr, "[NOT OK] <%s> %s\n", dev, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Parse size given as bytes with optional k, m or g suffix
+ */
+static off_t
+getsize(const char *arg)
+{
+    char *end;
+    off_t size = strtoll(arg, &end, 10);
+
+    switch (*end) {
+        case 'g': case 'G':
+            size *= 1024;
+        case 'm': case 'M':
+            size *= 1024;
+        case 'k': case 'K':
+            size *= 1024;
+            end++;
+    }
+    if (*end != '\0' || size <= 0) {
+        usage();
+    }
+    return size;
+}
+
+/*
+ * Block aligned buffer of len zero bytes, fit for O_DIRECT
+ */
+static void *
+getbuf(size_t len)
+{
+    void *buf;
+
+    if ((errno = posix_memalign(&buf, ZX_MAX_BLOCK_SIZE, len)) != 0) {
+        return NULL;
+    }
+    memset(buf, 0, len);
+    return buf;
+}
+
+static int
+flush(zx_dev_t *zdev)
+{
+    int n = niov;
+
+    niov = 0;
+    return (n == 0) ? 0 : zx_dev_pwritev(zdev, iov, n, iov_off);
+}
+
+/*
+ * Queue len bytes of buf for offset off, what is queued goes out
+ * when off does not follow it or iov is full
+ */
+static int
+gather(zx_dev_t *zdev, void *buf, size_t len, off_t off)
+{
+    if (niov > 0 && (off != iov_end || niov == MKZX_IOV) && flush(zdev) == -1) {
+        return -1;
+    }
+    if (niov == 0) {
+        iov_off = off;
+    }
+    iov[niov].iov_base = buf;
+    iov[niov++].iov_len = len;
+    iov_end = off + len;
+    return 0;
+}
+
+static int
+gather_zero(zx_dev_t *zdev, off_t len, off_t off)
+{
+    size_t n;
+
+    for (; len > 0; len -= n, off += n) {
+        n = (len < MKZX_ZERO) ? len : MKZX_ZERO;
+        if (gather(zdev, zero, n, off) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Set first n bits of bitmap
+ */
+static void
+setbits(char *map, __u32 n)
+{
+    memset(map, 0xff, n / 8);
+    if (n % 8 != 0) {
+        map[n / 8] = (1 << (n % 8)) - 1;
+    }
+}
+
+static void
+add(char *path, const struct stat *st, __u32 parent)
+{
+    struct node *n;
+
+    if (ntree == maxtree) {
+        maxtree = (maxtree == 0) ? 1024 : maxtree * 2;
+        if ((n = (struct node *) realloc(tree, maxtree * sizeof(struct node))) == NULL) {
+            fail(path);
+        }
+        tree = n;
+    }
+    n = &tree[ntree++];
+    memset(n, 0, sizeof(struct node));
+    n->path = path;
+    n->st = *st;
+    n->parent = parent;
+}
+
+/*
+ * Root directory of an empty file system
+ */
+static void
+empty_root(void)
+{
+    struct stat st;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    st.st_uid = ZX_ROOT_UID;
+    st.st_gid = ZX_ROOT_GID;
+    st.st_atime = st.st_mtime = st.st_ctime = time(NULL);
+    add(NULL, &st, ZX_ROOT_INODE);
+}
+
+/*
+ * Walk host directory breadth first, entries of a directory in name
+ * order so the same tree always gives the same image. Only regular
+ * files and directories are taken.
+ */
+static void
+scan(const char *dir)
+{
+    struct dirent **ent;
+    struct stat st;
+    char *path;
+    size_t len;
+    __u32 i;
+    int j, n;
+
+    if (stat(dir, &st) == -1) {
+        fail(dir);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        fail(dir);
+    }
+    if ((path = strdup(dir)) == NULL) {
+        fail(dir);
+    }
+    add(path, &st, ZX_ROOT_INODE);
+
+    for (i = 0; i < ntree; i++) {
+        if (!S_ISDIR(tree[i].st.st_mode)) {
+            continue;
+        }
+        if ((n = scandir(tree[i].path, &ent, NULL, alphasort)) == -1) {
+            fail(tree[i].path);
+        }
+        tree[i].first = ntree;
+        for (j = 0; j < n; j++) {
+            len = strlen(ent[j]->d_name);
+            if (strcmp(ent[j]->d_name, ".") == 0 || strcmp(ent[j]->d_name, "..") == 0) {
+                free(ent[j]);
+                continue;
+            }
+            if ((path = (char *) malloc(strlen(tree[i].path) + len + 2)) == NULL) {
+                fail(tree[i].path);
+            }
+            sprintf(path, "%s/%s", tree[i].path, ent[j]->d_name);
+            free(ent[j]);
+            if (len >= ZX_MAX_NAME) {
+                errno = ENAMETOOLONG;
+                fail(path);
+            }
+            if (lstat(path, &st) == -1) {
+                fail(path);
+            }
+            if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+                printf("[SKIP]\t%s is not a regular file or directory\n", path);
+                free(path);
+                continue;
+            }
+            if (S_ISREG(st.st_mode) && st.st_size > UINT32_MAX) {
+                errno = EFBIG;
+                fail(path);
+            }
+            tree[i].subdirs += S_ISDIR(st.st_mode);
+            add(path, &st, i);
+        }
+        tree[i].count = ntree - tree[i].first;
+        free(ent);
+    }
+}
+
+/*
+ * Give every directory and every file too big to be inline its blocks,
+ * directories first. Files with data are split in batches of
+ * neighbours for the copiers. Returns data blocks used.
+ */
+static __u64
+layout(void)
+{
+    __u32 bs = geo.g_bsize;
+    __u64 next = geo.g_data_start;
+    size_t bytes = 0;
+    __u32 i;
+
+    for (i = 0; i < ntree; i++) {
+        if (S_ISDIR(tree[i].st.st_mode)) {
+            tree[i].start = next;
+            tree[i].nblk = DIV_ROUND_UP(tree[i].count + 2, ZX_DIR_TAIL(bs));
+            next += tree[i].nblk;
+        }
+    }
+    dblocks = next - geo.g_data_start;
+
+    if ((files = (__u32 *) malloc(ntree * sizeof(__u32))) == NULL ||
+        (batch = (__u32 *) malloc((ntree + 1) * sizeof(__u32))) == NULL) {
+        fail("layout");
+    }
+    for (i = 0; i < ntree; i++) {
+        if (!S_ISREG(tree[i].st.st_mode) || tree[i].st.st_size == 0) {
+            continue;
+        }
+        if (tree[i].st.st_size > ZX_INLINE_MAX) {
+            tree[i].start = next;
+            tree[i].nblk = DIV_ROUND_UP(tree[i].st.st_size, bs);
+            next += tree[i].nblk;
+        }
+        if (nbatch == 0 || bytes >= MKZX_BATCH ||
+            nfiles - batch[nbatch - 1] == MKZX_BATCH_FILES) {
+            batch[nbatch++] = nfiles;
+            bytes = 0;
+        }
+        files[nfiles++] = i;
+        bytes += (size_t) tree[i].nblk * bs;
+    }
+    batch[nbatch] = nfiles;
+
+    return next - geo.g_data_start;
+}
+
+/*
+ * Read len bytes at off of host file, one that got shorter since it
+ * was looked at is an I/O error
+ */
+static int
+readall(int fd, char *buf, size_t len, off_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = pread(fd, buf, len, off)) <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Copy files of batch b. Their blocks follow each other on device, so
+ * buffer goes out whenever it is full and once at the end. Inline
+ * files are read straight into their inode.
+ */
+static int
+copy(struct copier *c, __u32 b)
+{
+    struct node *n;
+    zx_inode_t *in;
+    off_t base = 0, pos, end;
+    size_t off = 0, len, want;
+    __u32 i, bs = geo.g_bsize;
+    int fd, err;
+
+    for (i = batch[b]; i < batch[b + 1]; i++) {
+        n = &tree[files[i]];
+        c->path = n->path;
+        if ((fd = open(n->path, O_RDONLY)) == -1) {
+            return -1;
+        }
+        if (n->nblk == 0) {
+            in = (zx_inode_t *) (itable + (size_t) files[i] * ZX_INODE_SIZE);
+            if (readall(fd, (char *) in->i_pad, n->st.st_size, 0) == -1) {
+                goto fail;
+            }
+        }
+        end = (off_t) n->nblk * bs;
+        for (pos = 0; pos < end; pos += len) {
+            if (off == 0) {
+                base = (off_t) n->start * bs + pos;
+            }
+            len = (end - pos < (off_t) (MKZX_BATCH - off)) ? end - pos : MKZX_BATCH - off;
+            want = (pos >= n->st.st_size) ? 0 :
+                   (n->st.st_size - pos < (off_t) len) ? n->st.st_size - pos : len;
+            if (readall(fd, c->buf + off, want, pos) == -1) {
+                goto fail;
+            }
+            memset(c->buf + off + want, 0, len - want);
+            off += len;
+            if (off == MKZX_BATCH) {
+                c->path = NULL;
+                if (zx_dev_pwrite(&zdev, c->buf, off, base) == -1) {
+                    goto fail;
+                }
+                c->path = n->path;
+                off = 0;
+            }
+        }
+        close(fd);
+    }
+
+    c->path = NULL;
+    return (off == 0) ? 0 : zx_dev_pwrite(&zdev, c->buf, off, base);
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+static void *
+copier(void *arg)
+{
+    struct copier *c = (struct copier *) arg;
+    __u32 b;
+
+    while ((b = __atomic_fetch_add(&next_batch, 1, __ATOMIC_RELAXED)) < nbatch) {
+        if (copy(c, b) == -1) {
+            c->err = errno;
+            __atomic_store_n(&next_batch, nbatch, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void
+fill_inode(__u32 ino)
+{
+    struct node *n = &tree[ino];
+    zx_inode_t *in = (zx_inode_t *) (itable + (size_t) ino * ZX_INODE_SIZE);
+
+    in->i_mode = htole16(n->st.st_mode & (S_IFMT | 07777));
+    in->i_links = htole16(S_ISDIR(n->st.st_mode) ? ZX_ROOT_INIT_LNKS + n->subdirs : 1);
+    in->i_atime = htole32(n->st.st_atime);
+    in->i_mtime = htole32(n->st.st_mtime);
+    in->i_ctime = htole32(n->st.st_ctime);
+    in->i_uid = htole16(n->st.st_uid);
+    in->i_gid = htole16(n->st.st_gid);
+    if (S_ISDIR(n->st.st_mode)) {
+        in->i_size = htole32(n->nblk * geo.g_bsize);
+    } else {
+        in->i_size = htole32(n->st.st_size);
+    }
+    if (n->nblk != 0) {
+        in->i_blocks = htole32(n->nblk);
+        in->i_extent[0].e_start = htole32(n->start);
+        in->i_extent[0].e_len = htole32(n->nblk);
+        in->i_nextents = htole16(1);
+    } else {
+        in->i_flags = htole16(ZX_INODE_INLINE);
+    }
+    in->i_checksum = htole32(zx_inode_csum(in, ino));
+}
+
+/*
+ * . and .. then children in walk order, de holds all blocks of
+ * directory
+ */
+static void
+fill_dir(__u32 ino, zx_dirent_t *de)
+{
+    struct node *n = &tree[ino];
+    zx_dirent_t *d;
+    const char *name;
+    __u32 bs = geo.g_bsize;
+    __u32 i, c;
+
+    for (i = 0; i < n->count + 2; i++) {
+        d = &de[(i / ZX_DIR_TAIL(bs)) * ZX_DIR_PER_BLOCK(bs) + i % ZX_DIR_TAIL(bs)];
+        if (i < 2) {
+            d->d_inode = htole32(i == 0 ? ino : n->parent);
+            strcpy(d->d_name, i == 0 ? "." : "..");
+            continue;
+        }
+        c = n->first + i - 2;
+        name = strrchr(tree[c].path, '/') + 1;
+        d->d_inode = htole32(c);
+        memcpy(d->d_name, name, strlen(name));
+    }
+    for (i = 0; i < n->nblk; i++) {
+        d = &de[i * ZX_DIR_PER_BLOCK(bs)];
+        d[ZX_DIR_TAIL(bs)].d_inode = htole32(zx_dir_csum(d, ino, bs));
+    }
+}
 
 int
 main(int argc, char *argv[])
 {
-    zx_super_t sb;
-    zx_inode_t ri;
-    zx_dirent_t dir;
+    zx_super_t *sb;
+    zx_dirent_t *dir;
+    zx_jsuper_t *js;
+    zx_group_t *gd;
+    struct copier *cp;
     char *dev;
+    char *src = NULL;
+    char *meta;
     struct stat stbuf;
-    int fd;
+    off_t size = 0;
+    size_t len;
+    __u64 used;
+    __u32 bsize = ZX_DEF_BLOCK_SIZE;
+    __u32 inodes = 0;
+    __u32 jnl = ZX_JNL_BLOCKS;
+    __u32 ag_blocks = 0;
+    __u32 ag, n, first, ipb, iblocks, i;
+    int direct = 0, discard = 1, lazy = 0;
+    int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int fd, opt, t;
 
     /*
      * Check for correct arguments
-     */ 
-    if (argc != 2) {
-        printf("\tUsage: mkzx <block_device>\n");
-        return EXIT_FAILURE;
+     */
+    while ((opt = getopt(argc, argv, "DKlb:d:g:i:j:s:t:")) != -1) {
+        switch (opt) {
+            case 'D':
+                direct = 1;
+                break;
+            case 'K':
+                discard = 0;
+                break;
+            case 'l':
+                lazy = 1;
+                break;
+            case 'b':
+                bsize = strtoul(optarg, NULL, 10);
+                if (zx_geom_bshift(bsize) == -1) {
+                    usage();
+                }
+                break;
+            case 'd':
+                src = optarg;
+                break;
+            case 'g':
+                if ((ag_blocks = strtoul(optarg, NULL, 10)) == 0) {
+                    usage();
+                }
+                break;
+            case 'i':
+                if ((inodes = strtoul(optarg, NULL, 10)) == 0) {
+                    usage();
+                }
+                break;
+            case 'j':
+                jnl = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                size = getsize(optarg);
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    } else if (nthreads > MKZX_THREADS) {
+        nthreads = MKZX_THREADS;
     }
     printf("[OK]\targuments verified\n");
 
-    dev = argv[1];
+    dev = argv[optind];
     /*
-     * Let's verify that it is indeed a block device
+     * Let's verify that it is a block device or an image file, image
+     * file is created or grown (sparse) to size given by -s
      */
     if (stat(dev, &stbuf) == -1) {
-        fprintf(stderr, "[NOT OK] <%s> %s\n", dev, strerror(errno));
-        exit(EXIT_FAILURE);
+        if (errno != ENOENT || size == 0) {
+            fail(dev);
+        }
+        stbuf.st_mode = S_IFREG;
+        stbuf.st_size = 0;
     }
     printf("[OK]\table to stat given device [%s]\n", dev);
 
-    if (!S_ISBLK(stbuf.st_mode)) {
-        fprintf(stderr, "[NOT OK] <%s> is not a block device\n", dev);
+    if (S_ISREG(stbuf.st_mode)) {
+        if (size > stbuf.st_size) {
+            if ((fd = open(dev, O_WRONLY | O_CREAT, 0644)) == -1 ||
+                ftruncate(fd, size) == -1) {
+                fail(dev);
+            }
+            close(fd);
+        }
+        printf("[OK]\tconfirmed that device [%s] is an image file\n", dev);
+    } else if (S_ISBLK(stbuf.st_mode)) {
+        printf("[OK]\tconfirmed that device [%s] is a block device\n", dev);
+    } else {
+        fprintf(stderr, "[NOT OK] <%s> is not a block device or image file\n", dev);
         exit(EXIT_FAILURE);
     }
-    printf("[OK]\tconfirmed that device [%s] is a block device\n", dev);
 
-    if ((fd = open(dev, O_WRONLY)) == -1) {
-        fprintf(stderr, "[NOT OK] <%s> %s\n", dev, strerror(errno));
-        exit(EXIT_FAILURE);
+    if (zx_dev_open(&zdev, dev, O_RDWR | (direct ? O_DIRECT : 0)) == -1) {
+        fail(dev);
     }
     printf("[OK]\table to open given device [%s]\n", dev);
 
+    if (src != NULL) {
+        scan(src);
+        printf("[OK]\tfound %u files and directories in [%s]\n", ntree, src);
+    } else {
+        empty_root();
+    }
+
     /*
-     * Make sure we have enough space on device 
+     * Make sure we have enough space on device and lay out
+     * bitmaps, inode table and data blocks on it. Default number of
+     * inodes grows to what the tree needs.
      */
-    if (lseek(fd, (ZX_BLOCK_SIZE * ZX_SEEK_BLOCKS), SEEK_SET) == (off_t) -1) {
-        fprintf(stderr, "[NOT OK] <%s> %s\n", dev, strerror(errno));
-        exit(EXIT_FAILURE);
+    if (size == 0) {
+        size = zdev.size;
+    }
+    if (size > zdev.size) {
+        errno = ENOSPC;
+        fail(dev);
+    }
+    if (zx_geom_make(&geo, bsize, size / bsize, inodes, jnl, ag_blocks) == -1 ||
+        (inodes == 0 && geo.g_inodes < ntree &&
+         zx_geom_make(&geo, bsize, size / bsize, ntree, jnl, ag_blocks) == -1)) {
+        fail(dev);
+    }
+    if (geo.g_inodes < ntree || (used = layout()) > geo.g_blocks) {
+        errno = ENOSPC;
+        fail(dev);
     }
     printf("[OK]\tconfirmed that device [%s] has desired space\n", dev);
+    printf("[OK]\t%u byte blocks, %u inodes, %u data blocks, %u journal blocks\n",
+           bsize, geo.g_inodes, geo.g_blocks, geo.g_jnl_blocks);
+    printf("[OK]\t%u allocation groups of %u inodes, %u data blocks\n",
+           geo.g_groups, geo.g_ag_inodes, geo.g_ag_blocks);
 
     /*
-     * Fill super block structure and then write it on disk
+     * Free data blocks hold nothing yet, let device (or file system
+     * under image file) drop whatever it keeps for them
      */
-    memset(&sb, 0, ZX_SUPER_SIZE);
-    sb.s_magic = htole32(ZX_MAGIC_NUMBER);
-    sb.s_state = ZX_VALID_FS;
-    sb.s_free_inodes = ZX_MAX_INODES - 1;
-    sb.s_inode_list = 0;
-    SET_BIT(sb.s_inode_list, 0);
-    sb.s_free_blocks = ZX_MAX_BLOCKS - 1;
-    SET_BIT(sb.s_block_list[0], 0);
-
-    if (lseek(fd, (ZX_BLOCK_SIZE * ZX_SUPER_START), SEEK_SET) == (off_t) -1) {
-        fprintf(stderr, "[NOT OK] <%s> %s\n", dev, strerror(errno));
-        exit(EXIT_FAILURE);
+    if (discard && geo.g_blocks > used) {
+        if (zx_dev_discard(&zdev, (off_t) (geo.g_data_start + used) * bsize,
+                           (off_t) (geo.g_blocks - used) * bsize) == 0) {
+            printf("[OK]\tdiscarded data blocks on device [%s]\n", dev);
+        }
     }
 
-    if (write(fd, &sb, ZX_SUPER_SIZE) == -1) {
-        fprintf(stderr, "[NOT OK] <%s> %s\n", dev, strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-    printf("[OK]\twrote super block on device [%s]\n", dev);
-
     /*
-     * Fill inode structure for root directory and then 
-     * write it on disk
+     * Everything up to and including the inode table blocks holding
+     * inodes in use is built in one buffer, all directory blocks in
+     * another. Whatever sits in the skip area is kept.
      */
-    memset(&ri, 0, ZX_INODE_SIZE);
-    ri.i_mode = (S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
-    ri.i_links = ZX_ROOT_INIT_LNKS;
-    ri.i_atime = time(NULL);
-    ri.i_mtime = time(NULL);
-    ri.i_ctime = time(NULL);
-    ri.i_uid = ZX_ROOT_UID;
-    ri.i_gid = ZX_ROOT_GID;
-    ri.i_size = ZX_BLOCK_SIZE;
-    ri.i_blocks = ZX_ROOT_INIT_BLKS;
-    ri.i_block[0] = ZX_DATA_START * ZX_BLOCK_SIZE;
-
-    if (lseek(fd, (ZX_INODE_START * ZX_BLOCK_SIZE), SEEK_SET) == (off_t) -1) {
-        fprintf(stderr, "[NOT OK] <%s> %s\n", dev, strerror(errno));
-        exit(EXIT_FAILURE);
+    ipb = ZX_INODE_PER_BLOCK(bsize);
+    iblocks = DIV_ROUND_UP(ntree, ipb);
+    len = (size_t) (geo.g_inode_start + iblocks) * bsize;
+    if ((meta = (char *) getbuf(len)) == NULL ||
+        (zero = (char *) getbuf(MKZX_ZERO)) == NULL ||
+        (dir = (zx_dirent_t *) getbuf((size_t) dblocks * bsize)) == NULL ||
+        (js = (zx_jsuper_t *) getbuf(bsize)) == NULL) {
+        fail(dev);
     }
+    if (zx_dev_pread(&zdev, meta, (size_t) geo.g_imap_start * bsize, 0) == -1) {
+        fail(dev);
+    }
+    memset(meta + ZX_SUPER_OFFSET, 0, len - ZX_SUPER_OFFSET);
+    itable = meta + (size_t) geo.g_inode_start * bsize;
 
-    if (write(fd, &ri, ZX_INODE_SIZE) == -1) {
-        fprintf(stderr, "[NOT OK] <%s> %s\n", dev, strerror(errno));
-        exit(EXIT_FAILURE);
+    /*
+     * File data goes first, so that nothing passes for the file system
+     * before all of it is there
+     */
+    if (nfiles != 0) {
+        if ((__u32) nthreads > nbatch) {
+            nthreads = nbatch;
+        }
+        if ((cp = (struct copier *) calloc(nthreads, sizeof(struct copier))) == NULL) {
+            fail(dev);
+        }
+        for (t = 0; t < nthreads; t++) {
+            if ((cp[t].buf = (char *) getbuf(MKZX_BATCH)) == NULL ||
+                (errno = pthread_create(&cp[t].tid, NULL, copier, &cp[t])) != 0) {
+                fail(dev);
+            }
+        }
+        for (t = 0; t < nthreads; t++) {
+            pthread_join(cp[t].tid, NULL);
+        }
+        for (t = 0; t < nthreads; t++) {
+            if (cp[t].err != 0) {
+                errno = cp[t].err;
+                fail(cp[t].path != NULL ? cp[t].path : dev);
+            }
+            free(cp[t].buf);
+        }
+        free(cp);
+        printf("[OK]\tcopied %u files, %llu data blocks with %d threads on device [%s]\n",
+               nfiles, (unsigned long long) (used - dblocks), nthreads, dev);
     }
-    printf("[OK]\twrote root inode on device [%s]\n", dev);
 
     /*
-     * Now we create both . and .. directory entries and make it
-     * point to root inode
+     * Fill super block structure
      */
-    memset(&dir, 0, ZX_DIR_SIZE);
-    dir.d_inode = ZX_ROOT_INODE;
-    strcpy(dir.d_name, ".");
+    sb = (zx_super_t *) (meta + ZX_SUPER_OFFSET);
+    sb->s_magic = htole32(ZX_MAGIC_NUMBER);
+    sb->s_state = htole32(ZX_VALID_FS);
+    sb->s_free_inodes = htole32(geo.g_inodes - ntree);
+    sb->s_free_blocks = htole32(geo.g_blocks - used);
+    zx_geom_store(&geo, sb);
+    sb->s_checksum = htole32(zx_super_csum(sb));
 
-    if (lseek(fd, (ZX_DATA_START * ZX_BLOCK_SIZE), SEEK_SET) == (off_t) -1) {
-        fprintf(stderr, "[NOT OK] <%s> %s\n", dev, strerror(errno));
-        exit(EXIT_FAILURE);
+    /*
+     * Inodes and blocks in use are the first ones of the device, they
+     * fill groups in order. With -l only inode table blocks holding
+     * inodes in use are written.
+     */
+    gd = (zx_group_t *) (meta + (size_t) geo.g_gdt_start * bsize);
+    for (ag = 0; ag < geo.g_groups; ag++) {
+        n = zx_geom_ag_inodes(&geo, ag, &first);
+        i = (ntree <= first) ? 0 : (ntree - first < n) ? ntree - first : n;
+        gd[ag].gd_free_inodes = htole32(n - i);
+        gd[ag].gd_itable_unused = htole32(lazy ? DIV_ROUND_UP(n, ipb) - DIV_ROUND_UP(i, ipb) : 0);
+        n = zx_geom_ag_blocks(&geo, ag, &first);
+        i = (used <= first) ? 0 : (used - first < n) ? used - first : n;
+        gd[ag].gd_free_blocks = htole32(n - i);
+        gd[ag].gd_checksum = htole32(zx_group_csum(&gd[ag], ag));
     }
 
-    if (write(fd, &dir, ZX_DIR_SIZE) == -1) {
-        fprintf(stderr, "[NOT OK] <%s> %s\n", dev, strerror(errno));
-        exit(EXIT_FAILURE);
+    setbits(meta + (size_t) geo.g_imap_start * bsize, ntree);
+    setbits(meta + (size_t) geo.g_bmap_start * bsize, used);
+
+    /*
+     * Inodes, root directory being the first one, and directory
+     * blocks
+     */
+    for (i = 0; i < ntree; i++) {
+        fill_inode(i);
+        if (S_ISDIR(tree[i].st.st_mode)) {
+            fill_dir(i, &dir[(size_t) (tree[i].start - geo.g_data_start) *
+                             ZX_DIR_PER_BLOCK(bsize)]);
+        }
     }
 
-    memset(&dir, 0, ZX_DIR_SIZE);
-    dir.d_inode = ZX_ROOT_INODE;
-    strcpy(dir.d_name, "..");
+    /*
+     * Journal starts empty, log is cleared so that nothing left on
+     * device can pass for a transaction
+     */
+    js->j_magic = htole32(ZX_JNL_MAGIC);
+    js->j_blocks = htole32(geo.g_jnl_blocks);
+    js->j_head = htole32(1);
+    js->j_seq = htole32(1);
+    js->j_checksum = htole32(zx_jsuper_csum(js));
 
-    if (write(fd, &dir, ZX_DIR_SIZE) == -1) {
-        fprintf(stderr, "[NOT OK] <%s> %s\n", dev, strerror(errno));
-        exit(EXIT_FAILURE);
+    /*
+     * Rest of inode table is cleared unless it is left for the engine
+     * to clear as inodes get used (-l), see gd_itable_unused
+     */
+    if (gather(&zdev, meta, len, 0) == -1 ||
+        (!lazy && gather_zero(&zdev, (off_t) (geo.g_inode_blocks - iblocks) * bsize, len) == -1) ||
+        (geo.g_jnl_blocks != 0 &&
+         (gather(&zdev, js, bsize, (off_t) geo.g_jnl_start * bsize) == -1 ||
+          gather_zero(&zdev, (off_t) (geo.g_jnl_blocks - 1) * bsize,
+                      (off_t) (geo.g_jnl_start + 1) * bsize) == -1)) ||
+        gather(&zdev, dir, (size_t) dblocks * bsize, (off_t) geo.g_data_start * bsize) == -1 ||
+        flush(&zdev) == -1) {
+        fail(dev);
+    }
+    printf("[OK]\twrote super block, bitmaps, %u inodes%s and %u directory blocks on device [%s]\n",
+           ntree, (geo.g_jnl_blocks != 0) ? ", journal" : "", dblocks, dev);
+    if (lazy) {
+        printf("[OK]\tinode table is left to be initialized as it is used\n");
     }
-    printf("[OK]\twrote directory entry for . & .. on device [%s]\n", dev);
 
-    close(fd);
-    
+    for (i = 0; i < ntree; i++) {
+        free(tree[i].path);
+    }
+    free(tree);
+    free(files);
+    free(batch);
+    free(meta);
+    free(zero);
+    free(dir);
+    free(js);
+    zx_dev_close(&zdev);
+
     printf("[OK]\tzxfs file system created on device [%s]\n", dev);
     printf("[OK]\tall done\n");
 